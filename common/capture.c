@@ -0,0 +1,167 @@
+/*
+ * Copyright 2015 Gauthier Voron
+ * This file is part of rwmsr.
+ *
+ * Rwmsr is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Rwmsr is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with rwmsr. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "capture.h"
+#include "rwmsr.h"
+
+
+#define CAPTURE_BUFFER_SIZE  (1 << 20)
+
+
+static FILE      *capture = NULL;
+
+static uint64_t   capture_start;
+
+static msrval_t  *capture_values = NULL;
+
+static size_t     capture_size = 0;
+
+
+static uint64_t capture_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ul + ts.tv_nsec;
+}
+
+int8_t capture_open(const char *path)
+{
+	struct capture_header header;
+	size_t numcore, maxid, i;
+	uint32_t *sockets;
+	uint8_t *cores;
+
+	if (coreinfo(&numcore, &maxid))
+		return -1;
+
+	sockets = calloc(maxid + 1, sizeof (uint32_t));
+	cores = malloc((maxid + 1) * sizeof (uint8_t));
+	if (!sockets || !cores)
+		goto err;
+
+	memset(&header, 0, sizeof (header));
+	memcpy(header.magic, CAPTURE_MAGIC, sizeof (header.magic));
+	header.numcore = numcore;
+	header.maxid = maxid;
+
+	for (i=0; i<=maxid; i++)
+		cores[i] = i;
+	if (!socketinfo(sockets, cores, maxid + 1))
+		header.flags |= CAPTURE_SOCKETS;
+	else
+		memset(sockets, 0, (maxid + 1) * sizeof (uint32_t));
+
+	capture = fopen(path, "w");
+	if (!capture)
+		goto err;
+	setvbuf(capture, NULL, _IOFBF, CAPTURE_BUFFER_SIZE);
+
+	fwrite(&header, sizeof (header), 1, capture);
+	fwrite(sockets, sizeof (uint32_t), maxid + 1, capture);
+	if (ferror(capture)) {
+		capture_close();
+		goto err;
+	}
+
+	free(sockets);
+	free(cores);
+	capture_start = capture_now();
+	return 0;
+ err:
+	free(sockets);
+	free(cores);
+	return -1;
+}
+
+uint8_t capture_enabled(void)
+{
+	return capture != NULL;
+}
+
+const msrval_t *capture_stash(const msrval_t *vals, size_t len)
+{
+	msrval_t *tmp;
+
+	if (len > capture_size) {
+		tmp = realloc(capture_values, len * sizeof (msrval_t));
+		if (!tmp)
+			return NULL;
+		capture_values = tmp;
+		capture_size = len;
+	}
+
+	memcpy(capture_values, vals, len * sizeof (msrval_t));
+	return capture_values;
+}
+
+const msrval_t *capture_merge(const msrval_t *olds, const msrval_t *masks,
+			      size_t len)
+{
+	size_t i;
+
+	for (i=0; i<len; i++)
+		capture_values[i] = (olds[i] & ~masks[i])
+			| (capture_values[i] & masks[i]);
+	return capture_values;
+}
+
+void capture_write(uint8_t type, const msradr_t *addrs, const msrval_t *vals,
+		   const msrval_t *written, const uint8_t *cores, size_t len,
+		   const uint64_t *success, size_t done)
+{
+	struct capture_record record;
+	uint64_t now = capture_now() - capture_start;
+	size_t i;
+
+	if (!capture)
+		return;
+
+	memset(&record, 0, sizeof (record));
+	record.time = now;
+	record.type = type;
+
+	for (i=0; i<len; i++) {
+		record.address = addrs[i];
+		record.core = cores[i];
+		record.value = vals ? vals[i] : 0;
+		record.written = written ? written[i] : 0;
+		if (success)
+			record.success = (success[i / 64] >> (i % 64)) & 1;
+		else
+			record.success = (done == len);
+		fwrite(&record, sizeof (record), 1, capture);
+	}
+}
+
+void capture_close(void)
+{
+	if (capture)
+		fclose(capture);
+	capture = NULL;
+
+	free(capture_values);
+	capture_values = NULL;
+	capture_size = 0;
+}
@@ -0,0 +1,306 @@
+/*
+ * Copyright 2015 Gauthier Voron
+ * This file is part of rwmsr.
+ *
+ * Rwmsr is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Rwmsr is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with rwmsr. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <ctype.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "control.h"
+#include "event.h"
+#include "parse.h"
+
+
+#define CONTROL_BACKLOG   4
+#define CONTROL_CLIENTS   4
+#define CONTROL_LINE_MAX  256
+#define CONTROL_REPLY_MAX 512
+
+
+struct control_client
+{
+	int     fd;
+	size_t  len;
+	char    line[CONTROL_LINE_MAX];
+};
+
+
+static int                    control_fd = -1;
+
+static struct sockaddr_un     control_path;
+
+static struct control_client  control_clients[CONTROL_CLIENTS];
+
+static struct control_op     *control_ops = NULL;
+
+static size_t                 control_nops = 0;
+
+static size_t                 control_size = 0;
+
+
+static void send_line(int fd, const char *line)
+{
+	send(fd, line, strlen(line), MSG_NOSIGNAL | MSG_DONTWAIT);
+}
+
+void control_reply(const struct control_op *op, const char *format, ...)
+{
+	char buffer[CONTROL_REPLY_MAX];
+	va_list ap;
+
+	if (op->client < 0)
+		return;
+
+	va_start(ap, format);
+	vsnprintf(buffer, sizeof (buffer) - 1, format, ap);
+	va_end(ap);
+	strcat(buffer, "\n");
+
+	send_line(op->client, buffer);
+}
+
+/*
+ * Parse an index argument ending the string or followed by a space.
+ * Return the address of the first character following the index, or NULL
+ * if the argument is not an index.
+ */
+static const char *parse_index(size_t *dest, const char *str)
+{
+	char *end;
+
+	if (!isdigit((unsigned char) *str))
+		return NULL;
+
+	*dest = strtoul(str, &end, 10);
+	if (*end != '\0' && *end != ' ')
+		return NULL;
+	return end;
+}
+
+/*
+ * Parse a line received from a client and queue the operation.
+ * Return NULL in case of success, or an error message.
+ */
+static const char *parse_line(int fd, const char *line)
+{
+	struct control_op op, *tmp;
+	const char *ptr;
+	size_t repeat;
+
+	memset(&op, 0, sizeof (op));
+	op.client = fd;
+
+	if (!strncmp(line, "add ", 4)) {
+		op.type = CONTROL_ADD;
+		if (parse_command(&op.command, line + 4))
+			return "invalid command";
+		if (op.command.stride)
+			return "unsupported command range";
+	} else if (!strncmp(line, "remove ", 7)) {
+		op.type = CONTROL_REMOVE;
+		ptr = parse_index(&op.index, line + 7);
+		if (!ptr || *ptr)
+			return "invalid index";
+	} else if (!strncmp(line, "period ", 7)) {
+		op.type = CONTROL_PERIOD;
+		ptr = parse_index(&op.index, line + 7);
+		if (!ptr || *ptr != ' ')
+			return "invalid index";
+		ptr = parse_index(&repeat, ptr + 1);
+		if (!ptr || *ptr || repeat > UINT32_MAX)
+			return "invalid period";
+		op.repeat = repeat;
+	} else if (!strcmp(line, "list")) {
+		op.type = CONTROL_LIST;
+	} else {
+		return "unknown operation";
+	}
+
+	if (control_nops == control_size) {
+		control_size = control_size ? control_size * 2 : 16;
+		tmp = realloc(control_ops, control_size * sizeof (op));
+		if (!tmp)
+			return "cannot queue operation";
+		control_ops = tmp;
+	}
+
+	control_ops[control_nops++] = op;
+	return NULL;
+}
+
+static void close_client(struct events *events, struct control_client *client)
+{
+	size_t i;
+
+	for (i=0; i<control_nops; i++)
+		if (control_ops[i].client == client->fd)
+			control_ops[i].client = -1;
+
+	event_unwatch(events, client->fd);
+	close(client->fd);
+	client->fd = -1;
+}
+
+/*
+ * Read what a client sent and parse each complete line. A client sending a
+ * line longer than CONTROL_LINE_MAX is disconnected.
+ */
+static void handle_client(int fd, void *data)
+{
+	struct events *events = data;
+	struct control_client *client = NULL;
+	const char *err;
+	char *nl, *line;
+	ssize_t rd;
+	size_t i;
+
+	for (i=0; i<CONTROL_CLIENTS; i++)
+		if (control_clients[i].fd == fd)
+			client = &control_clients[i];
+	if (!client)
+		return;
+
+	rd = recv(fd, client->line + client->len,
+		  CONTROL_LINE_MAX - client->len, MSG_DONTWAIT);
+	if (rd <= 0) {
+		close_client(events, client);
+		return;
+	}
+	client->len += rd;
+
+	line = client->line;
+	while ((nl = memchr(line, '\n', client->len - (line - client->line)))) {
+		*nl = '\0';
+		if (nl > line && nl[-1] == '\r')
+			nl[-1] = '\0';
+
+		err = (*line == '\0') ? NULL : parse_line(fd, line);
+		if (err) {
+			send_line(fd, "error: ");
+			send_line(fd, err);
+			send_line(fd, "\n");
+		}
+		line = nl + 1;
+	}
+
+	client->len -= line - client->line;
+	memmove(client->line, line, client->len);
+
+	if (client->len == CONTROL_LINE_MAX) {
+		send_line(fd, "error: line too long\n");
+		close_client(events, client);
+	}
+}
+
+static void handle_accept(int fd, void *data)
+{
+	struct events *events = data;
+	int cfd;
+	size_t i;
+
+	cfd = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (cfd < 0)
+		return;
+
+	for (i=0; i<CONTROL_CLIENTS; i++)
+		if (control_clients[i].fd < 0)
+			break;
+
+	if (i == CONTROL_CLIENTS
+	    || event_watch(events, cfd, handle_client, events)) {
+		send_line(cfd, "error: too many clients\n");
+		close(cfd);
+		return;
+	}
+
+	control_clients[i].fd = cfd;
+	control_clients[i].len = 0;
+}
+
+int8_t control_open(struct events *events, const char *path)
+{
+	size_t i;
+
+	for (i=0; i<CONTROL_CLIENTS; i++)
+		control_clients[i].fd = -1;
+
+	if (strlen(path) >= sizeof (control_path.sun_path))
+		return -1;
+
+	control_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK
+			    | SOCK_CLOEXEC, 0);
+	if (control_fd < 0)
+		return -1;
+
+	memset(&control_path, 0, sizeof (control_path));
+	control_path.sun_family = AF_UNIX;
+	strcpy(control_path.sun_path, path);
+	unlink(path);
+
+	if (bind(control_fd, (struct sockaddr *) &control_path,
+		 sizeof (control_path))
+	    || listen(control_fd, CONTROL_BACKLOG)
+	    || event_watch(events, control_fd, handle_accept, events)) {
+		control_close(events);
+		return -1;
+	}
+
+	return 0;
+}
+
+size_t control_pending(struct control_op **ops)
+{
+	if (ops)
+		*ops = control_ops;
+	return control_nops;
+}
+
+void control_done(void)
+{
+	control_nops = 0;
+}
+
+void control_close(struct events *events)
+{
+	size_t i;
+
+	if (control_fd < 0)
+		return;
+
+	for (i=0; i<CONTROL_CLIENTS; i++)
+		if (control_clients[i].fd >= 0)
+			close_client(events, &control_clients[i]);
+
+	event_unwatch(events, control_fd);
+	close(control_fd);
+	unlink(control_path.sun_path);
+
+	control_fd = -1;
+	free(control_ops);
+	control_ops = NULL;
+	control_nops = 0;
+	control_size = 0;
+}
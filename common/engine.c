@@ -16,19 +16,102 @@
  * along with rwmsr. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <time.h>
 #include <signal.h>
 
+#include "control.h"
 #include "engine.h"
+#include "event.h"
+#include "main.h"
+#include "metrics.h"
+#include "output.h"
+#include "parse.h"
+#include "pretrigger.h"
+#include "realtime.h"
+#include "recorder.h"
+#include "reduce.h"
+#include "rwmsr.h"
+#include "sparse.h"
+#include "stamp.h"
+#include "summary.h"
+#include "timer.h"
+#include "trace.h"
+#include "window.h"
 
 
-static uint8_t stopped = 0;
+/*
+ * Position in the batch of a write skipped by the write-elision cache.
+ */
+#define BATCH_ELIDED   ((size_t) -3)
+
+/*
+ * Position in the batch of a constant register already read.
+ */
+#define BATCH_CONSTANT ((size_t) -4)
+
+/*
+ * Position in the batch of an access skipped because its register failed
+ * recently.
+ */
+#define BATCH_FAULTY   ((size_t) -5)
+
+/*
+ * Maximum exponent of the backoff of the faulty registers, which are then
+ * skipped 2^FAULT_SHIFT_MAX - 1 times out of 2^FAULT_SHIFT_MAX.
+ */
+#define FAULT_SHIFT_MAX  10
+
+#define CONSTANT_NONE    0
+#define CONSTANT_UNREAD  1
+#define CONSTANT_READ    2
+
+
+/*
+ * Registers known to never change during a run. A command reading one of
+ * them is constant unless another command writes it.
+ */
+static const msradr_t invariant_addresses[] = {
+	0x0ce,    /* MSR_PLATFORM_INFO */
+	0x10a,    /* IA32_ARCH_CAPABILITIES */
+	0x1ad,    /* MSR_TURBO_RATIO_LIMIT */
+	0x1ae,    /* MSR_TURBO_RATIO_LIMIT1 */
+	0x1af,    /* MSR_TURBO_RATIO_LIMIT2 */
+	0x345,    /* IA32_PERF_CAPABILITIES */
+	0x606,    /* MSR_RAPL_POWER_UNIT */
+};
+
+
+/*
+ * The engine owns a copy of the commands and of their cores so that the
+ * control socket can change them at runtime.
+ */
+static struct command  *engine_commands = NULL;
+static uint8_t         *engine_cores = NULL;
+static uint32_t        *engine_sockets = NULL;
+
+
+static const msradr_t  *sort_addresses;
+
+static const size_t    *sort_members;
 
 
-static void handle_signal(int signum __attribute__((unused)))
+/*
+ * Handle the signals received by the event loop: SIGUSR1 prints the summary,
+ * SIGUSR2 dumps the flight recorder and the others stop the engine.
+ * Return 1 if the engine must stop, 0 otherwise.
+ */
+static uint8_t handle_signals(struct engine *engine, uint32_t signals)
 {
-	stopped = 1;
+	if (signals & (1u << SIGUSR1))
+		summary_print(stdout, engine);
+	if (signals & (1u << SIGUSR2))
+		recorder_dump(engine);
+
+	return (signals & ~((1u << SIGUSR1) | (1u << SIGUSR2))) != 0;
 }
 
 
@@ -41,206 +124,1678 @@ static uint64_t getnow(void)
 }
 
 
-static void print_header(const struct command *commands, size_t mlen,
-			 const uint8_t *cores, size_t rlen)
+/*
+ * Find which commands read a constant register, either because they have
+ * the COMMAND_CONSTANT flag or because they read an invariant address no
+ * command writes.
+ */
+static void setup_constants(struct engine *engine)
 {
-	size_t i, j;
-	char *ptype, *pdec = ":", *phex = "::";
-	
-	printf("time ");
-	for (i=0; i<mlen; i++) {
-		if (!(commands[i].flags & COMMAND_PRINT))
+	size_t i, k;
+	const struct command *commands = engine->commands;
+	size_t ninvariants = sizeof (invariant_addresses)
+		/ sizeof (invariant_addresses[0]);
+	uint8_t written[sizeof (invariant_addresses)
+			/ sizeof (invariant_addresses[0])] = { 0 };
+
+	for (i=0; i<engine->mlen; i++) {
+		if (!(commands[i].flags & COMMAND_WRITE))
 			continue;
-		if (commands[i].flags & COMMAND_HEXA)
-			ptype = phex;
-		else
-			ptype = pdec;
-		
-		for (j=0; j<rlen; j++)
-			printf("%s0x%lx(%u) ", ptype, commands[i].address,
-			       cores[j]);
+		for (k=0; k<ninvariants; k++)
+			if (commands[i].address == invariant_addresses[k])
+				written[k] = 1;
+	}
+
+	for (i=0; i<engine->mlen; i++) {
+		engine->constants[i] = CONSTANT_NONE;
+		if (commands[i].flags & COMMAND_WRITE)
+			continue;
+
+		if (commands[i].flags & COMMAND_CONSTANT) {
+			engine->constants[i] = CONSTANT_UNREAD;
+			continue;
+		}
+
+		for (k=0; k<ninvariants; k++)
+			if (commands[i].address == invariant_addresses[k])
+				break;
+		if (k < ninvariants && !written[k])
+			engine->constants[i] = CONSTANT_UNREAD;
 	}
-	printf("\n");
 }
 
-static void print_data(const uint64_t *times, const msrval_t *values,
-		       const struct command *commands, size_t mlen,
-		       size_t rlen, uint64_t start, uint64_t now)
+static int compare_cells(const void *a, const void *b)
 {
-	size_t i, j;
-	const char *fmt;
-	const char *dfmt = " %lu";
-	const char *hfmt = " %lx";
+	size_t ca = *(const size_t *) a, cb = *(const size_t *) b;
 
-	for (i=0; i<mlen; i++) {
-		if (!(commands[i].flags & COMMAND_PRINT))
-			continue;
-		if (times[i] > now || times[i] == 0)
+	if (sort_addresses[ca] != sort_addresses[cb])
+		return sort_addresses[ca] < sort_addresses[cb] ? -1 : 1;
+	if (sort_members[ca] != sort_members[cb])
+		return sort_members[ca] < sort_members[cb] ? -1 : 1;
+	return (ca > cb) - (ca < cb);
+}
+
+/*
+ * Store in order the cells of the commands, or only of the non constant
+ * read commands if reads is set, sorted by address, then core, then index,
+ * so the cells accessing the same register are contiguous and start with
+ * the first of them.
+ * Return the number of cells stored.
+ */
+static size_t sort_cells(const struct engine *engine, size_t *order,
+			 uint8_t reads)
+{
+	size_t i, c, n = 0;
+	const struct command *commands = engine->commands;
+
+	for (i=0; i<engine->mlen; i++) {
+		if (reads && ((commands[i].flags & COMMAND_WRITE)
+			      || engine->constants[i]))
 			continue;
-		break;
+		for (c=engine->offsets[i]; c<engine->offsets[i + 1]; c++)
+			order[n++] = c;
 	}
 
-	if (i == mlen)
+	sort_addresses = engine->addresses;
+	sort_members = engine->members;
+	qsort(order, n, sizeof (size_t), compare_cells);
+	return n;
+}
+
+/*
+ * Indicate if the cells a and b access the same register.
+ */
+static uint8_t same_register(const struct engine *engine, size_t a, size_t b)
+{
+	return engine->addresses[a] == engine->addresses[b]
+		&& engine->members[a] == engine->members[b];
+}
+
+/*
+ * Find for each cell of the read commands the first cell of a read command
+ * with the same address and the same core, so that a register read by
+ * several due commands is read only once.
+ * The order array is used as scratch space.
+ */
+static void setup_aliases(struct engine *engine, size_t *order)
+{
+	size_t k, n, c, first = 0;
+	size_t *aliases = engine->batch_aliases;
+
+	for (c=0; c<engine->offsets[engine->mlen]; c++)
+		aliases[c] = c;
+
+	n = sort_cells(engine, order, 1);
+	for (k=0; k<n; k++) {
+		if (k == 0 || !same_register(engine, order[k], first))
+			first = order[k];
+		aliases[order[k]] = first;
+	}
+}
+
+/*
+ * Find for each cell the first cell accessing the same address on the same
+ * core, which holds the write-elision and fault entries of this register,
+ * and clear these entries. List these first cells in the registers array.
+ * The order array is used as scratch space.
+ */
+static void setup_registers(struct engine *engine, size_t *order)
+{
+	size_t k, n, c, first = 0;
+	size_t *slots = engine->register_slots;
+
+	for (c=0; c<engine->offsets[engine->mlen]; c++) {
+		engine->fault_counts[c] = 0;
+		engine->fault_skips[c] = 0;
+		engine->fault_ticks[c] = 0;
+		if (engine->cache_valid)
+			engine->cache_valid[c] = 0;
+	}
+
+	engine->nregisters = 0;
+	n = sort_cells(engine, order, 0);
+	for (k=0; k<n; k++) {
+		if (k == 0 || !same_register(engine, order[k], first)) {
+			first = order[k];
+			engine->registers[engine->nregisters++] = first;
+		}
+		slots[order[k]] = first;
+	}
+}
+
+/*
+ * Return the bits written by the command i.
+ */
+static msrval_t command_mask(const struct command *command)
+{
+	if (command->flags & COMMAND_MASKED)
+		return command->mask;
+	return ~(0ul);
+}
+
+/*
+ * Indicate if the write of the cell c of the command i can be skipped
+ * because the register is known to already contain the bits to write.
+ */
+static uint8_t elide_write(const struct engine *engine, size_t i, size_t c)
+{
+	msrval_t mask = command_mask(&engine->commands[i]);
+	size_t s;
+
+	if (!engine->cache_valid)
+		return 0;
+
+	s = engine->register_slots[c];
+	return engine->cache_valid[s]
+		&& (engine->cache_values[s] & mask)
+		== (engine->values[c] & mask);
+}
+
+/*
+ * Update the write-elision cache entry of the batch access at pos, or drop
+ * it if the access failed.
+ */
+static void update_cache(struct engine *engine, size_t pos, uint8_t write,
+			 uint8_t success)
+{
+	size_t c, s;
+
+	if (!engine->cache_valid)
 		return;
-	
-	printf("%lu.%03lu", (now - start) / 1000, (now - start) % 1000);
-		
-	for (i=0; i<mlen; i++) {
-		if (!(commands[i].flags & COMMAND_PRINT))
+
+	c = engine->batch_cells[pos];
+	s = engine->register_slots[c];
+
+	engine->cache_valid[s] = success;
+	engine->cache_values[s] = engine->batch_values[pos];
+	if (write)
+		engine->cache_values[s] = (engine->cache_values[s]
+					   & ~engine->batch_masks[pos])
+			| (engine->values[c] & engine->batch_masks[pos]);
+}
+
+/*
+ * Indicate if the access of the cell c must be skipped because its register
+ * failed during the last accesses, and count the skipped access once per
+ * tick, however many cells access the register.
+ */
+static uint8_t skip_faulty(struct engine *engine, size_t c)
+{
+	size_t s = engine->register_slots[c];
+
+	if (engine->fault_ticks[s] == engine->ticks)
+		return 1;
+	if (engine->fault_skips[s] == 0)
+		return 0;
+
+	engine->fault_skips[s]--;
+	engine->fault_ticks[s] = engine->ticks;
+	return 1;
+}
+
+/*
+ * Update the fault entry of the batch access at pos. After failing during n
+ * consecutive ticks, the register is skipped during the next 2^(n-1) - 1
+ * ticks, up to 2^FAULT_SHIFT_MAX - 1.
+ */
+static void update_faults(struct engine *engine, size_t pos, uint8_t success)
+{
+	size_t s = engine->register_slots[engine->batch_cells[pos]];
+	uint32_t count;
+
+	if (success) {
+		engine->fault_counts[s] = 0;
+		return;
+	}
+
+	if (engine->fault_ticks[s] == engine->ticks)
+		return;
+	engine->fault_ticks[s] = engine->ticks;
+
+	count = ++engine->fault_counts[s];
+	if (count > FAULT_SHIFT_MAX + 1)
+		count = FAULT_SHIFT_MAX + 1;
+	engine->fault_skips[s] = (1u << (count - 1)) - 1;
+}
+
+/*
+ * Gather the accesses of the due commands in the batch of the tick.
+ * The batch starts with the read-writes then continues with the reads, both
+ * ordered core after core. The batch_slots array indicates the position in
+ * the batch of each due cell, the cells of the read commands sharing the
+ * position of their alias. The writes skipped by the write-elision cache are
+ * not part of the batch and have the BATCH_ELIDED position, the constant
+ * registers already read have the BATCH_CONSTANT position, and the accesses
+ * skipped because of recent failures have the BATCH_FAULTY position.
+ */
+static void setup_batch(struct engine *engine)
+{
+	size_t i, j, k, c, pos, start, rlen = engine->rlen;
+	const struct command *commands = engine->commands;
+	const size_t *offsets = engine->offsets;
+	const size_t *members = engine->members;
+	const size_t *aliases = engine->batch_aliases;
+	size_t *slots = engine->batch_slots;
+	size_t *writes = engine->batch_writes;
+	size_t *reads = engine->batch_reads;
+
+	engine->ticks++;
+	memset(writes, 0, rlen * sizeof (size_t));
+	memset(reads, 0, rlen * sizeof (size_t));
+
+	for (k=0; k<engine->ndue; k++) {
+		i = engine->due_list[k];
+		for (c=offsets[i]; c<offsets[i + 1]; c++)
+			slots[aliases[c]] = (size_t) -1;
+	}
+
+	for (k=0; k<engine->ndue; k++) {
+		i = engine->due_list[k];
+		if (engine->constants[i] == CONSTANT_READ) {
+			for (c=offsets[i]; c<offsets[i + 1]; c++)
+				slots[c] = BATCH_CONSTANT;
 			continue;
-		
-		if (times[i] > now || times[i] == 0) {
-			for (j=0; j<rlen; j++)
-				printf(" -");
-		} else {
-			if (commands[i].flags & COMMAND_HEXA)
-				fmt = hfmt;
-			else
-				fmt = dfmt;
-			
-			for (j=0; j<rlen; j++)
-				printf(fmt, values[i * rlen + j]);
+		}
+
+		for (c=offsets[i]; c<offsets[i + 1]; c++) {
+			if (commands[i].flags & COMMAND_WRITE) {
+				engine->total_writes++;
+				if (skip_faulty(engine, c)) {
+					slots[c] = BATCH_FAULTY;
+				} else if (elide_write(engine, i, c)) {
+					slots[c] = BATCH_ELIDED;
+					engine->elided_writes++;
+				} else {
+					writes[members[c]]++;
+				}
+			} else if (slots[aliases[c]] == (size_t) -1) {
+				if (skip_faulty(engine, c)) {
+					slots[aliases[c]] = BATCH_FAULTY;
+					continue;
+				}
+				slots[aliases[c]] = (size_t) -2;
+				reads[members[c]]++;
+			}
 		}
 	}
 
-	printf("\n");
-	fflush(stdout);
+	for (j=0, start=0; j<rlen; j++) {
+		pos = writes[j];
+		writes[j] = start;
+		start += pos;
+	}
+	for (j=0; j<rlen; j++) {
+		pos = reads[j];
+		reads[j] = start;
+		start += pos;
+	}
+
+	for (k=0; k<engine->ndue; k++) {
+		i = engine->due_list[k];
+		if (engine->constants[i] == CONSTANT_READ)
+			continue;
+
+		for (c=offsets[i]; c<offsets[i + 1]; c++) {
+			j = members[c];
+
+			if (commands[i].flags & COMMAND_WRITE) {
+				if (slots[c] == BATCH_ELIDED
+				    || slots[c] == BATCH_FAULTY)
+					continue;
+				pos = writes[j]++;
+			} else if (slots[aliases[c]] == (size_t) -2) {
+				pos = reads[j]++;
+				slots[aliases[c]] = pos;
+			} else {
+				slots[c] = slots[aliases[c]];
+				continue;
+			}
+
+			slots[c] = pos;
+			engine->batch_cells[pos] = c;
+			engine->batch_addresses[pos] = engine->addresses[c];
+			engine->batch_values[pos] = engine->values[c];
+			engine->batch_masks[pos] = command_mask(&commands[i]);
+			engine->batch_cores[pos] = engine->cores[j];
+		}
+	}
 }
 
+/*
+ * Perform len accesses of the batch from the entry off, either reads or
+ * read-writes, and zero the values of the failed ones.
+ * The validity of the cell of each access, the write-elision cache and the
+ * fault entries are updated with the result of each access.
+ */
+static void issue_batch(struct engine *engine, size_t off, size_t len,
+			uint8_t write)
+{
+	size_t i;
+	uint8_t success;
+	msrval_t *values = engine->batch_values + off;
+	const msrval_t *masks = engine->batch_masks + off;
+	const msradr_t *addresses = engine->batch_addresses + off;
+	const uint8_t *cores = engine->batch_cores + off;
+	uint64_t *bitmap = engine->batch_success;
+
+	if (len == 0)
+		return;
+
+	if (write)
+		rmwmsr_map(addresses, values, masks, cores, len, bitmap);
+	else
+		rdmsr_map(values, addresses, cores, len, bitmap);
+
+	for (i=0; i<len; i++) {
+		success = (bitmap[i / 64] >> (i % 64)) & 1;
+		if (!success)
+			values[i] = 0;
+		engine->valid[engine->batch_cells[off + i]] = success;
+		update_cache(engine, off + i, write, success);
+		update_faults(engine, off + i, success);
+	}
+}
 
-static void apply_commands(msrval_t *values, const msradr_t *addresses,
-			   const uint64_t *times,
-			   const struct command *commands, size_t mlen,
-			   const uint8_t *cores, size_t rlen, uint64_t now)
+/*
+ * Copy the results of the batch back to the values of the due commands,
+ * with the validity of the access they come from.
+ * The elided writes get the value the register is known to contain. The
+ * constant registers are copied from memory once read, and the skipped
+ * faulty accesses are zeroed and invalid like the failed ones. A constant
+ * register is read again until all its cells are valid.
+ */
+static void scatter_batch(struct engine *engine)
 {
-	size_t i, j, ret;
+	size_t i, k, c, slot;
+	uint8_t complete;
 
-	for (i=0; i<mlen; i++) {
-		if (times[i] > now || times[i] == 0)
-			goto end;;
+	for (k=0; k<engine->ndue; k++) {
+		i = engine->due_list[k];
+		complete = 1;
+
+		for (c=engine->offsets[i]; c<engine->offsets[i + 1]; c++) {
+			slot = engine->batch_slots[c];
+			if (slot == BATCH_CONSTANT) {
+				engine->values[c] = engine->constant_values[c];
+				engine->valid[c] = 1;
+			} else if (slot == BATCH_FAULTY) {
+				engine->values[c] = 0;
+				engine->valid[c] = 0;
+			} else if (slot == BATCH_ELIDED) {
+				engine->values[c] = engine->cache_values[
+					engine->register_slots[c]];
+				engine->valid[c] = 1;
+			} else {
+				engine->values[c] = engine->batch_values[slot];
+				engine->valid[c] = engine->valid[
+					engine->batch_cells[slot]];
+			}
+			complete &= engine->valid[c];
+		}
+
+		if (engine->constants[i] == CONSTANT_UNREAD && complete) {
+			c = engine->offsets[i];
+			memcpy(engine->constant_values + c, engine->values + c,
+			       (engine->offsets[i + 1] - c)
+			       * sizeof (msrval_t));
+			engine->constants[i] = CONSTANT_READ;
+		}
+	}
+}
+
+/*
+ * Perform the accesses of the due commands with a single read-write call
+ * followed by a single read call, so the reads see the values written
+ * during the same tick.
+ */
+static void apply_commands(struct engine *engine)
+{
+	size_t rlen = engine->rlen, nwrites;
+
+	if (rlen == 0)
+		return;
+
+	setup_batch(engine);
+	nwrites = engine->batch_writes[rlen - 1];
+	issue_batch(engine, 0, nwrites, 1);
+	issue_batch(engine, nwrites, engine->batch_reads[rlen - 1] - nwrites,
+		    0);
+	scatter_batch(engine);
+}
+
+/*
+ * Same as apply_commands() but perform the accesses of the batch core after
+ * core, and timestamp each core in the middle of its accesses.
+ */
+static void apply_commands_percore(struct engine *engine)
+{
+	size_t j, rlen = engine->rlen, start;
+	const size_t *writes = engine->batch_writes;
+	const size_t *reads = engine->batch_reads;
+	uint64_t t0, t1;
+
+	if (rlen == 0)
+		return;
+
+	setup_batch(engine);
+
+	for (j=0; j<rlen; j++) {
+		t0 = stamp_read();
+		start = j ? writes[j - 1] : 0;
+		issue_batch(engine, start, writes[j] - start, 1);
+		start = j ? reads[j - 1] : writes[rlen - 1];
+		issue_batch(engine, start, reads[j] - start, 0);
+		t1 = stamp_read();
+
+		engine->stamps[j] = stamp_to_ns(t0 + (t1 - t0) / 2
+						- engine->origin);
+	}
+
+	scatter_batch(engine);
+}
+
+
+/*
+ * Reduce the valid values of the due commands with a reduction, and store
+ * the resulting columns at the beginning of their values, along with their
+ * validity. A column is invalid if none of its cells is valid.
+ */
+static void reduce_commands(struct engine *engine, msrval_t *scratch)
+{
+	size_t i, k, c, n, off, len;
+	const struct command *commands = engine->commands;
+	const uint8_t *valid;
+	msrval_t *row;
+
+	for (k=0; k<engine->ndue; k++) {
+		i = engine->due_list[k];
+		if (commands[i].reduce == REDUCE_NONE)
+			continue;
+
+		off = engine->offsets[i];
+		len = engine->offsets[i + 1] - off;
+		row = engine->values + off;
+		valid = engine->valid + off;
+		if (!memchr(valid, 0, len))
+			valid = NULL;
 
-		if (commands[i].flags & COMMAND_WRITE) {
-			ret = rwmsr_arr(addresses, values, cores, rlen);
+		if (commands[i].flags & COMMAND_SOCKET) {
+			reduce_groups(scratch, engine->valid + off, row, valid,
+				      engine->cell_groups + off,
+				      engine->column_counts + off, len,
+				      engine->columns[i], commands[i].reduce);
+			memcpy(row, scratch,
+			       engine->columns[i] * sizeof (*row));
+		} else if (valid) {
+			for (c=0, n=0; c<len; c++)
+				if (valid[c])
+					scratch[n++] = row[c];
+			row[0] = n ? reduce_row(scratch, n, commands[i].reduce)
+				: 0;
+			engine->valid[off] = n != 0;
 		} else {
-			ret = rdmsr_arr(values, addresses, cores, rlen);
+			row[0] = reduce_row(row, len, commands[i].reduce);
 		}
+	}
+}
 
-		if (ret == rlen)
-			goto end;
 
-		for (j=0; j<rlen; j++)
-			values[j] = 0;
+static void setup_start_data(struct engine *engine)
+{
+	size_t i, c;
+
+	for (i=0; i<engine->mlen; i++)
+		for (c=engine->offsets[i]; c<engine->offsets[i + 1]; c++)
+			engine->addresses[c] = engine->commands[i].address;
+}
 
-	end:
-		values += rlen;
-		addresses += rlen;
+/*
+ * Clear the due marks of the previous tick, then list and mark the commands
+ * due at the given time.
+ * Return the number of due commands.
+ */
+static size_t setup_due(struct engine *engine, struct timer *timer,
+			uint64_t now)
+{
+	size_t k;
+
+	for (k=0; k<engine->ndue; k++)
+		engine->due[engine->due_list[k]] = 0;
+
+	engine->ndue = timer_expire(timer, now, engine->due_list);
+
+	for (k=0; k<engine->ndue; k++)
+		engine->due[engine->due_list[k]] = 1;
+
+	return engine->ndue;
+}
+
+/*
+ * Reset the values of the write commands to the value to write.
+ * If all is 0, only the write commands of the due list are reset since they
+ * are the only ones whose values have been replaced by the read values.
+ */
+static void setup_next_data(struct engine *engine, uint8_t all)
+{
+	size_t i, c, k, count = all ? engine->mlen : engine->ndue;
+
+	for (k=0; k<count; k++) {
+		i = all ? k : engine->due_list[k];
+		if (!(engine->commands[i].flags & COMMAND_WRITE))
+			continue;
+		for (c=engine->offsets[i]; c<engine->offsets[i + 1]; c++)
+			engine->values[c] = engine->commands[i].value;
 	}
 }
 
 
-static void setup_start_data(msradr_t *addresses,
-			     const struct command *commands, size_t mlen,
-			     size_t rlen)
+/*
+ * Allocate the buffers which depend on the commands and cores of the engine,
+ * and fill them for the first tick.
+ * Return 0 in case of success, -1 otherwise.
+ */
+static int8_t setup_layout(struct engine *engine)
 {
-	size_t i, j;
+	size_t i, cells, mlen = engine->mlen, rlen = engine->rlen;
+	size_t *order;
+
+	if (setup_columns(engine))
+		return -1;
+	cells = engine->offsets[mlen];
+
+	engine->due = calloc(mlen + 1, sizeof (uint8_t));
+	engine->due_list = malloc((mlen + 1) * sizeof (size_t));
+	engine->ndue = 0;
+	engine->values = malloc((cells + 1) * sizeof (msrval_t));
+	engine->valid = calloc(cells + 1, sizeof (uint8_t));
+	engine->addresses = malloc((cells + 1) * sizeof (msradr_t));
+	engine->scratch = malloc((rlen + 1) * sizeof (msrval_t));
+	engine->stamps = NULL;
+	if (engine->config->timestamps != STAMP_NONE)
+		engine->stamps = calloc(rlen + 1, sizeof (uint64_t));
+
+	engine->batch_addresses = malloc((cells + 1) * sizeof (msradr_t));
+	engine->batch_values = malloc((cells + 1) * sizeof (msrval_t));
+	engine->batch_masks = malloc((cells + 1) * sizeof (msrval_t));
+	engine->batch_cores = malloc((cells + 1) * sizeof (uint8_t));
+	engine->batch_slots = malloc((cells + 1) * sizeof (size_t));
+	engine->batch_aliases = malloc((cells + 1) * sizeof (size_t));
+	engine->batch_writes = malloc((rlen + 1) * sizeof (size_t));
+	engine->batch_reads = malloc((rlen + 1) * sizeof (size_t));
+	engine->constants = malloc((mlen + 1) * sizeof (uint8_t));
+	engine->constant_values = malloc((cells + 1) * sizeof (msrval_t));
+
+	engine->batch_cells = malloc((cells + 1) * sizeof (size_t));
+	engine->batch_success = malloc((cells / 64 + 1) * sizeof (uint64_t));
+	engine->register_slots = malloc((cells + 1) * sizeof (size_t));
+	engine->registers = malloc((cells + 1) * sizeof (size_t));
+	engine->fault_counts = malloc((cells + 1) * sizeof (uint32_t));
+	engine->fault_skips = malloc((cells + 1) * sizeof (uint32_t));
+	engine->fault_ticks = malloc((cells + 1) * sizeof (uint64_t));
+
+	engine->periods = malloc((mlen + 1) * sizeof (uint32_t));
+	engine->previous = malloc((cells + 1) * sizeof (msrval_t));
+	engine->previous_times = calloc(cells + 1, sizeof (uint64_t));
+	engine->sampled = calloc(mlen + 1, sizeof (uint8_t));
+
+	engine->cache_valid = NULL;
+	engine->cache_values = NULL;
+	if (engine->config->elide_writes) {
+		engine->cache_valid = malloc((cells + 1) * sizeof (uint8_t));
+		engine->cache_values = malloc((cells + 1) * sizeof (msrval_t));
+		if (!engine->cache_valid || !engine->cache_values)
+			return -1;
+	}
+
+	if (!engine->due || !engine->due_list || !engine->values
+	    || !engine->valid
+	    || !engine->addresses || !engine->scratch
+	    || (engine->config->timestamps != STAMP_NONE && !engine->stamps)
+	    || !engine->batch_addresses || !engine->batch_values
+	    || !engine->batch_masks
+	    || !engine->batch_cores || !engine->batch_slots
+	    || !engine->batch_aliases || !engine->batch_writes
+	    || !engine->batch_reads || !engine->constants
+	    || !engine->constant_values || !engine->batch_cells
+	    || !engine->batch_success || !engine->register_slots
+	    || !engine->registers
+	    || !engine->fault_counts || !engine->fault_skips
+	    || !engine->fault_ticks
+	    || !engine->periods || !engine->previous
+	    || !engine->previous_times || !engine->sampled)
+		return -1;
 
 	for (i=0; i<mlen; i++)
-		for (j=0; j<rlen; j++)
-			addresses[i * rlen + j] = commands[i].address;
+		engine->periods[i] = engine->commands[i].repeat;
+
+	order = malloc((cells + 1) * sizeof (size_t));
+	if (!order)
+		return -1;
+
+	setup_start_data(engine);
+	setup_registers(engine, order);
+	setup_constants(engine);
+	setup_aliases(engine, order);
+	setup_next_data(engine, 1);
+
+	free(order);
+	return 0;
 }
 
-static void setup_start_times(uint64_t *times, const struct command *commands,
-			      size_t mlen, uint64_t start)
+static void release_layout(struct engine *engine)
 {
-	size_t i;
+	release_columns(engine);
+	free(engine->due);
+	free(engine->due_list);
+	free(engine->values);
+	free(engine->valid);
+	free(engine->addresses);
+	free(engine->scratch);
+	free(engine->stamps);
+	free(engine->batch_addresses);
+	free(engine->batch_values);
+	free(engine->batch_masks);
+	free(engine->batch_cores);
+	free(engine->batch_slots);
+	free(engine->batch_aliases);
+	free(engine->batch_writes);
+	free(engine->batch_reads);
+	free(engine->constants);
+	free(engine->constant_values);
+	free(engine->cache_valid);
+	free(engine->cache_values);
+	free(engine->register_slots);
+	free(engine->registers);
+	free(engine->batch_cells);
+	free(engine->batch_success);
+	free(engine->fault_counts);
+	free(engine->fault_skips);
+	free(engine->fault_ticks);
+	free(engine->periods);
+	free(engine->previous);
+	free(engine->previous_times);
+	free(engine->sampled);
+}
 
-	for (i=0; i<mlen; i++) {
-		if (commands[i].flags & COMMAND_DELAY)
-			times[i] = start + commands[i].delay;
-		else
-			times[i] = start;
-	}
+/*
+ * Touch the buffers of the engine so that no page fault happens while
+ * sampling in real-time mode.
+ */
+static void prefault_layout(struct engine *engine)
+{
+	size_t cells = engine->offsets[engine->mlen], rlen = engine->rlen;
+
+	realtime_prefault(engine->due_list, engine->mlen * sizeof (size_t));
+	realtime_prefault(engine->values, cells * sizeof (msrval_t));
+	realtime_prefault(engine->valid, cells * sizeof (uint8_t));
+	realtime_prefault(engine->batch_addresses, cells * sizeof (msradr_t));
+	realtime_prefault(engine->batch_values, cells * sizeof (msrval_t));
+	realtime_prefault(engine->batch_masks, cells * sizeof (msrval_t));
+	realtime_prefault(engine->batch_cores, cells * sizeof (uint8_t));
+	realtime_prefault(engine->batch_slots, cells * sizeof (size_t));
+	realtime_prefault(engine->batch_writes, rlen * sizeof (size_t));
+	realtime_prefault(engine->batch_reads, rlen * sizeof (size_t));
+	realtime_prefault(engine->scratch, rlen * sizeof (msrval_t));
+	realtime_prefault(engine->constant_values, cells * sizeof (msrval_t));
+	realtime_prefault(engine->batch_cells, cells * sizeof (size_t));
+	realtime_prefault(engine->batch_success,
+			  (cells / 64 + 1) * sizeof (uint64_t));
+	realtime_prefault(engine->previous, cells * sizeof (msrval_t));
+	realtime_prefault(engine->previous_times, cells * sizeof (uint64_t));
+	if (engine->cache_valid)
+		realtime_prefault(engine->cache_values,
+				  cells * sizeof (msrval_t));
 }
 
-static void setup_next_data(msrval_t *values,
-			    const struct command *commands, size_t mlen,
-			    size_t rlen)
+
+/*
+ * Return the current repeat period of the periodic command i: its adaptive
+ * period if any, and at most the burst period during a burst.
+ */
+static uint32_t command_period(const struct engine *engine, size_t i)
+{
+	const struct trigger *trigger = &engine->config->trigger;
+	uint32_t period = engine->commands[i].repeat;
+
+	if (engine->commands[i].flags & COMMAND_ADAPTIVE)
+		period = engine->periods[i];
+	if (engine->burst_end && period > trigger->period)
+		period = trigger->period;
+
+	return period;
+}
+
+/*
+ * Build the timer of the commands of the engine, the commands starting at the
+ * given next times and repeating with their current period.
+ * Return 0 in case of success, -1 otherwise.
+ */
+static int8_t setup_timer(const struct engine *engine, struct timer *timer,
+			  const uint64_t *nexts)
 {
-	size_t i, j;
+	struct command *commands;
+	size_t i, mlen = engine->mlen;
+	int8_t ret;
+
+	commands = malloc((mlen + 1) * sizeof (*commands));
+	if (!commands)
+		return -1;
+	memcpy(commands, engine->commands, mlen * sizeof (*commands));
 
 	for (i=0; i<mlen; i++)
-		for (j=0; j<rlen; j++)
-			if (commands[i].flags & COMMAND_WRITE)
-				values[i * rlen + j] = commands[i].value;
+		if (commands[i].flags & COMMAND_REPEAT)
+			commands[i].repeat = command_period(engine, i);
+
+	ret = timer_setup(timer, commands, nexts, mlen);
+	free(commands);
+	return ret;
 }
 
-static uint64_t setup_next_times(uint64_t *times,
-				 const struct command *commands, size_t mlen,
-				 uint64_t now)
+/*
+ * Rebuild the timer after the period of some commands changed. The commands
+ * executed at this time are next executed after their new period, the others
+ * keep their next time, but no later than their new period from now if a
+ * burst started.
+ */
+static void reschedule(struct engine *engine, struct timer *timer,
+		       uint64_t now, uint8_t burst)
 {
-	size_t i;
-	uint64_t nearest = ~(0ul);
+	size_t i, mlen = engine->mlen;
+	uint64_t *nexts, next;
+
+	nexts = malloc((mlen + 1) * sizeof (uint64_t));
+	if (!nexts)
+		error("cannot allocate command timers");
 
 	for (i=0; i<mlen; i++) {
-		if (times[i] == 0)
+		nexts[i] = timer_command_next(timer, i);
+		if (nexts[i] == ~(0ul)
+		    || !(engine->commands[i].flags & COMMAND_REPEAT))
+			continue;
+		next = now + command_period(engine, i);
+		if (engine->due[i] || (burst && nexts[i] > next))
+			nexts[i] = next;
+	}
+
+	timer_release(timer);
+	if (setup_timer(engine, timer, nexts))
+		error("cannot allocate command timers");
+	free(nexts);
+}
+
+/*
+ * Return the value a condition compares for the column c: its masked value,
+ * or the increase of its masked field since its previous value, per second
+ * with CONDITION_RATE.
+ * Return 0 if the condition has no value for the column.
+ */
+static uint8_t condition_value(const struct engine *engine,
+			       const struct condition *condition, size_t c,
+			       uint64_t now, msrval_t *value)
+{
+	msrval_t mask = condition->mask, delta;
+	uint64_t elapsed;
+	int shift;
+
+	if (!engine->valid[c])
+		return 0;
+	if (condition->mode == CONDITION_VALUE) {
+		*value = engine->values[c] & mask;
+		return 1;
+	}
+
+	if (mask == 0 || engine->previous_times[c] == 0)
+		return 0;
+	elapsed = now - engine->previous_times[c];
+
+	shift = __builtin_ctzl(mask);
+	delta = ((engine->values[c] >> shift) - (engine->previous[c] >> shift))
+		& (mask >> shift);
+
+	if (condition->mode == CONDITION_DELTA) {
+		*value = delta;
+		return 1;
+	}
+
+	if (elapsed == 0)
+		return 0;
+	*value = delta / elapsed * 1000 + delta % elapsed * 1000 / elapsed;
+	return 1;
+}
+
+static uint8_t condition_holds(const struct condition *condition,
+			       msrval_t threshold, msrval_t value)
+{
+	switch (condition->op) {
+	case CONDITION_LT:
+		return value < threshold;
+	case CONDITION_LE:
+		return value <= threshold;
+	case CONDITION_EQ:
+		return value == threshold;
+	case CONDITION_NE:
+		return value != threshold;
+	case CONDITION_GE:
+		return value >= threshold;
+	case CONDITION_GT:
+		return value > threshold;
+	}
+
+	return 0;
+}
+
+/*
+ * Indicate if the condition holds with the given threshold at the given time
+ * for any valid column of the due commands reading its address.
+ * Return 1 if it holds, 0 if it does not, -1 if no such column is due.
+ */
+static int8_t condition_met(const struct engine *engine,
+			    const struct condition *condition,
+			    msrval_t threshold, uint64_t now)
+{
+	const struct command *command;
+	int8_t ret = -1;
+	size_t i, j, k, c;
+	msrval_t value;
+
+	for (k=0; k<engine->ndue; k++) {
+		i = engine->due_list[k];
+		command = &engine->commands[i];
+		if (command->address != condition->address
+		    || (command->flags & COMMAND_WRITE))
 			continue;
-		if (times[i] > now)
-			goto end;
-		
-		if (commands[i].flags & COMMAND_REPEAT) {
-			while (times[i] <= now)
-				times[i] += commands[i].repeat;
+
+		for (j=0; j<engine->columns[i]; j++) {
+			c = engine->offsets[i] + j;
+			if (!condition_value(engine, condition, c, now,
+					     &value))
+				continue;
+			ret = 0;
+			if (condition_holds(condition, threshold, value))
+				return 1;
+		}
+	}
+
+	return ret;
+}
+
+/*
+ * End the current burst if its duration elapsed, then start or extend a
+ * burst if the trigger condition holds for the values of the current tick.
+ * If ring is set, the ticks kept before the burst are printed when it starts,
+ * so they are output along with the burst. At the end of a burst, the flight
+ * recorder is dumped, so its window covers the ticks preceding the trigger
+ * and the burst itself.
+ */
+static void check_trigger(struct engine *engine, struct timer *timer,
+			  uint64_t now, uint8_t text, uint8_t ring)
+{
+	const struct trigger *trigger = &engine->config->trigger;
+
+	if (engine->burst_end && now >= engine->burst_end) {
+		engine->burst_end = 0;
+		reschedule(engine, timer, now, 0);
+		if (text)
+			printf("# burst end\n");
+		if (engine->config->recorder_path)
+			recorder_dump(engine);
+	}
+
+	if (condition_met(engine, &trigger->condition,
+			  trigger->condition.threshold, now) != 1)
+		return;
+
+	if (engine->burst_end) {
+		engine->burst_end = now + trigger->duration;
+		return;
+	}
+
+	engine->burst_end = now + trigger->duration;
+	reschedule(engine, timer, now, 1);
+	if (ring)
+		pretrigger_flush(stdout, engine);
+	if (text)
+		printf("# burst start\n");
+}
+
+
+/*
+ * Update the period of the due adaptive commands from the largest change of
+ * their valid columns since their previous execution, and re-key in the
+ * timer those whose period changed to their new period from now.
+ */
+static void adapt_periods(struct engine *engine, struct timer *timer,
+			  uint64_t now)
+{
+	const struct command *command;
+	size_t i, j, k, c;
+	msrval_t delta, diff, value;
+	uint32_t period;
+
+	for (k=0; k<engine->ndue; k++) {
+		i = engine->due_list[k];
+		command = &engine->commands[i];
+		if (!(command->flags & COMMAND_ADAPTIVE))
+			continue;
+
+		delta = 0;
+		for (j=0; j<engine->columns[i]; j++) {
+			c = engine->offsets[i] + j;
+			if (!engine->valid[c])
+				continue;
+			value = engine->values[c];
+			if (value > engine->previous[c])
+				diff = value - engine->previous[c];
+			else
+				diff = engine->previous[c] - value;
+			if (diff > delta)
+				delta = diff;
+		}
+
+		if (!engine->sampled[i]) {
+			engine->sampled[i] = 1;
+			continue;
+		}
+
+		period = engine->periods[i];
+		if (delta > command->threshold)
+			period /= 2;
+		else if (period <= command->repeat_max / 2)
+			period *= 2;
+		else
+			period = command->repeat_max;
+
+		if (period < command->repeat)
+			period = command->repeat;
+		if (period == engine->periods[i])
+			continue;
+
+		engine->periods[i] = period;
+		if (timer_command_next(timer, i) == ~(0ul))
+			continue;
+		period = command_period(engine, i);
+		timer_update(timer, i, now + period, period);
+	}
+}
+
+
+/*
+ * Keep the valid columns of the due commands as their previous values, read
+ * at the given time.
+ */
+static void update_previous(struct engine *engine, uint64_t now)
+{
+	size_t i, j, k, c;
+
+	for (k=0; k<engine->ndue; k++) {
+		i = engine->due_list[k];
+		for (j=0; j<engine->columns[i]; j++) {
+			c = engine->offsets[i] + j;
+			if (!engine->valid[c])
+				continue;
+			engine->previous[c] = engine->values[c];
+			engine->previous_times[c] = now;
+		}
+	}
+}
+
+
+/*
+ * Allocate the rule state and the rule arrays, with room for one command on
+ * every core for each rule.
+ * Return 0 in case of success, -1 otherwise.
+ */
+static int8_t setup_rules(struct engine *engine)
+{
+	size_t len = engine->config->nrules * CORES_MAX;
+
+	engine->engaged = calloc(engine->config->nrules + 1, sizeof (uint8_t));
+	engine->rule_addresses = malloc((len + 1) * sizeof (msradr_t));
+	engine->rule_values = malloc((len + 1) * sizeof (msrval_t));
+	engine->rule_masks = malloc((len + 1) * sizeof (msrval_t));
+	engine->rule_cores = malloc((len + 1) * sizeof (uint8_t));
+	engine->rule_steps = malloc((len + 1) * sizeof (uint16_t));
+	engine->rule_reads = malloc((len + 1) * sizeof (msrval_t));
+	engine->rule_success = malloc((len / 64 + 1) * sizeof (uint64_t));
+
+	if (!engine->engaged || !engine->rule_addresses
+	    || !engine->rule_values || !engine->rule_masks
+	    || !engine->rule_cores || !engine->rule_steps
+	    || !engine->rule_reads
+	    || !engine->rule_success)
+		return -1;
+	return 0;
+}
+
+static void release_rules(struct engine *engine)
+{
+	free(engine->engaged);
+	free(engine->rule_addresses);
+	free(engine->rule_values);
+	free(engine->rule_masks);
+	free(engine->rule_cores);
+	free(engine->rule_steps);
+	free(engine->rule_reads);
+	free(engine->rule_success);
+}
+
+/*
+ * Append to the rule arrays the writes of the given command, from the
+ * position n.
+ * Return the new number of writes.
+ */
+static size_t gather_rule(struct engine *engine, const struct command *command,
+			  size_t n)
+{
+	size_t w, j;
+	uint64_t bits;
+
+	for (w=0; w<CORES_MAX / 64; w++) {
+		for (bits=command->cores[w]; bits; bits&=bits-1) {
+			j = w * 64 + __builtin_ctzl(bits);
+			engine->rule_addresses[n] = command->address;
+			engine->rule_values[n] = command->value;
+			engine->rule_masks[n] = command_mask(command);
+			engine->rule_cores[n] = j;
+			engine->rule_steps[n] = command->flags
+				& (COMMAND_STEP | COMMAND_DECREASE);
+			n++;
+		}
+	}
+
+	return n;
+}
+
+/*
+ * Replace the step of the step writes among the len writes of the rules by
+ * the value of their field once stepped from its current value, which is
+ * read with one call to the backend. The writes whose register cannot be
+ * read are dropped.
+ * Return the new number of writes.
+ */
+static size_t step_rules(struct engine *engine, size_t len)
+{
+	size_t n, m = 0, shift;
+	msrval_t field, step, max, *reads = engine->rule_reads;
+
+	for (n=0; n<len; n++)
+		if (engine->rule_steps[n])
+			break;
+	if (n == len)
+		return len;
+
+	rdmsr_map(reads, engine->rule_addresses, engine->rule_cores, len,
+		  engine->rule_success);
+
+	for (n=0; n<len; n++) {
+		if (engine->rule_steps[n]) {
+			if (!((engine->rule_success[n / 64] >> (n % 64)) & 1))
+				continue;
+			shift = __builtin_ctzl(engine->rule_masks[n]);
+			max = engine->rule_masks[n] >> shift;
+			field = (reads[n] & engine->rule_masks[n]) >> shift;
+			step = engine->rule_values[n] >> shift;
+			if (!(engine->rule_steps[n] & COMMAND_DECREASE))
+				field = (max - field < step) ? max
+					: field + step;
+			else
+				field = (field < step) ? 0 : field - step;
+			engine->rule_values[n] = field << shift;
+		}
+
+		engine->rule_addresses[m] = engine->rule_addresses[n];
+		engine->rule_values[m] = engine->rule_values[n];
+		engine->rule_masks[m] = engine->rule_masks[n];
+		engine->rule_cores[m] = engine->rule_cores[n];
+		m++;
+	}
+
+	return m;
+}
+
+/*
+ * Return the index in the registers array of the register at the given
+ * address on the given core, or nregisters if no command accesses it.
+ */
+static size_t find_register(const struct engine *engine, msradr_t address,
+			    uint8_t core)
+{
+	size_t lo = 0, hi = engine->nregisters, mid, c;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		c = engine->registers[mid];
+		if (engine->addresses[c] < address
+		    || (engine->addresses[c] == address
+			&& engine->cores[engine->members[c]] < core))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (lo < engine->nregisters) {
+		c = engine->registers[lo];
+		if (engine->addresses[c] == address
+		    && engine->cores[engine->members[c]] == core)
+			return lo;
+	}
+	return engine->nregisters;
+}
+
+/*
+ * Forget the write-elision cache entries of the len registers written by the
+ * rules, since their content is not known anymore.
+ */
+static void forget_rules(struct engine *engine, size_t len)
+{
+	size_t n, r;
+
+	if (!engine->cache_valid)
+		return;
+
+	for (n=0; n<len; n++) {
+		r = find_register(engine, engine->rule_addresses[n],
+				  engine->rule_cores[n]);
+		if (r < engine->nregisters)
+			engine->cache_valid[engine->registers[r]] = 0;
+	}
+}
+
+/*
+ * Evaluate the rules on the values of the current tick, happening at the
+ * given time, and write the commands of the rules which switch on or off,
+ * with a single read-modify-write call to the backend, preceded by a read
+ * call if some of them step.
+ */
+static void apply_rules(struct engine *engine, uint64_t now, uint8_t text)
+{
+	const struct engine_config *config = engine->config;
+	const struct rule *rule;
+	size_t r, n = 0;
+
+	for (r=0; r<config->nrules; r++) {
+		rule = &config->rules[r];
+
+		if (!engine->engaged[r]) {
+			if (condition_met(engine, &rule->condition,
+					  rule->condition.threshold, now) != 1)
+				continue;
+			engine->engaged[r] = 1;
+			n = gather_rule(engine, &rule->on, n);
 		} else {
-			times[i] = 0;
+			if (condition_met(engine, &rule->condition,
+					  rule->release, now) != 0)
+				continue;
+			engine->engaged[r] = 0;
+			if (rule->off.flags)
+				n = gather_rule(engine, &rule->off, n);
+		}
+
+		if (text)
+			printf("# rule %lu %s\n", r,
+			       engine->engaged[r] ? "on" : "off");
+	}
+
+	n = step_rules(engine, n);
+	if (n == 0)
+		return;
+
+	rmwmsr_map(engine->rule_addresses, engine->rule_values,
+		   engine->rule_masks, engine->rule_cores, n,
+		   engine->rule_success);
+	forget_rules(engine, n);
+}
+
+
+/*
+ * Set the cores of the engine to the cores used by at least one command, in
+ * increasing order, and find their sockets if a command reduces by socket.
+ */
+static void setup_cores(struct engine *engine)
+{
+	size_t i, j, rlen = 0;
+	uint8_t socket = 0;
+	struct command all;
+
+	memset(&all, 0, sizeof (all));
+	for (i=0; i<engine->mlen; i++) {
+		for (j=0; j<CORES_MAX / 64; j++)
+			all.cores[j] |= engine->commands[i].cores[j];
+		if (engine->commands[i].flags & COMMAND_SOCKET)
+			socket = 1;
+	}
+
+	free(engine_cores);
+	free(engine_sockets);
+	engine_cores = malloc((CORES_MAX + 1) * sizeof (uint8_t));
+	engine_sockets = calloc(CORES_MAX + 1, sizeof (uint32_t));
+	if (!engine_cores || !engine_sockets)
+		error("cannot allocate cores");
+
+	for (i=0; i<CORES_MAX; i++)
+		if (COMMAND_HAS_CORE(&all, i))
+			engine_cores[rlen++] = i;
+
+	if (socket && socketinfo(engine_sockets, engine_cores, rlen))
+		memset(engine_sockets, 0, rlen * sizeof (uint32_t));
+
+	engine->cores = engine_cores;
+	engine->sockets = engine_sockets;
+	engine->rlen = rlen;
+}
+
+/*
+ * Set the cores bitmap of a command added from the control socket to the
+ * default cores if it has none, or check its cores exist and do not include
+ * the real-time cpu.
+ * Return 0 in case of success, -1 otherwise.
+ */
+static int8_t setup_command_cores(struct command *command,
+				  const struct engine_config *config)
+{
+	size_t i;
+
+	if (!(command->flags & COMMAND_CORES)) {
+		memcpy(command->cores, config->cores, sizeof (command->cores));
+		return 0;
+	}
+
+	for (i=config->cores_size; i<CORES_MAX; i++)
+		if (COMMAND_HAS_CORE(command, i))
+			return -1;
+	if (config->realtime && config->realtime_cpu < CORES_MAX
+	    && COMMAND_HAS_CORE(command, config->realtime_cpu))
+		return -1;
+	return 0;
+}
+
+/*
+ * Apply to the commands array the operations received from the control
+ * socket, and store in nexts the next execution time of the commands and in
+ * sources their index before the operations, or TIMER_NONE for the added
+ * ones.
+ * Return the new number of commands and set changed to 1 if the commands
+ * changed.
+ */
+static size_t apply_operations(struct engine *engine, struct command *commands,
+			       uint64_t *nexts, size_t *sources,
+			       struct control_op *ops, size_t nops,
+			       uint64_t now, uint8_t *changed)
+{
+	size_t i, k, mlen = engine->mlen;
+	struct control_op *op;
+	char buffer[256];
+
+	for (k=0; k<nops; k++) {
+		op = &ops[k];
+
+		if (op->type == CONTROL_ADD) {
+			if (setup_command_cores(&op->command, engine->config)) {
+				control_reply(op, "error: invalid core");
+				continue;
+			}
+			commands[mlen] = op->command;
+			nexts[mlen] = timer_first(&op->command, now);
+			sources[mlen] = TIMER_NONE;
+			control_reply(op, "ok %lu", mlen);
+			mlen++;
+			*changed = 1;
+		} else if (op->type == CONTROL_LIST) {
+			for (i=0; i<mlen; i++) {
+				format_command(buffer, sizeof (buffer),
+					       &commands[i]);
+				control_reply(op, "%lu %s", i, buffer);
+			}
+			control_reply(op, "ok");
+		} else if (op->index >= mlen) {
+			control_reply(op, "error: no such command: %lu",
+				      op->index);
+		} else if (op->type == CONTROL_REMOVE) {
+			i = op->index;
+			memmove(commands + i, commands + i + 1,
+				(mlen - i - 1) * sizeof (*commands));
+			memmove(nexts + i, nexts + i + 1,
+				(mlen - i - 1) * sizeof (*nexts));
+			memmove(sources + i, sources + i + 1,
+				(mlen - i - 1) * sizeof (*sources));
+			mlen--;
+			control_reply(op, "ok");
+			*changed = 1;
+		} else if (op->type == CONTROL_PERIOD) {
+			i = op->index;
+			commands[i].flags |= COMMAND_DELAY | COMMAND_REPEAT;
+			commands[i].repeat = op->repeat;
+			if (nexts[i] == ~(0ul))
+				nexts[i] = now;
+			control_reply(op, "ok");
+			*changed = 1;
+		}
+	}
+
+	return mlen;
+}
+
+/*
+ * Copy the state of the commands kept by a control socket change from the
+ * old layout to the new one of the engine, the sources array giving the old
+ * index of each command, or TIMER_NONE for the added ones. The cells of a
+ * kept command have the same cores in both layouts, so they match one to
+ * one, and so do the entries of their registers.
+ */
+static void migrate_layout(struct engine *engine, const struct engine *old,
+			   const size_t *sources)
+{
+	size_t i, k, c, d, s, t;
+
+	for (i=0; i<engine->mlen; i++) {
+		k = sources[i];
+		if (k == TIMER_NONE)
 			continue;
+
+		if (old->commands[k].repeat == engine->commands[i].repeat)
+			engine->periods[i] = old->periods[k];
+		engine->sampled[i] = old->sampled[k];
+		if (engine->constants[i] && old->constants[k])
+			engine->constants[i] = old->constants[k];
+
+		for (c=engine->offsets[i], d=old->offsets[k];
+		     c<engine->offsets[i + 1]; c++, d++) {
+			engine->previous[c] = old->previous[d];
+			engine->previous_times[c] = old->previous_times[d];
+			engine->constant_values[c] = old->constant_values[d];
+
+			s = engine->register_slots[c];
+			t = old->register_slots[d];
+			engine->fault_counts[s] = old->fault_counts[t];
+			engine->fault_skips[s] = old->fault_skips[t];
+			engine->fault_ticks[s] = old->fault_ticks[t];
+			if (engine->cache_valid) {
+				engine->cache_valid[s] = old->cache_valid[t];
+				engine->cache_values[s] = old->cache_values[t];
+			}
 		}
+	}
+}
 
-	end:
-		if (times[i] > now && times[i] < nearest)
-			nearest = times[i];
+/*
+ * Apply the operations received from the control socket since the last
+ * tick, then rebuild the engine buffers and timer if the commands changed,
+ * keeping the state of the commands which stay.
+ * Return 1 if the commands changed, 0 otherwise.
+ */
+static uint8_t apply_control(struct engine *engine, struct timer *timer,
+			     uint64_t now)
+{
+	struct control_op *ops;
+	struct command *commands;
+	struct engine old;
+	uint64_t *nexts;
+	size_t *sources;
+	uint8_t changed = 0;
+	size_t i, nops, mlen = engine->mlen;
+
+	nops = control_pending(&ops);
+	if (nops == 0)
+		return 0;
+
+	commands = malloc((mlen + nops) * sizeof (*commands));
+	nexts = malloc((mlen + nops) * sizeof (*nexts));
+	sources = malloc((mlen + nops) * sizeof (*sources));
+	if (!commands || !nexts || !sources)
+		error("cannot allocate commands");
+
+	memcpy(commands, engine->commands, mlen * sizeof (*commands));
+	for (i=0; i<mlen; i++) {
+		nexts[i] = timer_command_next(timer, i);
+		sources[i] = i;
 	}
 
-	return nearest;
+	mlen = apply_operations(engine, commands, nexts, sources, ops, nops,
+				now, &changed);
+	control_done();
+
+	if (!changed) {
+		free(commands);
+		free(nexts);
+		free(sources);
+		return 0;
+	}
+
+	old = *engine;
+	engine->commands = commands;
+	engine->mlen = mlen;
+	setup_cores(engine);
+	if (setup_layout(engine))
+		error("cannot allocate engine buffers");
+	migrate_layout(engine, &old, sources);
+	release_layout(&old);
+
+	free(engine_commands);
+	engine_commands = commands;
+	free(sources);
+
+	timer_release(timer);
+	if (setup_timer(engine, timer, nexts))
+		error("cannot allocate command timers");
+	free(nexts);
+
+	if (engine->config->realtime)
+		prefault_layout(engine);
+
+	return 1;
 }
 
 
 void execute(const struct command *commands, size_t mlen, const uint8_t *cores,
-	     size_t rlen)
+	     const uint32_t *sockets, size_t rlen,
+	     const struct engine_config *config)
 {
-	uint64_t *times = alloca(mlen * sizeof(uint64_t));
-	uint64_t start = getnow(), now, next;
-	struct timespec ts;
-	msrval_t *values;
-	msradr_t *addresses;
-
-	values = alloca(mlen * rlen * sizeof (msrval_t));
-	addresses = alloca(mlen * rlen * sizeof (msradr_t));
-	
-	print_header(commands, mlen, cores, rlen);
-
-	signal(SIGINT, handle_signal);
-	signal(SIGTERM, handle_signal);
-	signal(SIGQUIT, handle_signal);
-	
-	setup_start_data(addresses, commands, mlen, rlen);
-	setup_next_data(values, commands, mlen, rlen);
-	setup_start_times(times, commands, mlen, start);
+	uint64_t start = getnow(), now, next, *nexts;
+	uint8_t stopped = 0, expired;
+	struct events events;
+	struct engine engine;
+	struct timer timer;
+	uint32_t signals;
+	sigset_t mask;
+	size_t i, count;
+	uint8_t text, ring;
+
+	memset(&engine, 0, sizeof (engine));
+	engine.config = config;
+	engine.start = start;
+
+	engine_commands = malloc((mlen + 1) * sizeof (*commands));
+	engine_cores = malloc((rlen + 1) * sizeof (*cores));
+	engine_sockets = malloc((rlen + 1) * sizeof (*sockets));
+	if (!engine_commands || !engine_cores || !engine_sockets)
+		error("cannot allocate commands");
+	memcpy(engine_commands, commands, mlen * sizeof (*commands));
+	memcpy(engine_cores, cores, rlen * sizeof (*cores));
+	memcpy(engine_sockets, sockets, rlen * sizeof (*sockets));
+
+	engine.commands = engine_commands;
+	engine.mlen = mlen;
+	engine.cores = engine_cores;
+	engine.sockets = engine_sockets;
+	engine.rlen = rlen;
+
+	if (setup_layout(&engine) || setup_rules(&engine))
+		error("cannot allocate engine buffers");
+	if (engine.stamps)
+		engine.origin = stamp_read();
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGQUIT);
+	if (config->summary != SUMMARY_NONE)
+		sigaddset(&mask, SIGUSR1);
+	if (config->recorder_path)
+		sigaddset(&mask, SIGUSR2);
+	if (event_open(&events, &mask))
+		error("cannot create event loop");
+
+	if (config->recorder_path) {
+		if (recorder_open(&engine, config->recorder_path,
+				  config->recorder_seconds))
+			error("cannot create flight recorder: '%s'",
+			      config->recorder_path);
+	}
+
+	if (config->trace_path) {
+		if (trace_open(&engine, config->trace_path,
+			       config->trace_keyframe))
+			error("cannot create trace: '%s'", config->trace_path);
+	}
+
+	if (config->summary != SUMMARY_NONE) {
+		if (summary_open(&engine, config->summary))
+			error("cannot allocate summary statistics");
+	}
+
+	if (config->metrics_address) {
+		if (metrics_open(&engine, config->metrics_address))
+			error("cannot serve metrics on: '%s'",
+			      config->metrics_address);
+	}
+
+	if (config->control_path) {
+		if (control_open(&events, config->control_path))
+			error("cannot create control socket: '%s'",
+			      config->control_path);
+	}
+
+	text = !config->recorder_path && !config->trace_path
+		&& config->summary == SUMMARY_NONE;
+	if (text)
+		print_header(stdout, &engine);
+	if (text && config->window) {
+		if (window_open(&engine, config->window))
+			error("cannot allocate output window");
+	}
+	if (text && config->sparse) {
+		if (sparse_open(&engine, config->sparse))
+			error("cannot allocate sparse output");
+	}
+
+	ring = text && config->trigger.condition.op != CONDITION_NONE
+		&& config->trigger.ticks && !config->window && !config->sparse;
+	if (ring) {
+		if (pretrigger_open(&engine, config->trigger.ticks))
+			error("cannot allocate pre-trigger ring");
+	}
+
+	nexts = malloc((mlen + 1) * sizeof (uint64_t));
+	if (!nexts)
+		error("cannot allocate command timers");
+	for (i=0; i<mlen; i++)
+		nexts[i] = timer_first(&commands[i], start);
+	if (setup_timer(&engine, &timer, nexts))
+		error("cannot allocate command timers");
+	free(nexts);
+
+	if (config->realtime) {
+		if (realtime_setup(config->realtime_cpu,
+				   config->realtime_priority))
+			error("cannot switch to real-time mode on cpu %u",
+			      config->realtime_cpu);
+		prefault_layout(&engine);
+	}
 
 	while (!stopped) {
 		now = getnow();
 
-		apply_commands(values, addresses, times, commands, mlen, cores,
-			       rlen, now);
+		if (config->control_path && apply_control(&engine, &timer, now)
+		    && text) {
+			printf("# schema change\n");
+			print_header(stdout, &engine);
+			pretrigger_close();
+			if (ring && pretrigger_open(&engine,
+						    config->trigger.ticks))
+				error("cannot allocate pre-trigger ring");
+		}
+
+		count = setup_due(&engine, &timer, now);
+
+		if (engine.stamps)
+			apply_commands_percore(&engine);
+		else
+			apply_commands(&engine);
+
+		reduce_commands(&engine, engine.scratch);
 
-		print_data(times, values, commands, mlen, rlen, start, now);
+		if (config->nrules)
+			apply_rules(&engine, now, text);
 
-		next = setup_next_times(times, commands, mlen, now);
-		if (next == ~(0ul))
+		if (config->trigger.condition.op != CONDITION_NONE)
+			check_trigger(&engine, &timer, now, text, ring);
+
+		if (config->recorder_path && count)
+			recorder_write(&engine, now - start);
+		if (config->trace_path && count)
+			trace_write(&engine, now - start);
+		if (config->summary != SUMMARY_NONE)
+			summary_update(&engine);
+		if (config->metrics_address && count)
+			metrics_update(&engine, now - start);
+		if (text && config->window)
+			window_update(stdout, &engine, now - start);
+		else if (text && config->sparse)
+			sparse_update(stdout, &engine, now - start);
+		else if (ring && !engine.burst_end)
+			pretrigger_write(&engine, now - start);
+		else if (text)
+			print_line(stdout, &engine, now - start, engine.due,
+				   engine.stamps, engine.values, engine.valid,
+				   engine.periods);
+
+		adapt_periods(&engine, &timer, now);
+		update_previous(&engine, now);
+
+		next = timer_next(&timer);
+		if (next == ~(0ul) && !config->control_path)
 			break;
-		setup_next_data(values, commands, mlen, rlen);
+		setup_next_data(&engine, 0);
+
+		if (next != ~(0ul) && event_arm(&events, next))
+			error("cannot arm engine timer");
+		do {
+			signals = 0;
+			expired = event_wait(&events, &signals);
+			stopped = handle_signals(&engine, signals);
+		} while (!expired && !stopped && !control_pending(NULL));
 
-		ts.tv_sec  =  (next - now)             / 1000;
-		ts.tv_nsec = ((next - now) - ts.tv_sec * 1000) * 1000000;
-		nanosleep(&ts, NULL);
+		if (expired && config->realtime && next != ~(0ul))
+			realtime_record(next);
 	}
+
+	if (config->summary != SUMMARY_NONE)
+		summary_print(stdout, &engine);
+	if (text && config->window)
+		window_flush(stdout, &engine);
+	if (config->realtime)
+		realtime_report(stderr);
+	if (config->elide_writes)
+		fprintf(stderr, "elided writes: %lu of %lu\n",
+			engine.elided_writes, engine.total_writes);
+
+	control_close(&events);
+	event_close(&events);
+	recorder_close();
+	trace_close();
+	summary_close();
+	metrics_close();
+	window_close();
+	sparse_close();
+	pretrigger_close();
+	timer_release(&timer);
+	release_layout(&engine);
+	release_rules(&engine);
+
+	free(engine_commands);
+	free(engine_cores);
+	free(engine_sockets);
+	engine_commands = NULL;
+	engine_cores = NULL;
+	engine_sockets = NULL;
 }
@@ -0,0 +1,181 @@
+/*
+ * Copyright 2015 Gauthier Voron
+ * This file is part of rwmsr.
+ *
+ * Rwmsr is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Rwmsr is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with rwmsr. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+
+#include "event.h"
+
+
+#define EVENT_BATCH   (EVENT_WATCH_MAX + 2)
+
+
+static int8_t add_fd(struct events *events, int fd)
+{
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof (ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = fd;
+	return epoll_ctl(events->epfd, EPOLL_CTL_ADD, fd, &ev) ? -1 : 0;
+}
+
+int8_t event_open(struct events *events, const sigset_t *mask)
+{
+	events->epfd = -1;
+	events->tfd = -1;
+	events->sfd = -1;
+	events->nwatch = 0;
+	events->mask = *mask;
+
+	if (sigprocmask(SIG_BLOCK, mask, NULL))
+		return -1;
+
+	events->epfd = epoll_create1(EPOLL_CLOEXEC);
+	events->tfd = timerfd_create(CLOCK_REALTIME,
+				     TFD_CLOEXEC | TFD_NONBLOCK);
+	events->sfd = signalfd(-1, mask, SFD_CLOEXEC | SFD_NONBLOCK);
+
+	if (events->epfd < 0 || events->tfd < 0 || events->sfd < 0
+	    || add_fd(events, events->tfd) || add_fd(events, events->sfd)) {
+		event_close(events);
+		return -1;
+	}
+
+	return 0;
+}
+
+int8_t event_watch(struct events *events, int fd, event_handler_t handler,
+		   void *data)
+{
+	if (events->nwatch == EVENT_WATCH_MAX || add_fd(events, fd))
+		return -1;
+
+	events->fds[events->nwatch] = fd;
+	events->handlers[events->nwatch] = handler;
+	events->data[events->nwatch] = data;
+	events->nwatch++;
+	return 0;
+}
+
+void event_unwatch(struct events *events, int fd)
+{
+	size_t k;
+
+	for (k=0; k<events->nwatch; k++)
+		if (events->fds[k] == fd)
+			break;
+	if (k == events->nwatch)
+		return;
+
+	epoll_ctl(events->epfd, EPOLL_CTL_DEL, fd, NULL);
+
+	events->nwatch--;
+	events->fds[k] = events->fds[events->nwatch];
+	events->handlers[k] = events->handlers[events->nwatch];
+	events->data[k] = events->data[events->nwatch];
+}
+
+int8_t event_arm(struct events *events, uint64_t until)
+{
+	struct itimerspec its;
+
+	memset(&its, 0, sizeof (its));
+	its.it_value.tv_sec = until / 1000;
+	its.it_value.tv_nsec = (until % 1000) * 1000000;
+
+	/* A zero it_value would disarm the timer instead. */
+	if (until == 0)
+		its.it_value.tv_nsec = 1;
+
+	if (timerfd_settime(events->tfd, TFD_TIMER_ABSTIME, &its, NULL))
+		return -1;
+	return 0;
+}
+
+/*
+ * Read the pending signals from the signalfd and set their bits.
+ */
+static void read_signals(struct events *events, uint32_t *signals)
+{
+	struct signalfd_siginfo info;
+
+	while (read(events->sfd, &info, sizeof (info)) == sizeof (info))
+		if (info.ssi_signo < 32)
+			*signals |= 1u << info.ssi_signo;
+}
+
+/*
+ * Consume the expirations of the timer.
+ * Return 1 if the timer expired, 0 otherwise.
+ */
+static uint8_t read_timer(struct events *events)
+{
+	uint64_t count;
+
+	return read(events->tfd, &count, sizeof (count)) == sizeof (count);
+}
+
+uint8_t event_wait(struct events *events, uint32_t *signals)
+{
+	struct epoll_event evs[EVENT_BATCH];
+	uint8_t expired = 0;
+	int i, n;
+	size_t k;
+
+	do {
+		n = epoll_wait(events->epfd, evs, EVENT_BATCH, -1);
+	} while (n < 0 && errno == EINTR);
+	if (n < 0)
+		return 1;
+
+	for (i=0; i<n; i++) {
+		if (evs[i].data.fd == events->tfd) {
+			expired |= read_timer(events);
+		} else if (evs[i].data.fd == events->sfd) {
+			read_signals(events, signals);
+		} else {
+			for (k=0; k<events->nwatch; k++)
+				if (events->fds[k] == evs[i].data.fd)
+					events->handlers[k](events->fds[k],
+							    events->data[k]);
+		}
+	}
+
+	return expired;
+}
+
+void event_close(struct events *events)
+{
+	if (events->epfd >= 0)
+		close(events->epfd);
+	if (events->tfd >= 0)
+		close(events->tfd);
+	if (events->sfd >= 0)
+		close(events->sfd);
+	events->epfd = -1;
+	events->tfd = -1;
+	events->sfd = -1;
+}
@@ -27,6 +27,7 @@
 #include <sys/types.h>
 #include <sys/wait.h>
 
+#include "capture.h"
 #include "loader.h"
 #include "main.h"
 
@@ -41,6 +42,9 @@ static int8_t (*_destroy)(void);
 
 static int8_t (*_coreinfo)(size_t *numcore, size_t *maxid);
 
+static int8_t (*_socketinfo)(uint32_t *sockets, const uint8_t *cores,
+			     size_t len);
+
 static size_t (*_rdmsr_arr)(msrval_t *vals, const msradr_t *addrs,
 			    const uint8_t *cores, size_t len);
 
@@ -50,6 +54,18 @@ static size_t (*_wrmsr_arr)(const msradr_t *addrs, const msrval_t *vals,
 static size_t (*_rwmsr_arr)(const msradr_t *addrs, msrval_t *vals,
 			    const uint8_t *cores, size_t len);
 
+static size_t (*_rdmsr_map)(msrval_t *vals, const msradr_t *addrs,
+			    const uint8_t *cores, size_t len,
+			    uint64_t *success);
+
+static size_t (*_rwmsr_map)(const msradr_t *addrs, msrval_t *vals,
+			    const uint8_t *cores, size_t len,
+			    uint64_t *success);
+
+static size_t (*_rmwmsr_map)(const msradr_t *addrs, msrval_t *vals,
+			     const msrval_t *masks, const uint8_t *cores,
+			     size_t len, uint64_t *success);
+
 
 /*
  * Check if the operating system is GNU/Linux.
@@ -158,6 +174,16 @@ static int8_t load_file(const char *system, const char *file)
 	LOAD_SYMBOL(rwmsr_arr)
 #undef LOAD_SYMBOL
 
+#define LOAD_OPTIONAL_SYMBOL(symb)					\
+	*(void **) (&_##symb) = dlsym(handle, #symb);			\
+	if (dlerror())							\
+		_##symb = NULL;
+	LOAD_OPTIONAL_SYMBOL(socketinfo)
+	LOAD_OPTIONAL_SYMBOL(rdmsr_map)
+	LOAD_OPTIONAL_SYMBOL(rwmsr_map)
+	LOAD_OPTIONAL_SYMBOL(rmwmsr_map)
+#undef LOAD_OPTIONAL_SYMBOL
+
 	if (init(system)) {
 		if (verbose)
 			vlog("cannot initialize : '%s'", file);
@@ -295,6 +321,28 @@ int8_t coreinfo(size_t *numcore, size_t *maxid)
 }
 
 
+int8_t socketinfo(uint32_t *sockets, const uint8_t *cores, size_t len)
+{
+	int8_t ret;
+	const char *prev = module;
+
+	/*
+	 * The modules which do not know the sockets put all the cores on a
+	 * single socket.
+	 */
+	if (!_socketinfo) {
+		memset(sockets, 0, len * sizeof (uint32_t));
+		return 0;
+	}
+
+	module = _name;
+	ret = _socketinfo(sockets, cores, len);
+	module = prev;
+
+	return ret;
+}
+
+
 size_t rdmsr_arr(msrval_t *vals, const msradr_t *addrs, const uint8_t *cores,
 		 size_t len)
 {
@@ -305,6 +353,9 @@ size_t rdmsr_arr(msrval_t *vals, const msradr_t *addrs, const uint8_t *cores,
 	ret = _rdmsr_arr(vals, addrs, cores, len);
 	module = prev;
 
+	if (capture_enabled())
+		capture_write(CAPTURE_READ, addrs, vals, NULL, cores, len,
+			      NULL, ret);
 	return ret;
 }
 	
@@ -318,6 +369,9 @@ size_t wrmsr_arr(const msradr_t *addrs, const msrval_t *vals,
 	ret = _wrmsr_arr(addrs, vals, cores, len);
 	module = prev;
 
+	if (capture_enabled())
+		capture_write(CAPTURE_WRITE, addrs, NULL, vals, cores, len,
+			      NULL, ret);
 	return ret;
 }
 
@@ -326,10 +380,197 @@ size_t rwmsr_arr(const msradr_t *addrs, msrval_t *vals, const uint8_t *cores,
 {
 	size_t ret;
 	const char *prev = module;
+	const msrval_t *written = NULL;
+
+	if (capture_enabled())
+		written = capture_stash(vals, len);
 
 	module = _name;
 	ret = _rwmsr_arr(addrs, vals, cores, len);
 	module = prev;
 
+	if (written)
+		capture_write(CAPTURE_READWRITE, addrs, vals, written, cores,
+			      len, NULL, ret);
+	return ret;
+}
+
+
+/*
+ * Set the bits of the len first accesses in the success bitmap to the given
+ * value.
+ */
+static void fill_success(uint64_t *success, size_t len, uint8_t value)
+{
+	memset(success, value ? 0xff : 0, (len + 63) / 64 * sizeof (uint64_t));
+}
+
+static size_t read_map(msrval_t *vals, const msradr_t *addrs,
+		       const uint8_t *cores, size_t len, uint64_t *success)
+{
+	size_t i, ret;
+
+	if (_rdmsr_map)
+		return _rdmsr_map(vals, addrs, cores, len, success);
+
+	ret = _rdmsr_arr(vals, addrs, cores, len);
+	fill_success(success, len, ret == len);
+	if (ret == len)
+		return ret;
+
+	/*
+	 * The module does not tell which reads failed, so retry them one by
+	 * one to find out.
+	 */
+	for (i=0, ret=0; i<len; i++) {
+		if (_rdmsr_arr(vals + i, addrs + i, cores + i, 1) != 1)
+			continue;
+		success[i / 64] |= 1ul << (i % 64);
+		ret++;
+	}
+
+	return ret;
+}
+
+static size_t readwrite_map(const msradr_t *addrs, msrval_t *vals,
+			    const uint8_t *cores, size_t len,
+			    uint64_t *success)
+{
+	size_t ret;
+
+	if (_rwmsr_map)
+		return _rwmsr_map(addrs, vals, cores, len, success);
+
+	/*
+	 * The read-writes cannot be retried without writing twice, so they
+	 * all count as failed if one of them failed.
+	 */
+	ret = _rwmsr_arr(addrs, vals, cores, len);
+	fill_success(success, len, ret == len);
+	if (ret != len)
+		ret = 0;
+	return ret;
+}
+
+/*
+ * Perform the read-modify-writes of a module without rmwmsr_map() by reading
+ * the registers, then read-writing the successfully read ones with the
+ * merged values. A register may change between the two calls.
+ */
+static size_t emulate_rmw(const msradr_t *addrs, msrval_t *vals,
+			  const msrval_t *masks, const uint8_t *cores,
+			  size_t len, uint64_t *success)
+{
+	static msrval_t *olds = NULL;
+	static size_t size = 0;
+	msrval_t *tmp;
+	uint64_t bit;
+	size_t i, ret;
+
+	if (len > size) {
+		tmp = realloc(olds, len * sizeof (msrval_t));
+		if (!tmp) {
+			fill_success(success, len, 0);
+			return 0;
+		}
+		olds = tmp;
+		size = len;
+	}
+
+	/*
+	 * The whole registers written do not need to be read first, so they
+	 * are read-written even if they cannot be read.
+	 */
+	read_map(olds, addrs, cores, len, success);
+	for (i=0, ret=0; i<len; i++) {
+		if (masks[i] == ~(0ul))
+			success[i / 64] |= 1ul << (i % 64);
+		ret += (success[i / 64] >> (i % 64)) & 1;
+	}
+
+	if (ret == len) {
+		for (i=0; i<len; i++)
+			vals[i] = (olds[i] & ~masks[i]) | (vals[i] & masks[i]);
+		return readwrite_map(addrs, vals, cores, len, success);
+	}
+
+	for (i=0, ret=0; i<len; i++) {
+		if (!((success[i / 64] >> (i % 64)) & 1))
+			continue;
+		vals[i] = (olds[i] & ~masks[i]) | (vals[i] & masks[i]);
+		if (readwrite_map(addrs + i, vals + i, cores + i, 1, &bit)) {
+			ret++;
+			continue;
+		}
+		success[i / 64] &= ~(1ul << (i % 64));
+	}
+
+	return ret;
+}
+
+size_t rdmsr_map(msrval_t *vals, const msradr_t *addrs, const uint8_t *cores,
+		 size_t len, uint64_t *success)
+{
+	size_t ret;
+	const char *prev = module;
+
+	module = _name;
+	ret = read_map(vals, addrs, cores, len, success);
+	module = prev;
+
+	if (capture_enabled())
+		capture_write(CAPTURE_READ, addrs, vals, NULL, cores, len,
+			      success, ret);
+	return ret;
+}
+
+size_t rwmsr_map(const msradr_t *addrs, msrval_t *vals, const uint8_t *cores,
+		 size_t len, uint64_t *success)
+{
+	size_t ret;
+	const char *prev = module;
+	const msrval_t *written = NULL;
+
+	if (capture_enabled())
+		written = capture_stash(vals, len);
+
+	module = _name;
+	ret = readwrite_map(addrs, vals, cores, len, success);
+	module = prev;
+
+	if (written)
+		capture_write(CAPTURE_READWRITE, addrs, vals, written, cores,
+			      len, success, ret);
+	return ret;
+}
+
+size_t rmwmsr_map(const msradr_t *addrs, msrval_t *vals, const msrval_t *masks,
+		  const uint8_t *cores, size_t len, uint64_t *success)
+{
+	size_t i, ret;
+	const char *prev = module;
+	const msrval_t *written = NULL;
+
+	for (i=0; i<len; i++)
+		if (masks[i] != ~(0ul))
+			break;
+	if (i == len && !_rmwmsr_map)
+		return rwmsr_map(addrs, vals, cores, len, success);
+
+	if (capture_enabled())
+		written = capture_stash(vals, len);
+
+	module = _name;
+	if (_rmwmsr_map)
+		ret = _rmwmsr_map(addrs, vals, masks, cores, len, success);
+	else
+		ret = emulate_rmw(addrs, vals, masks, cores, len, success);
+	module = prev;
+
+	if (written) {
+		written = capture_merge(vals, masks, len);
+		capture_write(CAPTURE_READWRITE, addrs, vals, written, cores,
+			      len, success, ret);
+	}
 	return ret;
 }
@@ -26,16 +26,22 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "capture.h"
 #include "engine.h"
 #include "loader.h"
 #include "parse.h"
+#include "realtime.h"
 #include "rwmsr.h"
+#include "stamp.h"
+#include "summary.h"
 
 
 #define PATH_ENV  "MSR_PATH"
 
+#define DEFAULT_KEYFRAME  1000
 
-static const char     *options_string = "hVvs:p:c:";
+
+static const char     *options_string = "hVvs:p:c:f:t:r:o:S::m:R:C:Ea:w:T:L:d:";
 static struct option   options[] = {
 	{"help",    no_argument,       0, 'h'},
 	{"version", no_argument,       0, 'V'},
@@ -43,6 +49,20 @@ static struct option   options[] = {
 	{"system",  required_argument, 0, 's'},
 	{"path",    required_argument, 0, 'p'},
 	{"cores",   required_argument, 0, 'c'},
+	{"commands-file", required_argument, 0, 'f'},
+	{"timestamps", required_argument, 0, 't'},
+	{"flight-recorder", required_argument, 0, 'r'},
+	{"trace",   required_argument, 0, 'o'},
+	{"summary", optional_argument, 0, 'S'},
+	{"metrics", required_argument, 0, 'm'},
+	{"realtime", required_argument, 0, 'R'},
+	{"control", required_argument, 0, 'C'},
+	{"elide-writes", no_argument,  0, 'E'},
+	{"capture", required_argument, 0, 'a'},
+	{"window",  required_argument, 0, 'w'},
+	{"trigger", required_argument, 0, 'T'},
+	{"rule",    required_argument, 0, 'L'},
+	{"sparse",  required_argument, 0, 'd'},
 	{ NULL,     0,                 0,  0 }
 };
 
@@ -63,22 +83,44 @@ static struct command *commands;
 static size_t          commands_size;
 static size_t          commands_count;
 
+static struct rule    *rules;
+static size_t          rules_size;
+static size_t          rules_count;
+
 static uint8_t        *engine_cores;
+static uint32_t       *engine_sockets;
 static size_t          engine_cores_size;
 
+static struct engine_config  engine_config;
+
+static const char     *capture_path = NULL;
+
 
 static void usage(void)
 {
 	printf("Usage: rwmsr [-h | --help] [-V | --version]\n"
 	       "       rwmsr [-v] [-s <system>] [-p <paths>] [-c <cores>] "
-	       "<commands...>\n"
+	       "[-f <file>]\n"
+	       "             [-t <clock>] [-r <file>,<seconds>] "
+	       "[-o <file>[,<keyframe>]]\n"
+	       "             [-S[<mode>]] [-m <address>] "
+	       "[-R <cpu>[,<priority>]]\n"
+	       "             [-C <path>] [-E] [-a <file>] [-w <window>] "
+	       "[-T <trigger>]\n"
+	       "             [-d <keyframe>] [-L <rule>]... <commands...>\n"
 	       "Read and write Machine Specific Registers.\n"
 	       "Allow the user to read and write MSRs instantly or "
 	       "perdiodically throught a set\n"
 	       "of commands. Each command is in the following form:\n"
 	       "\n"
-	       "  commands ::= [':'[':']] <address> ['=' <value] ['@' <delay> "
-	       "['-' <repeat>]]\n"
+	       "  commands ::= [':'[':']] <address> ['-' <last> "
+	       "['+' <stride>]]\n"
+	       "               ['.const'] ['/' <reduce> ['.socket']] "
+	       "['%%' <cores>] [<write>]\n"
+	       "               ['@' <delay> ['-' <repeat> ['-' <max> "
+	       "['~' <threshold>]]]]\n"
+	       "  write    ::= '=' <value> | '|=' <value> | '&=~' <value>\n"
+	       "             | '[' <hi> ':' <lo> ']=' <value>\n"
 	       "\n");
 	printf("The <address> is the MSR address and the optional <value> is "
 	       "what to write in\n"
@@ -90,11 +132,52 @@ static void usage(void)
 	printf("hexadecimal form. In the last case, they should start with "
 	       "'0x' or 'x'.\n"
 	       "\n"
+	       "With a <last> address, the command is repeated for each "
+	       "address from <address>\n"
+	       "to <last> included, every <stride> addresses (1 by default), "
+	       "as in '::0xc1-0xc8'\n"
+	       "for the eight first general purpose counters. Each address "
+	       "has its own columns\n"
+	       "and the whole range is accessed in the same batch, with one "
+	       "access per address.\n"
+	       "\n"
 	       "The leading ':' or '::' optional characters indicate if the "
 	       "value of the\n"
 	       "register should be printed. ':' indicates to print it in "
 	       "decimal form whereas\n"
 	       "'::' indicates hexadecimal form is required.\n"
+	       "\n"
+	       "The optional <write> replaces the whole register with '=', or "
+	       "only some bits:\n"
+	       "'|=' sets the bits of <value>, '&=~' clears them and "
+	       "'[<hi>:<lo>]=' sets the\n"
+	       "bits <hi> down to <lo> included to <value>, as in "
+	       "'0x1b0[3:0]=6'. These are\n"
+	       "done by the backend as a single read-modify-write per core, "
+	       "and the printed\n"
+	       "value is the one before the write.\n"
+	       "\n"
+	       "The optional <reduce> operation is one of 'sum', 'min', 'max' "
+	       "or 'mean'. It\n"
+	       "indicates to print a single column with the reduction of the "
+	       "values of all the\n"
+	       "cores instead of one column per core, or one column per "
+	       "socket with the\n"
+	       "'.socket' suffix.\n"
+	       "\n"
+	       "The optional <cores> set, in the same form than for the '-c' "
+	       "option below,\n"
+	       "indicates the cores on which to execute the command instead of "
+	       "the global set\n"
+	       "of cores, as in '::0x611%%0,64'.\n"
+	       "\n"
+	       "The optional '.const' suffix indicates that the register "
+	       "never changes, so it\n"
+	       "is read only once and then printed from memory. This is "
+	       "implicit for a few\n"
+	       "registers known to be invariant, such as MSR_PLATFORM_INFO "
+	       "(0xce) or\n"
+	       "MSR_RAPL_POWER_UNIT (0x606), unless a command writes them.\n"
 	       "\n");
 	printf("The optional <delay> value is an amount of millisecond to "
 	       "wait before to\n"
@@ -105,6 +188,25 @@ static void usage(void)
 	       "execute the command again. When this value is specified, the "
 	       "command is\n"
 	       "executed periodically until the user kills the program.\n"
+	       "With a <max> value, the period is adaptive: it starts at "
+	       "<repeat> and doubles\n"
+	       "up to <max> milliseconds while the values change by at most "
+	       "<threshold>\n"
+	       "(default 0) between two executions, and halves down to <repeat> "
+	       "otherwise. The\n"
+	       "current period of each printed adaptive command is output in "
+	       "a\n"
+	       "'period(<address>)' column after its values.\n"
+	       "The commands executed at the same time are sent together to "
+	       "the backend, the\n"
+	       "writes first, so a read returns the value written by a command "
+	       "of the same\n"
+	       "time. A register read by several commands is read only once.\n"
+	       "A '-' is printed in place of the value of a command which is "
+	       "not executed at\n"
+	       "this time, or whose access failed. The reductions only use the "
+	       "values of the\n"
+	       "accesses which succeeded.\n"
 	       "\n"
 	       "\n");
 	printf("By default, the MSR of the current core are used. This "
@@ -126,6 +228,111 @@ static void usage(void)
 	       "several times.\n"
 	       "\n"
 	       "\n");
+	printf("Commands can also be loaded from a file with the '-f' "
+	       "(or '--commands-file')\n"
+	       "option. The file contains one command per line, blank lines "
+	       "are ignored and\n"
+	       "the '#' character starts a comment running until the end of "
+	       "the line. Commands\n"
+	       "identical to a previous one are ignored. This option can be "
+	       "specified several\n"
+	       "times and is processed before the command line commands.\n"
+	       "\n"
+	       "\n");
+	printf("By default, each output line is stamped with the time of "
+	       "its tick, in\n"
+	       "milliseconds. The '-t' (or '--timestamps') option makes the "
+	       "accesses to be\n"
+	       "performed core after core and adds a column per core with "
+	       "the time of its\n"
+	       "accesses, in nanoseconds since the start. The option value is "
+	       "the clock to use,\n"
+	       "either 'tsc' for the processor timestamp counter, or 'raw' "
+	       "for the\n"
+	       "CLOCK_MONOTONIC_RAW clock.\n"
+	       "\n"
+	       "\n");
+	printf("The '-r' (or '--flight-recorder') option disables the "
+	       "regular output and\n"
+	       "records the ticks in a memory mapped ring file instead, "
+	       "large enough to keep\n"
+	       "the last <seconds> seconds. When the program receives the "
+	       "SIGUSR2 signal, the\n"
+	       "recorded window is printed on the standard output. The ring "
+	       "file stays readable\n"
+	       "if the program crashes.\n"
+	       "\n"
+	       "The '-o' (or '--trace') option disables the regular output "
+	       "and writes a compact\n"
+	       "binary trace in the given file instead. Each value is "
+	       "encoded as a variable\n"
+	       "length difference with its previous value, and a full "
+	       "keyframe is written every\n"
+	       "<keyframe> ticks (%d by default). The 'rwmsr-decode' program "
+	       "prints the\n"
+	       "content of a trace or flight recorder file in the regular "
+	       "format.\n"
+	       "\n"
+	       "\n", DEFAULT_KEYFRAME);
+	printf("The '-S' (or '--summary') option disables the regular "
+	       "output and only prints\n"
+	       "statistics about each printed column when the program stops, "
+	       "or when it\n"
+	       "receives the SIGUSR1 signal: count, mean, standard deviation, "
+	       "min, max and\n"
+	       "estimated 50th, 90th and 99th percentiles. With the 'delta' "
+	       "mode (as in\n"
+	       "'-Sdelta' or '--summary=delta'), the statistics are about the "
+	       "differences\n"
+	       "between successive values of the columns instead.\n"
+	       "\n"
+	       "\n");
+	printf("The '-m' (or '--metrics') option serves the last values of "
+	       "the printed columns\n"
+	       "over HTTP in the OpenMetrics text format. The <address> is "
+	       "either the path of\n"
+	       "a Unix domain socket to create, or a TCP port to listen to on "
+	       "the localhost\n"
+	       "interface. The requests are served by a separate thread and "
+	       "never delay the\n"
+	       "accesses to the registers.\n"
+	       "\n"
+	       "\n");
+	printf("The '-R' (or '--realtime') option runs the sampling with the "
+	       "SCHED_FIFO\n"
+	       "policy at the given <priority> (%d by default), pinned on the "
+	       "given <cpu>\n"
+	       "which must not be one of the used cores. The memory of the "
+	       "program is locked\n"
+	       "and prefaulted, and the percentiles of the wakeup latencies "
+	       "are printed on the\n"
+	       "standard error when the program stops.\n"
+	       "\n"
+	       "\n", REALTIME_DEFAULT_PRIORITY);
+	printf("The '-C' (or '--control') option creates a Unix domain "
+	       "socket at the given\n"
+	       "<path> to change the commands without restarting. Each line "
+	       "sent on the socket\n"
+	       "is one of 'add <command>', 'remove <index>', 'period <index> "
+	       "<repeat>' or 'list'\n"
+	       "and is answered by 'ok' or 'error: <message>'. The changes are "
+	       "applied between\n"
+	       "two ticks and a new header is printed when the columns change. "
+	       "This option\n"
+	       "only works with the text output.\n"
+	       "\n"
+	       "\n");
+	printf("The '-E' (or '--elide-writes') option remembers the last "
+	       "value read or written\n"
+	       "in each register and skips the writes of the value it already "
+	       "contains. This\n"
+	       "assumes that nothing else writes the registers between two "
+	       "accesses of rwmsr.\n"
+	       "The number of skipped writes is printed on the standard error "
+	       "when the program\n"
+	       "stops.\n"
+	       "\n"
+	       "\n");
 	printf("This program can run on multiple systems. Currently, it can "
 	       "work under\n"
 	       "bare-metal GNU/Linux (codename 'linux'), or under Xen "
@@ -135,6 +342,120 @@ static void usage(void)
 	       "the current system, but user can override this with the '-s' "
 	       "(or '--system')\n"
 	       "option.\n"
+	       "\n"
+	       "The system 'mmio:<path>[,<offset>[,<size>[,<width>]]]' is never "
+	       "detected and\n"
+	       "accesses memory-mapped registers instead of MSRs, like the "
+	       "uncore counters of a\n"
+	       "PCI BAR. The register window of <size> bytes at <offset> in the "
+	       "file <path>\n"
+	       "(such as /dev/mem or a sysfs 'resource' file) is mapped once, "
+	       "and the addresses\n"
+	       "of the commands are byte offsets in this window. The registers "
+	       "are <width> bytes\n"
+	       "wide, either 4 or 8 (the default), and are seen as those of a "
+	       "single core 0.\n"
+	       "\n"
+	       "The '-a' (or '--capture') option records every access made "
+	       "to the module in\n"
+	       "the given <file>. The system 'replay:<file>[,fast]' serves "
+	       "back the values read\n"
+	       "in a capture, register by register in the recorded order. "
+	       "Each value is served\n"
+	       "at the time it was recorded, relative to the first access, or "
+	       "immediately with\n"
+	       "',fast'. The writes are ignored.\n"
+	       "\n");
+	printf("The '-w' (or '--window') option prints one line per <window> "
+	       "milliseconds\n"
+	       "instead of one line per tick. Each column then contains the "
+	       "minimum, maximum,\n"
+	       "mean and last values of the window separated by '/', so the "
+	       "commands can be\n"
+	       "sampled fast without losing the peaks. This option only works "
+	       "with the text\n"
+	       "output.\n"
+	       "\n"
+	       "\n");
+	printf("The '-d' (or '--sparse') option only prints the columns whose "
+	       "value changed\n"
+	       "since they were last printed, each as '<column>=<value>' with "
+	       "the column named\n"
+	       "as in the header line, and skips the ticks where nothing "
+	       "changed. Every\n"
+	       "<keyframe> sampling ticks, all the known columns are printed "
+	       "instead. This\n"
+	       "option only works with the text output, without timestamps.\n"
+	       "\n"
+	       "\n");
+	printf("The '-T' (or '--trigger') option switches the periodic "
+	       "commands to a burst\n"
+	       "rate while a condition holds on the values read at an address. "
+	       "The trigger is\n"
+	       "in the form '<condition>,<period>,<duration>[,<ticks>]' where "
+	       "the condition is\n"
+	       "in the form '<address>[&<mask>][.delta|.rate]<op><threshold>' "
+	       "and <op> is one\n"
+	       "of '<', '<=', '==', '!=', '>=' or '>'. When a value read at "
+	       "<address>, masked\n"
+	       "with <mask>, satisfies the condition, the periodic commands "
+	       "repeat every\n"
+	       "<period> milliseconds at most, during <duration> milliseconds "
+	       "after the last\n"
+	       "time the condition held. The start and end of each burst are "
+	       "marked with a\n"
+	       "'# burst start' and '# burst end' line.\n"
+	       "With '.delta', the threshold is compared to the increase of the "
+	       "bits of <mask>\n"
+	       "since the previous read, and with '.rate' to this increase per "
+	       "second, as in\n"
+	       "'0x611&0xffffffff.rate>3000000,5,1000' for the package energy "
+	       "counter. The\n"
+	       "increase wraps around the width of <mask>.\n"
+	       "Between the bursts, the lines are not printed but the last "
+	       "<ticks> (16 by\n"
+	       "default) are kept in memory, and printed right before the '# "
+	       "burst start' line,\n"
+	       "so the ticks preceding the trigger are output along with the "
+	       "burst. With\n"
+	       "<ticks> set to 0, or with the '-w' or '-d' options, all the "
+	       "lines are printed\n"
+	       "instead. With the '-r' option, the flight recorder window is "
+	       "dumped at the end\n"
+	       "of each burst, as on SIGUSR2.\n"
+	       "\n"
+	       "\n");
+	printf("The '-L' (or '--rule') option, which can be repeated, writes "
+	       "registers in\n"
+	       "reaction to the values read, without leaving the engine. A rule "
+	       "is in the form\n"
+	       "'<condition>[~<release>]?<command>[?<command>]' where "
+	       "<condition> is in the same\n"
+	       "form than for '-T' and each <command> is a write command "
+	       "without ':' nor '@'.\n"
+	       "When the condition starts holding, the first command is "
+	       "written. The second\n"
+	       "command, if any, is written once the condition no longer holds "
+	       "with <release>\n"
+	       "in place of the threshold, as in "
+	       "'0x611>5000~4000?0x620[6:0]=20?0x620[6:0]=24'.\n"
+	       "The write of a rule command can also be '+=<step>' or "
+	       "'-=<step>', alone or after\n"
+	       "'[<hi>:<lo>]', to add or subtract <step> to the current "
+	       "value of the register or\n"
+	       "of its bits <hi> to <lo>, saturating at 0 and at the largest "
+	       "value, as in\n"
+	       "'0x611.rate>3000000~2500000?0x620[6:0]-=1?0x620[6:0]+=1'. The "
+	       "registers to step\n"
+	       "are read with one more call to the backend, just before the "
+	       "write.\n"
+	       "The writes of the rules are done right after the tick which "
+	       "triggers them,\n"
+	       "with a single read-modify-write call to the backend. With the "
+	       "text output, each\n"
+	       "switch is marked with a '# rule <index> on' or "
+	       "'# rule <index> off' line.\n"
+	       "\n"
 	       "\n");
 	printf("Once the system has been detected (or provided), the program "
 	       "searches an\n"
@@ -231,6 +552,20 @@ static int parse_early_options(int argc, char *const *argv)
 			break;
 			
 		case 'c':
+		case 'f':
+		case 't':
+		case 'r':
+		case 'o':
+		case 'S':
+		case 'm':
+		case 'R':
+		case 'C':
+		case 'E':
+		case 'a':
+		case 'w':
+		case 'T':
+		case 'L':
+		case 'd':
 			break;
 
 		default:
@@ -243,11 +578,121 @@ static int parse_early_options(int argc, char *const *argv)
 	return 0;
 }
 
+static void load_commands_file(const char *path)
+{
+	size_t line;
+	const char *err;
+
+	err = parse_commands_file(&commands, &commands_count, &commands_size,
+				  path, &line);
+	if (err && line == 0)
+		error("cannot load commands file: '%s'", path);
+	if (err)
+		error("%s:%lu: command syntax error: '%s'", path, line, err);
+	if (verbose)
+		vlog("loaded %lu commands from '%s'", commands_count, path);
+}
+
+static void add_command(const char *str)
+{
+	const char *err;
+	struct command command, *tmp;
+	size_t count;
+
+	err = parse_command(&command, str);
+	if (err)
+		error("command sytax error: '%s'", err);
+
+	count = expand_command(NULL, &command);
+	if (commands_count + count > commands_size) {
+		while (commands_count + count > commands_size)
+			commands_size = commands_size ? commands_size * 2 : 16;
+		tmp = realloc(commands, commands_size * sizeof (*commands));
+		if (!tmp)
+			error("cannot allocate commands");
+		commands = tmp;
+	}
+
+	expand_command(&commands[commands_count], &command);
+	commands_count += count;
+}
+
+static void add_rule(const char *str)
+{
+	const char *err;
+	struct rule *tmp;
+
+	if (rules_count == rules_size) {
+		rules_size = rules_size ? rules_size * 2 : 4;
+		tmp = realloc(rules, rules_size * sizeof (*rules));
+		if (!tmp)
+			error("cannot allocate rules");
+		rules = tmp;
+	}
+
+	err = parse_rule(&rules[rules_count], str);
+	if (err)
+		error("rule syntax error: '%s'", err);
+	rules_count++;
+}
+
+static void parse_recorder(char *str)
+{
+	char *comma = strrchr(str, ',');
+	char *err;
+
+	if (!comma || comma == str)
+		error("invalid flight recorder parameter: '%s'", str);
+
+	*comma = '\0';
+	engine_config.recorder_path = str;
+	engine_config.recorder_seconds = strtol(comma + 1, &err, 10);
+	if (*err || err == comma + 1 || engine_config.recorder_seconds == 0)
+		error("invalid flight recorder duration: '%s'", comma + 1);
+}
+
+static void parse_trace(char *str)
+{
+	char *comma = strrchr(str, ',');
+	char *err;
+
+	engine_config.trace_path = str;
+	engine_config.trace_keyframe = DEFAULT_KEYFRAME;
+	if (!comma)
+		return;
+
+	*comma = '\0';
+	engine_config.trace_keyframe = strtol(comma + 1, &err, 10);
+	if (*err || err == comma + 1 || engine_config.trace_keyframe == 0)
+		error("invalid trace keyframe interval: '%s'", comma + 1);
+}
+
+static void parse_realtime(const char *str)
+{
+	char *err;
+	long priority;
+
+	engine_config.realtime = 1;
+	engine_config.realtime_priority = REALTIME_DEFAULT_PRIORITY;
+	engine_config.realtime_cpu = strtol(str, &err, 10);
+	if (err == str || (*err && *err != ','))
+		error("invalid real-time cpu: '%s'", str);
+	if (*err == '\0')
+		return;
+
+	str = err + 1;
+	priority = strtol(str, &err, 10);
+	if (*err || err == str || priority < 1 || priority > 99)
+		error("invalid real-time priority: '%s'", str);
+	engine_config.realtime_priority = priority;
+}
+
 static int parse_late_options(int argc, char *const *argv)
 {
 	int c;
 	size_t i;
 	const char *err;
+	char *end;
 
 	while (1) {
 		c = getopt_long(argc, argv, options_string, options, NULL);
@@ -266,6 +711,79 @@ static int parse_late_options(int argc, char *const *argv)
 				error("invalid core parameter: '%s'", optarg);
 			break;
 
+		case 'f':
+			load_commands_file(optarg);
+			break;
+
+		case 't':
+			if (!strcmp(optarg, "tsc"))
+				engine_config.timestamps = STAMP_TSC;
+			else if (!strcmp(optarg, "raw"))
+				engine_config.timestamps = STAMP_RAW;
+			else
+				error("invalid timestamps clock: '%s'", optarg);
+			break;
+
+		case 'r':
+			parse_recorder(optarg);
+			break;
+
+		case 'o':
+			parse_trace(optarg);
+			break;
+
+		case 'S':
+			if (!optarg || !strcmp(optarg, "value"))
+				engine_config.summary = SUMMARY_VALUE;
+			else if (!strcmp(optarg, "delta"))
+				engine_config.summary = SUMMARY_DELTA;
+			else
+				error("invalid summary mode: '%s'", optarg);
+			break;
+
+		case 'm':
+			engine_config.metrics_address = optarg;
+			break;
+
+		case 'R':
+			parse_realtime(optarg);
+			break;
+
+		case 'C':
+			engine_config.control_path = optarg;
+			break;
+
+		case 'E':
+			engine_config.elide_writes = 1;
+			break;
+
+		case 'a':
+			capture_path = optarg;
+			break;
+
+		case 'w':
+			engine_config.window = strtoul(optarg, &end, 10);
+			if (*end || engine_config.window == 0)
+				error("invalid window: '%s'", optarg);
+			break;
+
+		case 'T':
+			err = parse_trigger(&engine_config.trigger, optarg);
+			if (err)
+				error("invalid trigger: '%s'", optarg);
+			break;
+
+		case 'L':
+			add_rule(optarg);
+			break;
+
+		case 'd':
+			engine_config.sparse = strtoul(optarg, &end, 10);
+			if (*end || engine_config.sparse == 0)
+				error("invalid sparse keyframe interval: '%s'",
+				      optarg);
+			break;
+
 		case 'h':
 		case 'V':
 		case 'v':
@@ -317,31 +835,127 @@ static void setup_early_config(void)
 	cores = calloc(cores_size, sizeof (sizeof(uint8_t)));
 }
 
+/*
+ * Set the cores of a command without cores to the global core set, or check
+ * the cores of the command otherwise.
+ */
+static void setup_command_cores(struct command *cmd)
+{
+	size_t j;
+
+	for (j=0; j<CORES_MAX; j++) {
+		if (cmd->flags & COMMAND_CORES) {
+			if (COMMAND_HAS_CORE(cmd, j) && j >= cores_size)
+				error("invalid core for command 0x%lx: %lu",
+				      cmd->address, j);
+		} else if (j < cores_size && cores[j]) {
+			COMMAND_SET_CORE(cmd, j);
+		}
+	}
+}
+
 static void setup_late_config(void)
 {
-	size_t i;
-	
+	size_t i, j;
+	uint8_t global = 0;
+
+	for (i=0; i<commands_count; i++)
+		if (!(commands[i].flags & COMMAND_CORES))
+			global = 1;
+	for (i=0; i<rules_count; i++)
+		if (!(rules[i].on.flags & COMMAND_CORES)
+		    || (rules[i].off.flags
+			&& !(rules[i].off.flags & COMMAND_CORES)))
+			global = 1;
+
 	engine_cores_size = 0;
 	for (i=0; i<cores_size; i++)
 		if (cores[i])
 			engine_cores_size++;
 
-	if (engine_cores_size == 0) {
+	if (engine_cores_size == 0 && (global || engine_config.control_path))
 		cores[sched_getcpu()] = 1;
-		engine_cores_size = 1;
+
+	engine_config.cores_size = cores_size;
+	for (i=0; i<cores_size; i++)
+		if (cores[i])
+			COMMAND_SET_CORE(&engine_config, i);
+
+	for (i=0; i<commands_count; i++)
+		setup_command_cores(&commands[i]);
+	for (i=0; i<rules_count; i++) {
+		setup_command_cores(&rules[i].on);
+		if (rules[i].off.flags)
+			setup_command_cores(&rules[i].off);
+	}
+	engine_config.rules = rules;
+	engine_config.nrules = rules_count;
+
+	for (i=0; i<cores_size; i++) {
+		cores[i] = 0;
+		for (j=0; j<commands_count; j++)
+			if (COMMAND_HAS_CORE(&commands[j], i))
+				cores[i] = 1;
 	}
 
+	engine_cores_size = 0;
+	for (i=0; i<cores_size; i++)
+		if (cores[i])
+			engine_cores_size++;
+
 	engine_cores = malloc(engine_cores_size * sizeof (uint8_t));
 	engine_cores_size = 0;
 	for (i=0; i<cores_size; i++)
 		if (cores[i])
 			engine_cores[engine_cores_size++] = i;
+
+	engine_sockets = calloc(engine_cores_size, sizeof (uint32_t));
+	for (i=0; i<commands_count; i++)
+		if (commands[i].flags & COMMAND_SOCKET)
+			break;
+	if (i < commands_count
+	    && socketinfo(engine_sockets, engine_cores, engine_cores_size)) {
+		for (i=0; i<engine_cores_size; i++)
+			engine_sockets[i] = 0;
+		if (verbose)
+			vlog("cannot find core sockets, assume a single one");
+	}
+
+	if (engine_config.realtime
+	    && (engine_config.realtime_cpu >= cores_size
+		|| cores[engine_config.realtime_cpu]))
+		error("real-time cpu must be outside of the used cores: %u",
+		      engine_config.realtime_cpu);
+
+	if (engine_config.control_path
+	    && (engine_config.recorder_path || engine_config.trace_path
+		|| engine_config.summary != SUMMARY_NONE
+		|| engine_config.metrics_address))
+		error("control socket only works with the text output");
+
+	if (engine_config.window
+	    && (engine_config.recorder_path || engine_config.trace_path
+		|| engine_config.summary != SUMMARY_NONE
+		|| engine_config.control_path))
+		error("output window only works with the text output");
+
+	if (engine_config.sparse
+	    && (engine_config.recorder_path || engine_config.trace_path
+		|| engine_config.summary != SUMMARY_NONE
+		|| engine_config.control_path || engine_config.window
+		|| engine_config.timestamps != STAMP_NONE))
+		error("sparse output only works with the text output");
+
+	if (capture_path && capture_open(capture_path))
+		error("cannot create capture: '%s'", capture_path);
+
+	if (stamp_setup(engine_config.timestamps))
+		error("cannot setup timestamps clock");
 }
 
 int main(int argc, char *const *argv)
 {
 	int i, tmp;
-	const char *err;
 
 	program = argv[0];
 	
@@ -355,24 +969,22 @@ int main(int argc, char *const *argv)
 	argc -= tmp;
 	argv += tmp;
 
-	commands_count = 0;
-	commands_size = (size_t) argc;
-	commands = alloca(commands_size * sizeof (struct command));
-	for (i=0; i<argc; i++) {
-		err = parse_command(&commands[i], argv[i]);
-		if (err)
-			error("command sytax error: '%s'", err);
-		commands_count++;
-	}
+	for (i=0; i<argc; i++)
+		add_command(argv[i]);
 
 	setup_late_config();
 
-	execute(commands, commands_count, engine_cores, engine_cores_size);
+	execute(commands, commands_count, engine_cores, engine_sockets,
+		engine_cores_size, &engine_config);
 
 	free(paths);
+	free(commands);
+	free(rules);
 	free(cores);
 	free(engine_cores);
+	free(engine_sockets);
 
+	capture_close();
 	destroy();
 	unload_module();
 	
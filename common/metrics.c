@@ -0,0 +1,565 @@
+/*
+ * Copyright 2015 Gauthier Voron
+ * This file is part of rwmsr.
+ *
+ * Rwmsr is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Rwmsr is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with rwmsr. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "engine.h"
+#include "metrics.h"
+#include "output.h"
+#include "reduce.h"
+
+
+#define METRICS_BACKLOG      16
+#define METRICS_CLIENTS      16
+#define METRICS_TIMEOUT      1000
+#define METRICS_REQUEST_MAX  4096
+#define METRICS_VALUE_MAX    24
+
+#define METRICS_HEADER							\
+	"HTTP/1.0 200 OK\r\n"						\
+	"Content-Type: application/openmetrics-text; version=1.0.0; "	\
+	"charset=utf-8\r\n"						\
+	"Connection: close\r\n"						\
+	"\r\n"								\
+	"# TYPE rwmsr_register gauge\n"					\
+	"# HELP rwmsr_register Last value of a register.\n"
+
+#define METRICS_FOOTER							\
+	"# TYPE rwmsr_last_tick_timestamp_seconds gauge\n"		\
+	"# HELP rwmsr_last_tick_timestamp_seconds Time of the last "	\
+	"published tick.\n"						\
+	"rwmsr_last_tick_timestamp_seconds %lu.%03lu\n"			\
+	"# EOF\n"
+
+
+/*
+ * The values published by the engine are protected by a sequence lock: the
+ * engine makes the sequence odd while updating them and even again once done,
+ * and the server copies them until it gets the same even sequence before and
+ * after the copy. This way, the engine never waits for the server.
+ * The label of each published column is formatted once at startup, so
+ * serving a request only formats the values.
+ */
+static uint64_t        metrics_seq;
+
+static msrval_t       *metrics_values;
+
+static uint8_t        *metrics_valid;
+
+static uint64_t        metrics_time;
+
+static size_t          metrics_cells;
+
+static size_t         *metrics_offsets;
+
+static char          **metrics_labels;
+
+static char           *metrics_buffer;
+
+static size_t          metrics_buffer_size;
+
+static int             metrics_fd = -1;
+
+static struct sockaddr_un  metrics_path;
+
+static pthread_t       metrics_thread;
+
+static uint8_t         metrics_started = 0;
+
+
+static int8_t format_labels(const struct engine *engine)
+{
+	const struct command *commands = engine->commands;
+	size_t i, j, k = 0, size = sizeof (METRICS_HEADER)
+		+ sizeof (METRICS_FOOTER) + 2 * METRICS_VALUE_MAX;
+	char buffer[128];
+
+	for (i=0; i<engine->mlen; i++) {
+		if (!(commands[i].flags & COMMAND_PRINT))
+			continue;
+
+		for (j=0; j<engine->columns[i]; j++) {
+			if (commands[i].reduce == REDUCE_NONE)
+				snprintf(buffer, sizeof (buffer),
+					 "rwmsr_register{address=\"0x%lx\","
+					 "core=\"%u\"} ", commands[i].address,
+					 column_core(engine, i, j));
+			else if (commands[i].flags & COMMAND_SOCKET)
+				snprintf(buffer, sizeof (buffer),
+					 "rwmsr_register{address=\"0x%lx\","
+					 "reduce=\"%s\",socket=\"%u\"} ",
+					 commands[i].address,
+					 reduce_name(commands[i].reduce),
+					 column_socket(engine, i, j));
+			else
+				snprintf(buffer, sizeof (buffer),
+					 "rwmsr_register{address=\"0x%lx\","
+					 "reduce=\"%s\"} ", commands[i].address,
+					 reduce_name(commands[i].reduce));
+
+			metrics_labels[k] = strdup(buffer);
+			if (!metrics_labels[k])
+				return -1;
+			size += strlen(buffer) + METRICS_VALUE_MAX;
+			k++;
+		}
+	}
+
+	metrics_buffer = malloc(size);
+	metrics_buffer_size = size;
+	if (!metrics_buffer)
+		return -1;
+	return 0;
+}
+
+/*
+ * Render the last published values in the response buffer.
+ * Return the length of the response.
+ */
+static size_t render(msrval_t *values, uint8_t *valid)
+{
+	uint64_t seq, time;
+	size_t i, len;
+	char *ptr = metrics_buffer;
+
+	do {
+		seq = __atomic_load_n(&metrics_seq, __ATOMIC_ACQUIRE);
+		if (seq & 1)
+			continue;
+		memcpy(values, metrics_values,
+		       metrics_cells * sizeof (msrval_t));
+		memcpy(valid, metrics_valid, metrics_cells);
+		time = metrics_time;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while (seq != __atomic_load_n(&metrics_seq, __ATOMIC_RELAXED)
+		 || (seq & 1));
+
+	memcpy(ptr, METRICS_HEADER, sizeof (METRICS_HEADER) - 1);
+	ptr += sizeof (METRICS_HEADER) - 1;
+
+	for (i=0; i<metrics_cells; i++) {
+		if (!valid[i])
+			continue;
+		len = strlen(metrics_labels[i]);
+		memcpy(ptr, metrics_labels[i], len);
+		ptr += len;
+		ptr += sprintf(ptr, "%lu\n", values[i]);
+	}
+
+	ptr += sprintf(ptr, METRICS_FOOTER, time / 1000, time % 1000);
+	return ptr - metrics_buffer;
+}
+
+/*
+ * A client connection, first reading its request, then sending its own copy
+ * of the response, so that a slow client never delays the others.
+ */
+struct client
+{
+	int       fd;                            /* -1 if the slot is free */
+	uint8_t   answering;                     /* sending the response */
+	size_t    len;                           /* request or response length */
+	size_t    done;                          /* response bytes sent */
+	uint64_t  deadline;                      /* ms before being dropped */
+	char     *response;
+	char      request[METRICS_REQUEST_MAX];
+};
+
+
+static uint64_t now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000ul + ts.tv_nsec / 1000000ul;
+}
+
+static void close_client(struct client *client)
+{
+	close(client->fd);
+	client->fd = -1;
+}
+
+/*
+ * Accept every pending connection in a free client slot, or close it if
+ * there is none left.
+ * Return 0 in case of success, -1 if the listening socket is closed.
+ */
+static int8_t accept_clients(struct client *clients, uint64_t now)
+{
+	size_t i;
+	int fd;
+
+	while (1) {
+		fd = accept(metrics_fd, NULL, NULL);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			return -1;
+		}
+
+		for (i=0; i<METRICS_CLIENTS; i++)
+			if (clients[i].fd < 0)
+				break;
+
+		if (i == METRICS_CLIENTS || fcntl(fd, F_SETFL, O_NONBLOCK)) {
+			close(fd);
+			continue;
+		}
+
+		if (!clients[i].response)
+			clients[i].response = malloc(metrics_buffer_size);
+		if (!clients[i].response) {
+			close(fd);
+			continue;
+		}
+
+		clients[i].fd = fd;
+		clients[i].answering = 0;
+		clients[i].len = 0;
+		clients[i].done = 0;
+		clients[i].deadline = now + METRICS_TIMEOUT;
+	}
+}
+
+/*
+ * Read what is available of the request, until the end of its header, so
+ * that closing the connection does not reset it before the client reads the
+ * response.
+ * Return 1 once the request is complete, 0 if more is to come, -1 if the
+ * connection failed.
+ */
+static int8_t read_request(struct client *client)
+{
+	char *request = client->request;
+	ssize_t ret;
+
+	while (client->len < METRICS_REQUEST_MAX - 1) {
+		ret = recv(client->fd, request + client->len,
+			   METRICS_REQUEST_MAX - 1 - client->len, 0);
+		if (ret == 0)
+			return 1;
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			return -1;
+		}
+
+		client->len += ret;
+		request[client->len] = '\0';
+		if (strstr(request, "\r\n\r\n") || strstr(request, "\n\n"))
+			return 1;
+	}
+
+	return 1;
+}
+
+/*
+ * Send what the socket accepts of the response.
+ * Return 1 once the response is sent, 0 if more is to send, -1 if the
+ * connection failed.
+ */
+static int8_t send_response(struct client *client)
+{
+	ssize_t ret;
+
+	while (client->done < client->len) {
+		ret = send(client->fd, client->response + client->done,
+			   client->len - client->done, MSG_NOSIGNAL);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			return -1;
+		}
+		client->done += ret;
+	}
+
+	return 1;
+}
+
+/*
+ * Poll the listening socket along with the open connections, reading the
+ * requests and sending the responses as the sockets get ready. The values
+ * are rendered once for all the requests completed by the same poll, and
+ * the connections still open after METRICS_TIMEOUT milliseconds are dropped.
+ */
+static void *serve(void *arg __attribute__((unused)))
+{
+	msrval_t *values = malloc(metrics_cells * sizeof (msrval_t) + 1);
+	uint8_t *valid = malloc(metrics_cells + 1);
+	struct client *clients = calloc(METRICS_CLIENTS, sizeof (*clients));
+	struct pollfd fds[METRICS_CLIENTS + 1];
+	size_t slots[METRICS_CLIENTS + 1];
+	size_t i, k, nfds, len = 0;
+	uint8_t rendered;
+	struct client *client;
+	uint64_t now;
+	int ret;
+
+	for (i=0; clients && i<METRICS_CLIENTS; i++)
+		clients[i].fd = -1;
+
+	if (!values || !valid || !clients)
+		goto out;
+
+	while (1) {
+		fds[0].fd = metrics_fd;
+		fds[0].events = POLLIN;
+		nfds = 1;
+
+		for (i=0; i<METRICS_CLIENTS; i++) {
+			if (clients[i].fd < 0)
+				continue;
+			fds[nfds].fd = clients[i].fd;
+			fds[nfds].events = clients[i].answering ? POLLOUT
+				: POLLIN;
+			slots[nfds++] = i;
+		}
+
+		ret = poll(fds, nfds, nfds > 1 ? METRICS_TIMEOUT : -1);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		now = now_ms();
+		rendered = 0;
+
+		for (k=1; k<nfds; k++) {
+			client = &clients[slots[k]];
+
+			if (!fds[k].revents) {
+				if (now >= client->deadline)
+					close_client(client);
+				continue;
+			}
+
+			if (!client->answering) {
+				ret = read_request(client);
+				if (ret < 0)
+					close_client(client);
+				if (ret <= 0)
+					continue;
+
+				if (!rendered) {
+					len = render(values, valid);
+					rendered = 1;
+				}
+
+				memcpy(client->response, metrics_buffer, len);
+				client->answering = 1;
+				client->len = len;
+				client->done = 0;
+			}
+
+			if (send_response(client))
+				close_client(client);
+			else if (now >= client->deadline)
+				close_client(client);
+		}
+
+		if (fds[0].revents & (POLLERR | POLLHUP | POLLNVAL))
+			break;
+		if ((fds[0].revents & POLLIN) && accept_clients(clients, now))
+			break;
+	}
+
+ out:
+	for (i=0; clients && i<METRICS_CLIENTS; i++) {
+		if (clients[i].fd >= 0)
+			close(clients[i].fd);
+		free(clients[i].response);
+	}
+
+	free(clients);
+	free(values);
+	free(valid);
+	return NULL;
+}
+
+static int open_socket(const char *address)
+{
+	struct sockaddr_in inaddr;
+	int fd, one = 1;
+	char *err;
+	long port;
+
+	port = strtol(address, &err, 10);
+
+	if (*address != '\0' && *err == '\0') {
+		if (port <= 0 || port > 65535)
+			return -1;
+
+		fd = socket(AF_INET, SOCK_STREAM, 0);
+		if (fd < 0)
+			return -1;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof (one));
+
+		memset(&inaddr, 0, sizeof (inaddr));
+		inaddr.sin_family = AF_INET;
+		inaddr.sin_port = htons(port);
+		inaddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		if (bind(fd, (struct sockaddr *) &inaddr, sizeof (inaddr)))
+			goto err;
+	} else {
+		if (strlen(address) >= sizeof (metrics_path.sun_path))
+			return -1;
+
+		fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (fd < 0)
+			return -1;
+
+		memset(&metrics_path, 0, sizeof (metrics_path));
+		metrics_path.sun_family = AF_UNIX;
+		strcpy(metrics_path.sun_path, address);
+		unlink(address);
+		if (bind(fd, (struct sockaddr *) &metrics_path,
+			 sizeof (metrics_path)))
+			goto err;
+	}
+
+	if (listen(fd, METRICS_BACKLOG) || fcntl(fd, F_SETFL, O_NONBLOCK))
+		goto err;
+	return fd;
+ err:
+	close(fd);
+	metrics_path.sun_path[0] = '\0';
+	return -1;
+}
+
+int8_t metrics_open(const struct engine *engine, const char *address)
+{
+	size_t i, cells = 0;
+	sigset_t set, old;
+	int ret;
+
+	metrics_offsets = malloc(engine->mlen * sizeof (size_t));
+	if (!metrics_offsets)
+		return -1;
+
+	for (i=0; i<engine->mlen; i++) {
+		metrics_offsets[i] = cells;
+		if (engine->commands[i].flags & COMMAND_PRINT)
+			cells += engine->columns[i];
+	}
+
+	metrics_cells = cells;
+	metrics_values = calloc(cells + 1, sizeof (msrval_t));
+	metrics_valid = calloc(cells + 1, sizeof (uint8_t));
+	metrics_labels = calloc(cells + 1, sizeof (char *));
+	if (!metrics_values || !metrics_valid || !metrics_labels)
+		goto err;
+	if (format_labels(engine))
+		goto err;
+
+	metrics_fd = open_socket(address);
+	if (metrics_fd < 0)
+		goto err;
+
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, &old);
+	ret = pthread_create(&metrics_thread, NULL, serve, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (ret)
+		goto err;
+
+	metrics_started = 1;
+	return 0;
+ err:
+	metrics_close();
+	return -1;
+}
+
+void metrics_update(const struct engine *engine, uint64_t time)
+{
+	size_t i, k;
+	uint64_t seq = metrics_seq;
+
+	__atomic_store_n(&metrics_seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	for (k=0; k<engine->ndue; k++) {
+		i = engine->due_list[k];
+		if (!(engine->commands[i].flags & COMMAND_PRINT))
+			continue;
+
+		memcpy(metrics_values + metrics_offsets[i],
+		       engine->values + engine->offsets[i],
+		       engine->columns[i] * sizeof (msrval_t));
+		memcpy(metrics_valid + metrics_offsets[i],
+		       engine->valid + engine->offsets[i], engine->columns[i]);
+	}
+	metrics_time = engine->start + time;
+
+	__atomic_store_n(&metrics_seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+void metrics_close(void)
+{
+	size_t i;
+
+	if (metrics_fd >= 0) {
+		shutdown(metrics_fd, SHUT_RDWR);
+		if (metrics_started)
+			pthread_join(metrics_thread, NULL);
+		metrics_started = 0;
+		close(metrics_fd);
+		metrics_fd = -1;
+	}
+
+	if (metrics_path.sun_path[0] != '\0') {
+		unlink(metrics_path.sun_path);
+		metrics_path.sun_path[0] = '\0';
+	}
+
+	for (i=0; metrics_labels && i<metrics_cells; i++)
+		free(metrics_labels[i]);
+
+	free(metrics_labels);
+	free(metrics_values);
+	free(metrics_valid);
+	free(metrics_offsets);
+	free(metrics_buffer);
+	metrics_labels = NULL;
+	metrics_values = NULL;
+	metrics_valid = NULL;
+	metrics_offsets = NULL;
+	metrics_buffer = NULL;
+}
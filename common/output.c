@@ -0,0 +1,306 @@
+/*
+ * Copyright 2015 Gauthier Voron
+ * This file is part of rwmsr.
+ *
+ * Rwmsr is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Rwmsr is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with rwmsr. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "engine.h"
+#include "output.h"
+#include "reduce.h"
+
+
+/*
+ * Compute the cells of each command from its cores bitmap.
+ * Return 0 in case of success, -1 otherwise.
+ */
+static int8_t setup_cells(struct engine *engine)
+{
+	size_t i, j, cells = 0;
+
+	engine->offsets = malloc((engine->mlen + 1) * sizeof (size_t));
+	if (!engine->offsets)
+		return -1;
+
+	for (i=0; i<engine->mlen; i++) {
+		engine->offsets[i] = cells;
+		for (j=0; j<engine->rlen; j++)
+			if (COMMAND_HAS_CORE(&engine->commands[i],
+					     engine->cores[j]))
+				cells++;
+	}
+	engine->offsets[engine->mlen] = cells;
+
+	engine->members = malloc(cells * sizeof (size_t));
+	engine->cell_groups = malloc(cells * sizeof (size_t));
+	engine->column_groups = malloc(cells * sizeof (size_t));
+	engine->column_counts = malloc(cells * sizeof (size_t));
+	if (cells && (!engine->members || !engine->cell_groups
+		      || !engine->column_groups || !engine->column_counts))
+		return -1;
+
+	cells = 0;
+	for (i=0; i<engine->mlen; i++)
+		for (j=0; j<engine->rlen; j++)
+			if (COMMAND_HAS_CORE(&engine->commands[i],
+					     engine->cores[j]))
+				engine->members[cells++] = j;
+
+	return 0;
+}
+
+/*
+ * Compute the socket columns of a command reduced by socket: one column per
+ * group containing at least one of its cores, in the order of the groups.
+ * Return the number of columns.
+ */
+static size_t setup_socket_columns(struct engine *engine, size_t i)
+{
+	size_t g, k, c, n = 0;
+	size_t start = engine->offsets[i], end = engine->offsets[i + 1];
+
+	for (g=0; g<engine->ngroups; g++) {
+		for (k=start; k<end; k++)
+			if (engine->groups[engine->members[k]] == g)
+				break;
+		if (k == end)
+			continue;
+
+		engine->column_groups[start + n] = g;
+		engine->column_counts[start + n] = 0;
+		n++;
+	}
+
+	for (k=start; k<end; k++) {
+		for (c=0; c<n; c++)
+			if (engine->column_groups[start + c]
+			    == engine->groups[engine->members[k]])
+				break;
+		engine->cell_groups[k] = c;
+		engine->column_counts[start + c]++;
+	}
+
+	return n;
+}
+
+int8_t setup_columns(struct engine *engine)
+{
+	size_t i, j, g, rlen = engine->rlen;
+	uint32_t socket;
+
+	engine->groups = calloc(rlen, sizeof (size_t));
+	engine->group_counts = calloc(rlen, sizeof (size_t));
+	engine->group_sockets = calloc(rlen, sizeof (uint32_t));
+	engine->columns = calloc(engine->mlen, sizeof (size_t));
+	engine->ngroups = 0;
+	engine->offsets = NULL;
+	engine->members = NULL;
+	engine->cell_groups = NULL;
+	engine->column_groups = NULL;
+	engine->column_counts = NULL;
+
+	if (!engine->groups || !engine->group_counts || !engine->group_sockets
+	    || !engine->columns || setup_cells(engine)) {
+		release_columns(engine);
+		return -1;
+	}
+
+	for (j=0; j<rlen; j++) {
+		socket = engine->sockets[j];
+		for (g=0; g<engine->ngroups; g++)
+			if (engine->group_sockets[g] >= socket)
+				break;
+
+		if (g == engine->ngroups || engine->group_sockets[g] != socket) {
+			for (i=engine->ngroups; i>g; i--) {
+				engine->group_sockets[i] =
+					engine->group_sockets[i - 1];
+				engine->group_counts[i] =
+					engine->group_counts[i - 1];
+			}
+			engine->group_sockets[g] = socket;
+			engine->group_counts[g] = 0;
+			engine->ngroups++;
+		}
+
+		engine->group_counts[g]++;
+	}
+
+	for (j=0; j<rlen; j++)
+		for (g=0; g<engine->ngroups; g++)
+			if (engine->group_sockets[g] == engine->sockets[j])
+				engine->groups[j] = g;
+
+	for (i=0; i<engine->mlen; i++) {
+		if (engine->commands[i].reduce == REDUCE_NONE)
+			engine->columns[i] = engine->offsets[i + 1]
+				- engine->offsets[i];
+		else if (engine->commands[i].flags & COMMAND_SOCKET)
+			engine->columns[i] = setup_socket_columns(engine, i);
+		else
+			engine->columns[i] = 1;
+	}
+
+	return 0;
+}
+
+void release_columns(struct engine *engine)
+{
+	free(engine->groups);
+	free(engine->group_counts);
+	free(engine->group_sockets);
+	free(engine->columns);
+	free(engine->offsets);
+	free(engine->members);
+	free(engine->cell_groups);
+	free(engine->column_groups);
+	free(engine->column_counts);
+	engine->groups = NULL;
+	engine->group_counts = NULL;
+	engine->group_sockets = NULL;
+	engine->columns = NULL;
+	engine->offsets = NULL;
+	engine->members = NULL;
+	engine->cell_groups = NULL;
+	engine->column_groups = NULL;
+	engine->column_counts = NULL;
+}
+
+uint8_t column_core(const struct engine *engine, size_t i, size_t column)
+{
+	return engine->cores[engine->members[engine->offsets[i] + column]];
+}
+
+uint32_t column_socket(const struct engine *engine, size_t i, size_t column)
+{
+	return engine->group_sockets[engine->column_groups[engine->offsets[i]
+							   + column]];
+}
+
+
+void print_column(FILE *stream, const struct engine *engine, size_t i,
+		  size_t column)
+{
+	const struct command *command = &engine->commands[i];
+
+	if (command->reduce == REDUCE_NONE)
+		fprintf(stream, "0x%lx(%u)", command->address,
+			column_core(engine, i, column));
+	else if (command->flags & COMMAND_SOCKET)
+		fprintf(stream, "0x%lx/%s(s%u)", command->address,
+			reduce_name(command->reduce),
+			column_socket(engine, i, column));
+	else
+		fprintf(stream, "0x%lx/%s(all)", command->address,
+			reduce_name(command->reduce));
+}
+
+void print_header(FILE *stream, const struct engine *engine)
+{
+	size_t i, j;
+	char *ptype, *pdec = ":", *phex = "::";
+	const struct command *commands = engine->commands;
+	const uint8_t *cores = engine->cores;
+	size_t mlen = engine->mlen, rlen = engine->rlen;
+	
+	fprintf(stream, "time ");
+	if (engine->stamps)
+		for (j=0; j<rlen; j++)
+			fprintf(stream, "ts(%u) ", cores[j]);
+	for (i=0; i<mlen; i++) {
+		if (!(commands[i].flags & COMMAND_PRINT))
+			continue;
+		if (commands[i].flags & COMMAND_HEXA)
+			ptype = phex;
+		else
+			ptype = pdec;
+
+		for (j=0; j<engine->columns[i]; j++) {
+			fprintf(stream, "%s", ptype);
+			print_column(stream, engine, i, j);
+			fprintf(stream, " ");
+		}
+
+		if (commands[i].flags & COMMAND_ADAPTIVE)
+			fprintf(stream, "period(0x%lx) ", commands[i].address);
+	}
+	fprintf(stream, "\n");
+}
+
+void print_line(FILE *stream, const struct engine *engine, uint64_t time,
+		const uint8_t *due, const uint64_t *stamps,
+		const msrval_t *values, const uint8_t *valid,
+		const uint32_t *periods)
+{
+	size_t i, j, c;
+	const char *fmt;
+	const char *dfmt = " %lu";
+	const char *hfmt = " %lx";
+	const struct command *commands = engine->commands;
+	size_t mlen = engine->mlen, rlen = engine->rlen;
+
+	for (i=0; i<mlen; i++) {
+		if (!(commands[i].flags & COMMAND_PRINT))
+			continue;
+		if (!due[i])
+			continue;
+		break;
+	}
+
+	if (i == mlen)
+		return;
+	
+	fprintf(stream, "%lu.%03lu", time / 1000, time % 1000);
+
+	if (stamps)
+		for (j=0; j<rlen; j++)
+			fprintf(stream, " %lu", stamps[j]);
+		
+	for (i=0; i<mlen; i++) {
+		if (!(commands[i].flags & COMMAND_PRINT))
+			continue;
+		
+		if (!due[i]) {
+			for (j=0; j<engine->columns[i]; j++)
+				fprintf(stream, " -");
+		} else {
+			if (commands[i].flags & COMMAND_HEXA)
+				fmt = hfmt;
+			else
+				fmt = dfmt;
+			
+			for (j=0; j<engine->columns[i]; j++) {
+				c = engine->offsets[i] + j;
+				if (valid && !valid[c])
+					fprintf(stream, " -");
+				else
+					fprintf(stream, fmt, values[c]);
+			}
+		}
+
+		if (!(commands[i].flags & COMMAND_ADAPTIVE))
+			continue;
+		if (due[i] && periods)
+			fprintf(stream, " %u", periods[i]);
+		else
+			fprintf(stream, " -");
+	}
+
+	fprintf(stream, "\n");
+	fflush(stream);
+}
@@ -16,12 +16,28 @@
  * along with rwmsr. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "engine.h"
 #include "parse.h"
+#include "reduce.h"
+
+
+#define LINE_MAXLEN   256
+
+#define RANGE_MAXLEN  4096
+
+#define TRIGGER_TICKS 16
 
 
 const char *parse_cores(uint8_t *dest, size_t len, const char *str)
@@ -69,7 +85,8 @@ const char *parse_cores(uint8_t *dest, size_t len, const char *str)
 
 /*
  * Parse a number either in decimal or hexadecimal form.
- * A number is in hexadecimal form if it starts with 'x' or '0x'.
+ * A number is in hexadecimal form if it starts with 'x' or '0x'. The whole 64
+ * bits range is accepted, but not a sign nor a value out of this range.
  * Set the end field at the first character following the number in case of
  * success, or NULL in case of failure.
  */
@@ -87,10 +104,17 @@ static uint64_t parse_uint64(const char *str, const char **end)
 		str += 2;
 	}
 
-	val = strtol(str, &err, base);
+	if (!isxdigit((unsigned char) *str)) {
+		if (end)
+			*end = NULL;
+		return 0;
+	}
+
+	errno = 0;
+	val = strtoull(str, &err, base);
 
 	if (end) {
-		if (err == str)
+		if (err == str || errno == ERANGE)
 			*end = NULL;
 		else
 			*end = (const char *) err;
@@ -99,7 +123,159 @@ static uint64_t parse_uint64(const char *str, const char **end)
 	return val;
 }
 
-const char *parse_command(struct command *dest, const char *str)
+/*
+ * Parse a reduction in the form "<reduce>[.socket]" and fill the dest
+ * command with.
+ * Return the address of the first character following the reduction in case
+ * of success, NULL otherwise.
+ */
+static const char *parse_reduce(struct command *dest, const char *str)
+{
+	size_t i, len;
+
+	for (i=REDUCE_SUM; i<=REDUCE_MEAN; i++) {
+		len = strlen(reduce_name(i));
+		if (!strncmp(str, reduce_name(i), len))
+			break;
+	}
+
+	if (i > REDUCE_MEAN)
+		return NULL;
+
+	dest->reduce = i;
+	str += len;
+
+	if (!strncmp(str, ".socket", 7)) {
+		dest->flags |= COMMAND_SOCKET;
+		str += 7;
+	}
+
+	return str;
+}
+
+/*
+ * Parse a set of cores in the same form than parse_cores() but ending at the
+ * first character which is neither a digit, a comma or an hyphen, and fill
+ * the cores bitmap of the dest command with.
+ * Return the address of the first character following the set in case of
+ * success, NULL otherwise.
+ */
+static const char *parse_command_cores(struct command *dest, const char *str)
+{
+	static char buffer[LINE_MAXLEN];
+	uint8_t cores[CORES_MAX];
+	size_t i, len;
+
+	len = strspn(str, "0123456789,-");
+	if (len == 0 || len >= LINE_MAXLEN)
+		return NULL;
+
+	memcpy(buffer, str, len);
+	buffer[len] = '\0';
+	memset(cores, 0, sizeof (cores));
+	if (parse_cores(cores, CORES_MAX, buffer))
+		return NULL;
+
+	for (i=0; i<CORES_MAX; i++)
+		if (cores[i])
+			COMMAND_SET_CORE(dest, i);
+	dest->flags |= COMMAND_CORES;
+
+	return str + len;
+}
+
+/*
+ * Parse the operator of a write at str, "=", or "+=" and "-=" if steps is set,
+ * and set the step flags of the command accordingly.
+ * Return the address of the first character after the operator in case of
+ * success, NULL otherwise.
+ */
+static const char *parse_write_op(struct command *dest, const char *str,
+				  uint8_t steps)
+{
+	if (*str == '=')
+		return str + 1;
+	if (!steps || (str[0] != '+' && str[0] != '-') || str[1] != '=')
+		return NULL;
+
+	dest->flags |= COMMAND_MASKED | COMMAND_STEP;
+	if (*str == '-')
+		dest->flags |= COMMAND_DECREASE;
+	return str + 2;
+}
+
+/*
+ * Parse the write of a command, either "=<value>", "|=<value>",
+ * "&=~<value>" or "[<hi>:<lo>]=<value>", and set the value and the mask of
+ * the written bits of the command. If steps is set, "+=<value>" and
+ * "-=<value>" are also accepted in place of "=<value>", alone or after
+ * "[<hi>:<lo>]".
+ * Return the address of the first character after the write in case of
+ * success, NULL otherwise.
+ */
+static const char *parse_write(struct command *dest, const char *str,
+			       uint8_t steps)
+{
+	unsigned long hi, lo;
+	msrval_t value;
+	char *end;
+
+	dest->flags |= COMMAND_WRITE;
+
+	if (*str != '[' && *str != '|' && *str != '&') {
+		str = parse_write_op(dest, str, steps);
+		if (!str)
+			return NULL;
+		dest->value = parse_uint64(str, &str);
+		if (dest->flags & COMMAND_STEP)
+			dest->mask = ~(0ul);
+		return str;
+	}
+
+	dest->flags |= COMMAND_MASKED;
+
+	if (!strncmp(str, "|=", 2)) {
+		dest->value = parse_uint64(str + 2, &str);
+		dest->mask = dest->value;
+		return str;
+	}
+
+	if (!strncmp(str, "&=~", 3)) {
+		dest->mask = parse_uint64(str + 3, &str);
+		dest->value = 0;
+		return str;
+	}
+
+	if (*str != '[' || !isdigit((unsigned char) str[1]))
+		return NULL;
+	hi = strtoul(str + 1, &end, 10);
+	if (*end != ':' || !isdigit((unsigned char) end[1]))
+		return NULL;
+	str = end + 1;
+	lo = strtoul(str, &end, 10);
+	if (*end != ']' || hi > 63 || lo > hi)
+		return NULL;
+
+	str = parse_write_op(dest, end + 1, steps);
+	if (!str)
+		return NULL;
+	value = parse_uint64(str, &str);
+	if (!str)
+		return NULL;
+
+	dest->mask = (~(0ul) >> (63 - hi)) & (~(0ul) << lo);
+	if ((value << lo) >> lo != value || ((value << lo) & ~dest->mask))
+		return NULL;
+	dest->value = value << lo;
+	return str;
+}
+
+/*
+ * Parse a command as parse_command() does, also accepting step writes if
+ * steps is set.
+ */
+static const char *parse_any_command(struct command *dest, const char *str,
+				     uint8_t steps)
 {
 	const char *ptr;
 	
@@ -121,10 +297,52 @@ const char *parse_command(struct command *dest, const char *str)
 		return str;
 	str = ptr;
 
-	if (*str == '=') {
+	if (*str == '-' && str[1] != '=') {
+		str++;
+		dest->last = parse_uint64(str, &ptr);
+		if (!ptr || dest->last < dest->address)
+			return str;
+		str = ptr;
+
+		dest->stride = 1;
+		if (*str == '+') {
+			str++;
+			dest->stride = parse_uint64(str, &ptr);
+			if (!ptr || dest->stride == 0)
+				return str;
+			str = ptr;
+		}
+
+		if ((dest->last - dest->address) / dest->stride >= RANGE_MAXLEN)
+			return str;
+	}
+
+	if (!strncmp(str, ".const", 6)) {
+		dest->flags |= COMMAND_CONSTANT;
+		str += 6;
+	}
+
+	if (*str == '/') {
+		str++;
+		ptr = parse_reduce(dest, str);
+		if (!ptr)
+			return str;
+		str = ptr;
+	}
+
+	if (*str == '%') {
 		str++;
-		dest->flags |= COMMAND_WRITE;
-		dest->value = parse_uint64(str, &ptr);
+		ptr = parse_command_cores(dest, str);
+		if (!ptr)
+			return str;
+		str = ptr;
+	}
+
+	if (*str == '=' || *str == '|' || *str == '&' || *str == '['
+	    || (steps && (*str == '+' || *str == '-'))) {
+		if (dest->flags & COMMAND_CONSTANT)
+			return str;
+		ptr = parse_write(dest, str, steps);
 		if (!ptr)
 			return str;
 		str = ptr;
@@ -140,9 +358,477 @@ const char *parse_command(struct command *dest, const char *str)
 			dest->flags |= COMMAND_REPEAT;
 			dest->repeat = strtol(str, (char **) &str, 10);
 		}
+
+		if ((dest->flags & COMMAND_REPEAT) && *str == '-') {
+			ptr = str++;
+			dest->flags |= COMMAND_ADAPTIVE;
+			dest->repeat_max = strtol(str, (char **) &str, 10);
+			if (dest->repeat == 0 || dest->repeat_max < dest->repeat)
+				return ptr;
+
+			if (*str == '~') {
+				str++;
+				dest->threshold = parse_uint64(str, &ptr);
+				if (!ptr)
+					return str;
+				str = ptr;
+			}
+		}
 	}
 
 	if (*str != '\0')
 		return str;
 	return NULL;
 }
+
+const char *parse_command(struct command *dest, const char *str)
+{
+	return parse_any_command(dest, str, 0);
+}
+
+size_t expand_command(struct command *dest, const struct command *src)
+{
+	size_t i, len = 1;
+
+	if (src->stride)
+		len = (src->last - src->address) / src->stride + 1;
+	if (!dest)
+		return len;
+
+	for (i=0; i<len; i++) {
+		dest[i] = *src;
+		dest[i].address = src->address + i * src->stride;
+		dest[i].last = 0;
+		dest[i].stride = 0;
+	}
+
+	return len;
+}
+
+
+/*
+ * Parse a condition in the form
+ * "<address>[&<mask>][.delta|.rate]<op><threshold>".
+ * Return the address of the first character after the condition in case of
+ * success, NULL otherwise.
+ */
+static const char *parse_condition(struct condition *dest, const char *str)
+{
+	static const struct { const char *name; uint8_t op; } ops[] = {
+		{ "<=", CONDITION_LE }, { ">=", CONDITION_GE },
+		{ "==", CONDITION_EQ }, { "!=", CONDITION_NE },
+		{ "<",  CONDITION_LT }, { ">",  CONDITION_GT }
+	};
+	size_t i;
+
+	dest->address = parse_uint64(str, &str);
+	if (!str)
+		return NULL;
+
+	dest->mask = ~(0ul);
+	if (*str == '&') {
+		dest->mask = parse_uint64(str + 1, &str);
+		if (!str)
+			return NULL;
+	}
+
+	dest->mode = CONDITION_VALUE;
+	if (!strncmp(str, ".delta", 6)) {
+		dest->mode = CONDITION_DELTA;
+		str += 6;
+	} else if (!strncmp(str, ".rate", 5)) {
+		dest->mode = CONDITION_RATE;
+		str += 5;
+	}
+
+	for (i=0; i<sizeof (ops) / sizeof (ops[0]); i++)
+		if (!strncmp(str, ops[i].name, strlen(ops[i].name)))
+			break;
+	if (i == sizeof (ops) / sizeof (ops[0]))
+		return NULL;
+	dest->op = ops[i].op;
+	str += strlen(ops[i].name);
+
+	dest->threshold = parse_uint64(str, &str);
+	return str;
+}
+
+const char *parse_trigger(struct trigger *dest, const char *str)
+{
+	const char *ptr;
+	char *end;
+
+	memset(dest, 0, sizeof (*dest));
+
+	ptr = parse_condition(&dest->condition, str);
+	if (!ptr)
+		return str;
+	str = ptr;
+
+	if (*str != ',')
+		return str;
+	dest->period = strtoul(str + 1, &end, 10);
+	if (end == str + 1 || dest->period == 0)
+		return str + 1;
+	str = end;
+
+	if (*str != ',')
+		return str;
+	dest->duration = strtoul(str + 1, &end, 10);
+	if (end == str + 1 || dest->duration == 0)
+		return str + 1;
+	str = end;
+
+	dest->ticks = TRIGGER_TICKS;
+	if (*str == ',') {
+		dest->ticks = strtoul(str + 1, &end, 10);
+		if (end == str + 1)
+			return str + 1;
+		str = end;
+	}
+
+	if (*str != '\0')
+		return str;
+	return NULL;
+}
+
+/*
+ * Parse the write command of a rule, ending at the given separator or at the
+ * end of the string.
+ * Return the address of the end of the command in case of success, NULL
+ * otherwise.
+ */
+static const char *parse_rule_command(struct command *dest, const char *str,
+				      char sep)
+{
+	const char *end = strchr(str, sep);
+	size_t len = end ? (size_t) (end - str) : strlen(str);
+	char *buffer = malloc(len + 1);
+	const char *err;
+
+	if (!buffer)
+		return NULL;
+	memcpy(buffer, str, len);
+	buffer[len] = '\0';
+	err = parse_any_command(dest, buffer, 1);
+	free(buffer);
+
+	if (err || dest->stride || !(dest->flags & COMMAND_WRITE)
+	    || (dest->flags & (COMMAND_PRINT | COMMAND_DELAY)))
+		return NULL;
+	return str + len;
+}
+
+const char *parse_rule(struct rule *dest, const char *str)
+{
+	const char *ptr;
+
+	memset(dest, 0, sizeof (*dest));
+
+	ptr = parse_condition(&dest->condition, str);
+	if (!ptr)
+		return str;
+	str = ptr;
+
+	dest->release = dest->condition.threshold;
+	if (*str == '~') {
+		str++;
+		dest->release = parse_uint64(str, &ptr);
+		if (!ptr)
+			return str;
+		str = ptr;
+	}
+
+	if (*str != '?')
+		return str;
+	str++;
+	ptr = parse_rule_command(&dest->on, str, '?');
+	if (!ptr)
+		return str;
+	str = ptr;
+
+	if (*str == '?') {
+		str++;
+		ptr = parse_rule_command(&dest->off, str, '\0');
+		if (!ptr)
+			return str;
+		str = ptr;
+	}
+
+	if (*str != '\0')
+		return str;
+	return NULL;
+}
+
+
+size_t format_command(char *dest, size_t len, const struct command *command)
+{
+	size_t i, j, off = 0;
+	const char *sep = "%";
+
+#define APPEND(...)							\
+	do {								\
+		off += snprintf(dest + off, off < len ? len - off : 0,	\
+				__VA_ARGS__);				\
+	} while (0)
+
+	if (command->flags & COMMAND_PRINT)
+		APPEND(":");
+	if (command->flags & COMMAND_HEXA)
+		APPEND(":");
+	APPEND("0x%lx", command->address);
+	if (command->stride)
+		APPEND("-0x%lx", command->last);
+	if (command->stride > 1)
+		APPEND("+%lu", command->stride);
+	if (command->flags & COMMAND_CONSTANT)
+		APPEND(".const");
+
+	if (command->reduce != REDUCE_NONE)
+		APPEND("/%s%s", reduce_name(command->reduce),
+		       (command->flags & COMMAND_SOCKET) ? ".socket" : "");
+
+	for (i=0; (command->flags & COMMAND_CORES) && i<CORES_MAX; i++) {
+		if (!COMMAND_HAS_CORE(command, i))
+			continue;
+		for (j=i; j+1<CORES_MAX && COMMAND_HAS_CORE(command, j+1); j++)
+			;
+		if (j == i)
+			APPEND("%s%lu", sep, i);
+		else
+			APPEND("%s%lu-%lu", sep, i, j);
+		sep = ",";
+		i = j;
+	}
+
+	if ((command->flags & COMMAND_STEP) && command->mask == ~(0ul))
+		APPEND("%c=0x%lx",
+		       (command->flags & COMMAND_DECREASE) ? '-' : '+',
+		       command->value);
+	else if (command->flags & COMMAND_STEP)
+		APPEND("[%d:%d]%c=0x%lx", 63 - __builtin_clzl(command->mask),
+		       __builtin_ctzl(command->mask),
+		       (command->flags & COMMAND_DECREASE) ? '-' : '+',
+		       command->value >> __builtin_ctzl(command->mask));
+	else if ((command->flags & COMMAND_MASKED)
+		 && command->value == command->mask)
+		APPEND("|=0x%lx", command->value);
+	else if ((command->flags & COMMAND_MASKED) && command->value == 0)
+		APPEND("&=~0x%lx", command->mask);
+	else if (command->flags & COMMAND_MASKED)
+		APPEND("[%d:%d]=0x%lx", 63 - __builtin_clzl(command->mask),
+		       __builtin_ctzl(command->mask),
+		       command->value >> __builtin_ctzl(command->mask));
+	else if (command->flags & COMMAND_WRITE)
+		APPEND("=0x%lx", command->value);
+	if (command->flags & COMMAND_DELAY)
+		APPEND("@%u", command->delay);
+	if (command->flags & COMMAND_REPEAT)
+		APPEND("-%u", command->repeat);
+	if (command->flags & COMMAND_ADAPTIVE)
+		APPEND("-%u", command->repeat_max);
+	if (command->threshold)
+		APPEND("~0x%lx", command->threshold);
+
+#undef APPEND
+
+	return off;
+}
+
+
+/*
+ * Set of command indexes hashed by address, used to drop duplicated commands
+ * when loading a file. Slots contain the command index plus one, 0 meaning
+ * an empty slot.
+ */
+struct command_set
+{
+	size_t  *slots;
+	size_t   mask;
+	size_t   count;
+};
+
+static size_t hash_address(msradr_t address)
+{
+	return (size_t) ((address * 0x9e3779b97f4a7c15ul) >> 17);
+}
+
+static uint8_t same_command(const struct command *a, const struct command *b)
+{
+	return a->flags == b->flags && a->reduce == b->reduce
+		&& a->address == b->address
+		&& a->last == b->last && a->stride == b->stride
+		&& a->value == b->value && a->mask == b->mask
+		&& a->delay == b->delay
+		&& a->repeat == b->repeat && a->repeat_max == b->repeat_max
+		&& a->threshold == b->threshold
+		&& !memcmp(a->cores, b->cores, sizeof (a->cores));
+}
+
+static int8_t command_set_grow(struct command_set *set,
+			       const struct command *commands)
+{
+	size_t i, h, size = (set->mask + 1) * 2;
+	size_t *slots = calloc(size, sizeof (size_t));
+
+	if (!slots)
+		return -1;
+
+	for (i=0; i<=set->mask; i++) {
+		if (!set->slots[i])
+			continue;
+		h = hash_address(commands[set->slots[i] - 1].address);
+		while (slots[h & (size - 1)])
+			h++;
+		slots[h & (size - 1)] = set->slots[i];
+	}
+
+	free(set->slots);
+	set->slots = slots;
+	set->mask = size - 1;
+	return 0;
+}
+
+/*
+ * Insert the command at the given index in the set.
+ * Return 1 if an identical command is already in the set, 0 if it has been
+ * inserted, -1 in case of allocation failure.
+ */
+static int8_t command_set_insert(struct command_set *set,
+				 const struct command *commands, size_t index)
+{
+	const struct command *cmd = &commands[index];
+	size_t h = hash_address(cmd->address);
+
+	while (set->slots[h & set->mask]) {
+		if (same_command(&commands[set->slots[h & set->mask] - 1], cmd))
+			return 1;
+		h++;
+	}
+
+	set->slots[h & set->mask] = index + 1;
+	set->count++;
+
+	if (set->count * 2 > set->mask + 1)
+		return command_set_grow(set, commands);
+	return 0;
+}
+
+const char *parse_commands_file(struct command **dest, size_t *len,
+				size_t *size, const char *path, size_t *line)
+{
+	static char buffer[LINE_MAXLEN];
+	struct command_set set = { NULL, 63, 0 };
+	struct command command, *tmp;
+	const char *map, *ptr, *end, *eol, *com, *err = NULL;
+	struct stat st;
+	size_t i, llen, base, count, grow;
+	int fd;
+
+	*line = 0;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return path;
+	if (fstat(fd, &st)) {
+		close(fd);
+		return path;
+	}
+
+	if (st.st_size == 0) {
+		close(fd);
+		return NULL;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return path;
+
+	madvise((void *) map, st.st_size, MADV_SEQUENTIAL);
+
+	set.slots = calloc(set.mask + 1, sizeof (size_t));
+	if (!set.slots) {
+		err = path;
+		goto out;
+	}
+	for (i=0; i<*len; i++)
+		if (command_set_insert(&set, *dest, i) < 0) {
+			err = path;
+			goto out;
+		}
+
+	ptr = map;
+	end = map + st.st_size;
+
+	while (ptr < end) {
+		(*line)++;
+
+		eol = memchr(ptr, '\n', end - ptr);
+		if (!eol)
+			eol = end;
+		com = memchr(ptr, '#', eol - ptr);
+		if (!com)
+			com = eol;
+
+		while (ptr < com && isspace((unsigned char) *ptr))
+			ptr++;
+		while (com > ptr && isspace((unsigned char) com[-1]))
+			com--;
+
+		llen = com - ptr;
+		ptr = eol + 1;
+		if (llen == 0)
+			continue;
+
+		if (llen >= LINE_MAXLEN) {
+			memcpy(buffer, com - llen, LINE_MAXLEN - 1);
+			buffer[LINE_MAXLEN - 1] = '\0';
+			err = buffer;
+			goto out;
+		}
+
+		memcpy(buffer, com - llen, llen);
+		buffer[llen] = '\0';
+
+		err = parse_command(&command, buffer);
+		if (err)
+			goto out;
+
+		count = expand_command(NULL, &command);
+		for (grow = *size; *len + count > grow; )
+			grow = grow ? grow * 2 : 64;
+		if (grow != *size) {
+			tmp = realloc(*dest, grow * sizeof (struct command));
+			if (!tmp) {
+				err = buffer;
+				goto out;
+			}
+			*dest = tmp;
+			*size = grow;
+		}
+
+		base = *len;
+		expand_command(*dest + base, &command);
+
+		for (i=0; i<count; i++) {
+			(*dest)[*len] = (*dest)[base + i];
+			switch (command_set_insert(&set, *dest, *len)) {
+			case 0:
+				(*len)++;
+				break;
+			case 1:
+				break;
+			default:
+				err = buffer;
+				goto out;
+			}
+		}
+	}
+
+	*line = 0;
+ out:
+	free(set.slots);
+	munmap((void *) map, st.st_size);
+	return err;
+}
@@ -0,0 +1,138 @@
+/*
+ * Copyright 2015 Gauthier Voron
+ * This file is part of rwmsr.
+ *
+ * Rwmsr is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Rwmsr is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with rwmsr. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "engine.h"
+#include "output.h"
+#include "pretrigger.h"
+
+
+/*
+ * Each tick of the ring is stored in fixed size slots of the arrays below,
+ * the tick number N being in the slot N % capacity.
+ */
+static uint64_t   *pretrigger_times = NULL;
+
+static uint8_t    *pretrigger_due = NULL;
+
+static uint64_t   *pretrigger_stamps = NULL;
+
+static msrval_t   *pretrigger_values = NULL;
+
+static uint8_t    *pretrigger_valid = NULL;
+
+static uint32_t   *pretrigger_periods = NULL;
+
+static size_t      pretrigger_capacity;
+
+static uint64_t    pretrigger_first;
+
+static uint64_t    pretrigger_last;
+
+
+int8_t pretrigger_open(const struct engine *engine, uint32_t ticks)
+{
+	size_t mlen = engine->mlen, cells = engine->offsets[mlen];
+
+	pretrigger_times = malloc((ticks + 1) * sizeof (uint64_t));
+	pretrigger_due = malloc((ticks * mlen + 1) * sizeof (uint8_t));
+	pretrigger_values = malloc((ticks * cells + 1) * sizeof (msrval_t));
+	pretrigger_valid = malloc((ticks * cells + 1) * sizeof (uint8_t));
+	pretrigger_periods = malloc((ticks * mlen + 1) * sizeof (uint32_t));
+	if (engine->stamps)
+		pretrigger_stamps = malloc((ticks * engine->rlen + 1)
+					   * sizeof (uint64_t));
+
+	if (!pretrigger_times || !pretrigger_due || !pretrigger_values
+	    || !pretrigger_valid || !pretrigger_periods
+	    || (engine->stamps && !pretrigger_stamps)) {
+		pretrigger_close();
+		return -1;
+	}
+
+	pretrigger_capacity = ticks;
+	pretrigger_first = 0;
+	pretrigger_last = 0;
+	return 0;
+}
+
+void pretrigger_write(const struct engine *engine, uint64_t time)
+{
+	size_t i, slot, mlen = engine->mlen, cells = engine->offsets[mlen];
+
+	for (i=0; i<mlen; i++)
+		if (engine->due[i] && (engine->commands[i].flags
+				       & COMMAND_PRINT))
+			break;
+	if (i == mlen)
+		return;
+
+	slot = pretrigger_last++ % pretrigger_capacity;
+	if (pretrigger_last - pretrigger_first > pretrigger_capacity)
+		pretrigger_first++;
+
+	pretrigger_times[slot] = time;
+	memcpy(pretrigger_due + slot * mlen, engine->due, mlen);
+	memcpy(pretrigger_values + slot * cells, engine->values,
+	       cells * sizeof (msrval_t));
+	memcpy(pretrigger_valid + slot * cells, engine->valid, cells);
+	memcpy(pretrigger_periods + slot * mlen, engine->periods,
+	       mlen * sizeof (uint32_t));
+	if (engine->stamps)
+		memcpy(pretrigger_stamps + slot * engine->rlen, engine->stamps,
+		       engine->rlen * sizeof (uint64_t));
+}
+
+void pretrigger_flush(FILE *stream, const struct engine *engine)
+{
+	size_t slot, mlen = engine->mlen, cells = engine->offsets[mlen];
+	uint64_t seq;
+
+	for (seq=pretrigger_first; seq<pretrigger_last; seq++) {
+		slot = seq % pretrigger_capacity;
+		print_line(stream, engine, pretrigger_times[slot],
+			   pretrigger_due + slot * mlen,
+			   engine->stamps ? pretrigger_stamps
+			   + slot * engine->rlen : NULL,
+			   pretrigger_values + slot * cells,
+			   pretrigger_valid + slot * cells,
+			   pretrigger_periods + slot * mlen);
+	}
+
+	pretrigger_first = pretrigger_last;
+}
+
+void pretrigger_close(void)
+{
+	free(pretrigger_times);
+	free(pretrigger_due);
+	free(pretrigger_stamps);
+	free(pretrigger_values);
+	free(pretrigger_valid);
+	free(pretrigger_periods);
+	pretrigger_times = NULL;
+	pretrigger_due = NULL;
+	pretrigger_stamps = NULL;
+	pretrigger_values = NULL;
+	pretrigger_valid = NULL;
+	pretrigger_periods = NULL;
+}
@@ -0,0 +1,168 @@
+/*
+ * Copyright 2015 Gauthier Voron
+ * This file is part of rwmsr.
+ *
+ * Rwmsr is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Rwmsr is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with rwmsr. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+
+#include "realtime.h"
+
+
+#define PREFAULT_STACK     (512ul << 10)
+
+/*
+ * The latencies are recorded in microseconds in a log-linear histogram: the
+ * values lower than LINEAR_MAX each have their own bucket, the others are
+ * split in SUB_BUCKETS buckets per power of two, which bounds the relative
+ * error to 1 / SUB_BUCKETS.
+ */
+#define SUB_BITS           5
+#define SUB_BUCKETS        (1 << SUB_BITS)
+#define LINEAR_MAX         (2 * SUB_BUCKETS)
+#define HISTOGRAM_SIZE     (LINEAR_MAX + (64 - SUB_BITS - 1) * SUB_BUCKETS)
+
+
+static uint64_t  histogram[HISTOGRAM_SIZE];
+
+static uint64_t  latency_count = 0;
+
+static uint64_t  latency_max = 0;
+
+
+static size_t bucket_of(uint64_t usec)
+{
+	unsigned int exp;
+
+	if (usec < LINEAR_MAX)
+		return usec;
+
+	exp = 63 - __builtin_clzl(usec);
+	return LINEAR_MAX + (exp - SUB_BITS - 1) * SUB_BUCKETS
+		+ ((usec >> (exp - SUB_BITS)) & (SUB_BUCKETS - 1));
+}
+
+/*
+ * Return the lowest value of the given bucket.
+ */
+static uint64_t bucket_value(size_t bucket)
+{
+	size_t exp, sub;
+
+	if (bucket < LINEAR_MAX)
+		return bucket;
+
+	exp = (bucket - LINEAR_MAX) / SUB_BUCKETS + SUB_BITS + 1;
+	sub = (bucket - LINEAR_MAX) % SUB_BUCKETS;
+	return (1ul << exp) + (sub << (exp - SUB_BITS));
+}
+
+/*
+ * Touch the pages of a large stack frame so that the stack used by the
+ * engine and the functions it calls is already mapped.
+ */
+static void prefault_stack(void)
+{
+	volatile uint8_t frame[PREFAULT_STACK];
+	size_t i, page = sysconf(_SC_PAGESIZE);
+
+	for (i=0; i<PREFAULT_STACK; i+=page)
+		frame[i] = 0;
+	(void) frame[0];
+}
+
+int8_t realtime_setup(uint32_t cpu, uint8_t priority)
+{
+	struct sched_param param;
+	cpu_set_t set;
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	if (sched_setaffinity(0, sizeof (set), &set))
+		return -1;
+
+	memset(&param, 0, sizeof (param));
+	param.sched_priority = priority;
+	if (sched_setscheduler(0, SCHED_FIFO, &param))
+		return -1;
+
+	if (mlockall(MCL_CURRENT | MCL_FUTURE))
+		return -1;
+
+	prefault_stack();
+	return 0;
+}
+
+void realtime_prefault(void *buffer, size_t size)
+{
+	volatile uint8_t *ptr = buffer;
+	size_t i, page = sysconf(_SC_PAGESIZE);
+
+	for (i=0; i<size; i+=page)
+		ptr[i] = ptr[i];
+	if (size)
+		ptr[size - 1] = ptr[size - 1];
+}
+
+void realtime_record(uint64_t until)
+{
+	struct timespec ts;
+	uint64_t target = until * 1000000ul, now, late;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	now = ts.tv_sec * 1000000000ul + ts.tv_nsec;
+	late = (now > target) ? (now - target) / 1000 : 0;
+
+	histogram[bucket_of(late)]++;
+	latency_count++;
+	if (late > latency_max)
+		latency_max = late;
+}
+
+static uint64_t percentile(double quantile)
+{
+	uint64_t rank = (uint64_t) (quantile * (latency_count - 1)), seen = 0;
+	size_t i;
+
+	for (i=0; i<HISTOGRAM_SIZE; i++) {
+		seen += histogram[i];
+		if (seen > rank)
+			break;
+	}
+
+	if (i == HISTOGRAM_SIZE || bucket_value(i) > latency_max)
+		return latency_max;
+	return bucket_value(i);
+}
+
+void realtime_report(FILE *stream)
+{
+	if (latency_count == 0)
+		return;
+
+	fprintf(stream, "wakeup latency (us): count %lu p50 %lu p90 %lu "
+		"p99 %lu p99.9 %lu max %lu\n", latency_count,
+		percentile(0.50), percentile(0.90), percentile(0.99),
+		percentile(0.999), latency_max);
+}
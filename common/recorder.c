@@ -0,0 +1,260 @@
+/*
+ * Copyright 2015 Gauthier Voron
+ * This file is part of rwmsr.
+ *
+ * Rwmsr is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Rwmsr is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with rwmsr. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+
+#include "engine.h"
+#include "output.h"
+#include "recorder.h"
+
+
+#define RECORDER_ALIGN   64
+
+
+static struct recorder_header  *recorder = NULL;
+
+static size_t                   recorder_size;
+
+static size_t                   recorder_window;
+
+
+static size_t align(size_t size, size_t alignment)
+{
+	return (size + alignment - 1) & ~(alignment - 1);
+}
+
+static uint8_t *record_slot(uint64_t seq)
+{
+	return ((uint8_t *) recorder) + recorder->data_offset
+		+ (seq % recorder->capacity) * recorder->record_size;
+}
+
+/*
+ * Return the maximum number of ticks the engine can perform during the given
+ * window of milliseconds. Each periodic command causes at most one tick per
+ * period, no longer than the burst period if a trigger is set, and the
+ * engine performs at most one tick per millisecond.
+ */
+static size_t window_ticks(const struct engine *engine, uint64_t window)
+{
+	const struct trigger *trigger = &engine->config->trigger;
+	size_t i, ticks = 0, once = 0;
+	uint32_t repeat;
+
+	for (i=0; i<engine->mlen; i++) {
+		if (!(engine->commands[i].flags & COMMAND_REPEAT)) {
+			once++;
+			continue;
+		}
+
+		repeat = engine->commands[i].repeat;
+		if (trigger->condition.op != CONDITION_NONE
+		    && trigger->period < repeat)
+			repeat = trigger->period;
+		if (repeat == 0)
+			repeat = 1;
+		ticks += (window + repeat - 1) / repeat;
+		if (ticks > window)
+			ticks = window;
+	}
+
+	return ticks + once + 1;
+}
+
+size_t describe_engine(const struct engine *engine, void *dest)
+{
+	struct recorder_command *commands = dest;
+	struct recorder_core *cores;
+	size_t i;
+
+	if (dest == NULL)
+		goto out;
+
+	for (i=0; i<engine->mlen; i++) {
+		commands[i].address = engine->commands[i].address;
+		commands[i].flags = engine->commands[i].flags;
+		commands[i].reduce = engine->commands[i].reduce;
+		memcpy(commands[i].cores, engine->commands[i].cores,
+		       sizeof (commands[i].cores));
+	}
+
+	cores = (struct recorder_core *) (commands + engine->mlen);
+	for (i=0; i<engine->rlen; i++) {
+		cores[i].id = engine->cores[i];
+		cores[i].socket = engine->sockets[i];
+	}
+
+ out:
+	return engine->mlen * sizeof (struct recorder_command)
+		+ engine->rlen * sizeof (struct recorder_core);
+}
+
+int8_t recorder_open(const struct engine *engine, const char *path,
+		     uint32_t seconds)
+{
+	size_t i, capacity, record_size, data_offset;
+	int fd;
+
+	capacity = window_ticks(engine, seconds * 1000ul);
+
+	record_size = 2 * sizeof (uint64_t) + align(engine->mlen, 8);
+	if (engine->stamps)
+		record_size += engine->rlen * sizeof (uint64_t);
+	record_size += engine->offsets[engine->mlen] * sizeof (msrval_t);
+	record_size += align(engine->offsets[engine->mlen], 8);
+	record_size += align(engine->mlen * sizeof (uint32_t), 8);
+
+	data_offset = sizeof (struct recorder_header)
+		+ describe_engine(engine, NULL);
+	data_offset = align(data_offset, RECORDER_ALIGN);
+
+	recorder_size = data_offset + capacity * record_size;
+	recorder_window = seconds * 1000ul;
+
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return -1;
+	if (ftruncate(fd, recorder_size)) {
+		close(fd);
+		return -1;
+	}
+
+	recorder = mmap(NULL, recorder_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED, fd, 0);
+	close(fd);
+	if (recorder == MAP_FAILED) {
+		recorder = NULL;
+		return -1;
+	}
+
+	memcpy(recorder->magic, RECORDER_MAGIC, sizeof (recorder->magic));
+	recorder->start = engine->start;
+	recorder->cursor = 0;
+	recorder->capacity = capacity;
+	recorder->record_size = record_size;
+	recorder->mlen = engine->mlen;
+	recorder->rlen = engine->rlen;
+	recorder->flags = engine->stamps ? RECORDER_STAMPS : 0;
+	recorder->data_offset = data_offset;
+
+	describe_engine(engine, recorder + 1);
+
+	for (i=0; i<capacity; i++)
+		*(uint64_t *) record_slot(i) = RECORDER_INVALID;
+
+	return 0;
+}
+
+void recorder_write(const struct engine *engine, uint64_t time)
+{
+	uint64_t seq = recorder->cursor;
+	uint8_t *slot = record_slot(seq);
+	uint64_t *header = (uint64_t *) slot;
+
+	__atomic_store_n(&header[0], RECORDER_INVALID, __ATOMIC_RELEASE);
+	header[1] = time;
+	slot += 2 * sizeof (uint64_t);
+
+	memcpy(slot, engine->due, engine->mlen);
+	slot += align(engine->mlen, 8);
+
+	if (engine->stamps) {
+		memcpy(slot, engine->stamps, engine->rlen * sizeof (uint64_t));
+		slot += engine->rlen * sizeof (uint64_t);
+	}
+
+	memcpy(slot, engine->values,
+	       engine->offsets[engine->mlen] * sizeof (msrval_t));
+	slot += engine->offsets[engine->mlen] * sizeof (msrval_t);
+
+	memcpy(slot, engine->valid, engine->offsets[engine->mlen]);
+	slot += align(engine->offsets[engine->mlen], 8);
+
+	memcpy(slot, engine->periods, engine->mlen * sizeof (uint32_t));
+
+	__atomic_store_n(&header[0], seq, __ATOMIC_RELEASE);
+	__atomic_store_n(&recorder->cursor, seq + 1, __ATOMIC_RELEASE);
+}
+
+void recorder_dump(const struct engine *engine)
+{
+	uint64_t seq, first, last, *header;
+	const uint8_t *slot, *due, *valid;
+	const uint64_t *stamps;
+	const msrval_t *values;
+	const uint32_t *periods;
+
+	last = recorder->cursor;
+	if (last == 0)
+		return;
+
+	first = 0;
+	if (last > recorder->capacity)
+		first = last - recorder->capacity;
+
+	header = (uint64_t *) record_slot(last - 1);
+	while (first < last) {
+		slot = record_slot(first);
+		if (((uint64_t *) slot)[1] + recorder_window >= header[1])
+			break;
+		first++;
+	}
+
+	print_header(stdout, engine);
+
+	for (seq=first; seq<last; seq++) {
+		slot = record_slot(seq);
+		header = (uint64_t *) slot;
+		if (header[0] != seq)
+			continue;
+
+		due = slot + 2 * sizeof (uint64_t);
+		slot = due + align(engine->mlen, 8);
+		stamps = NULL;
+		if (engine->stamps) {
+			stamps = (const uint64_t *) slot;
+			slot += engine->rlen * sizeof (uint64_t);
+		}
+		values = (const msrval_t *) slot;
+		valid = slot + engine->offsets[engine->mlen]
+			* sizeof (msrval_t);
+		periods = (const uint32_t *)
+			(valid + align(engine->offsets[engine->mlen], 8));
+
+		print_line(stdout, engine, header[1], due, stamps, values,
+			   valid, periods);
+	}
+
+	msync(recorder, recorder_size, MS_ASYNC);
+}
+
+void recorder_close(void)
+{
+	if (recorder == NULL)
+		return;
+
+	msync(recorder, recorder_size, MS_SYNC);
+	munmap(recorder, recorder_size);
+	recorder = NULL;
+}
@@ -0,0 +1,189 @@
+/*
+ * Copyright 2015 Gauthier Voron
+ * This file is part of rwmsr.
+ *
+ * Rwmsr is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Rwmsr is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with rwmsr. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "engine.h"
+#include "reduce.h"
+
+
+/*
+ * Number of independent accumulators used by the reductions.
+ * The loops below have no dependency between the accumulators so the
+ * compiler can map them to vector registers.
+ */
+#define REDUCE_LANES   8
+
+
+static const char *reduce_names[] = {
+	[REDUCE_NONE] = "none",
+	[REDUCE_SUM]  = "sum",
+	[REDUCE_MIN]  = "min",
+	[REDUCE_MAX]  = "max",
+	[REDUCE_MEAN] = "mean"
+};
+
+
+const char *reduce_name(uint8_t op)
+{
+	if (op > REDUCE_MEAN)
+		return NULL;
+	return reduce_names[op];
+}
+
+static msrval_t reduce_sum(const msrval_t *row, size_t len)
+{
+	msrval_t acc[REDUCE_LANES] = { 0 };
+	size_t i, k;
+
+	for (i=0; i + REDUCE_LANES <= len; i += REDUCE_LANES)
+		for (k=0; k<REDUCE_LANES; k++)
+			acc[k] += row[i + k];
+	for (; i<len; i++)
+		acc[0] += row[i];
+
+	for (k=1; k<REDUCE_LANES; k++)
+		acc[0] += acc[k];
+	return acc[0];
+}
+
+static msrval_t reduce_min(const msrval_t *row, size_t len)
+{
+	msrval_t acc[REDUCE_LANES];
+	size_t i, k;
+
+	for (k=0; k<REDUCE_LANES; k++)
+		acc[k] = ~((msrval_t) 0);
+
+	for (i=0; i + REDUCE_LANES <= len; i += REDUCE_LANES)
+		for (k=0; k<REDUCE_LANES; k++)
+			acc[k] = row[i + k] < acc[k] ? row[i + k] : acc[k];
+	for (; i<len; i++)
+		acc[0] = row[i] < acc[0] ? row[i] : acc[0];
+
+	for (k=1; k<REDUCE_LANES; k++)
+		acc[0] = acc[k] < acc[0] ? acc[k] : acc[0];
+	return acc[0];
+}
+
+static msrval_t reduce_max(const msrval_t *row, size_t len)
+{
+	msrval_t acc[REDUCE_LANES] = { 0 };
+	size_t i, k;
+
+	for (i=0; i + REDUCE_LANES <= len; i += REDUCE_LANES)
+		for (k=0; k<REDUCE_LANES; k++)
+			acc[k] = row[i + k] > acc[k] ? row[i + k] : acc[k];
+	for (; i<len; i++)
+		acc[0] = row[i] > acc[0] ? row[i] : acc[0];
+
+	for (k=1; k<REDUCE_LANES; k++)
+		acc[0] = acc[k] > acc[0] ? acc[k] : acc[0];
+	return acc[0];
+}
+
+/*
+ * Sum the quotients and the remainders of the division of each value by len
+ * separately, so the mean does not overflow when the sum of the values does.
+ * The sum of the remainders is lower than len * len.
+ */
+static msrval_t reduce_mean(const msrval_t *row, size_t len)
+{
+	msrval_t quot = 0, rem = 0;
+	size_t i;
+
+	for (i=0; i<len; i++) {
+		quot += row[i] / len;
+		rem += row[i] % len;
+	}
+
+	return quot + rem / len;
+}
+
+msrval_t reduce_row(const msrval_t *row, size_t len, uint8_t op)
+{
+	switch (op) {
+	case REDUCE_SUM:
+		return reduce_sum(row, len);
+	case REDUCE_MIN:
+		return reduce_min(row, len);
+	case REDUCE_MAX:
+		return reduce_max(row, len);
+	case REDUCE_MEAN:
+		return len ? reduce_mean(row, len) : 0;
+	default:
+		return 0;
+	}
+}
+
+void reduce_groups(msrval_t *dest, uint8_t *present, const msrval_t *row,
+		   const uint8_t *valid, const size_t *groups,
+		   const size_t *counts, size_t len, size_t ngroups,
+		   uint8_t op)
+{
+	msrval_t rems[CORES_MAX];
+	size_t found[CORES_MAX];
+	size_t i, g;
+
+	for (g=0; g<ngroups; g++) {
+		dest[g] = (op == REDUCE_MIN) ? ~((msrval_t) 0) : 0;
+		rems[g] = 0;
+		found[g] = valid ? 0 : counts[g];
+	}
+
+	for (i=0; valid && i<len; i++)
+		if (valid[i])
+			found[groups[i]]++;
+
+	switch (op) {
+	case REDUCE_SUM:
+		for (i=0; i<len; i++)
+			if (!valid || valid[i])
+				dest[groups[i]] += row[i];
+		break;
+	case REDUCE_MEAN:
+		for (i=0; i<len; i++) {
+			if (valid && !valid[i])
+				continue;
+			g = groups[i];
+			dest[g] += row[i] / found[g];
+			rems[g] += row[i] % found[g];
+		}
+		break;
+	case REDUCE_MIN:
+		for (i=0; i<len; i++)
+			if ((!valid || valid[i]) && row[i] < dest[groups[i]])
+				dest[groups[i]] = row[i];
+		break;
+	case REDUCE_MAX:
+		for (i=0; i<len; i++)
+			if ((!valid || valid[i]) && row[i] > dest[groups[i]])
+				dest[groups[i]] = row[i];
+		break;
+	}
+
+	for (g=0; g<ngroups; g++) {
+		if (op == REDUCE_MEAN && found[g])
+			dest[g] += rems[g] / found[g];
+		if (found[g] == 0)
+			dest[g] = 0;
+		if (present)
+			present[g] = found[g] != 0;
+	}
+}
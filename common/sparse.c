@@ -0,0 +1,151 @@
+/*
+ * Copyright 2015 Gauthier Voron
+ * This file is part of rwmsr.
+ *
+ * Rwmsr is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Rwmsr is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with rwmsr. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "engine.h"
+#include "output.h"
+#include "sparse.h"
+
+
+static msrval_t  *sparse_values = NULL;
+
+static uint8_t   *sparse_known = NULL;
+
+static uint8_t   *sparse_valid = NULL;
+
+static uint32_t  *sparse_periods = NULL;
+
+static uint32_t   sparse_keyframe;
+
+static uint64_t   sparse_ticks;
+
+
+int8_t sparse_open(const struct engine *engine, uint32_t keyframe)
+{
+	size_t cells = engine->offsets[engine->mlen];
+
+	sparse_values = malloc((cells + 1) * sizeof (msrval_t));
+	sparse_known = calloc(cells + 1, sizeof (uint8_t));
+	sparse_valid = calloc(cells + 1, sizeof (uint8_t));
+	sparse_periods = calloc(engine->mlen + 1, sizeof (uint32_t));
+	if (!sparse_values || !sparse_known || !sparse_valid
+	    || !sparse_periods) {
+		sparse_close();
+		return -1;
+	}
+
+	sparse_keyframe = keyframe;
+	sparse_ticks = 0;
+	return 0;
+}
+
+/*
+ * Print the time of the line before its first column.
+ */
+static void print_start(FILE *stream, uint64_t time, uint8_t *started)
+{
+	if (*started)
+		return;
+	fprintf(stream, "%lu.%03lu", time / 1000, time % 1000);
+	*started = 1;
+}
+
+void sparse_update(FILE *stream, const struct engine *engine, uint64_t time)
+{
+	size_t i, j, c;
+	uint8_t keyframe, valid, started = 0;
+	const char *fmt;
+	const struct command *commands = engine->commands;
+	msrval_t val;
+
+	for (i=0; i<engine->mlen; i++)
+		if ((commands[i].flags & COMMAND_PRINT) && engine->due[i])
+			break;
+	if (i == engine->mlen)
+		return;
+
+	keyframe = (sparse_ticks++ % sparse_keyframe) == 0;
+
+	for (i=0; i<engine->mlen; i++) {
+		if (!(commands[i].flags & COMMAND_PRINT))
+			continue;
+
+		if (commands[i].flags & COMMAND_HEXA)
+			fmt = "=%lx";
+		else
+			fmt = "=%lu";
+
+		for (j=0; j<engine->columns[i]; j++) {
+			c = engine->offsets[i] + j;
+
+			if (engine->due[i]) {
+				val = engine->values[c];
+				valid = engine->valid[c];
+				if (sparse_known[c] && sparse_valid[c] == valid
+				    && (!valid || sparse_values[c] == val)
+				    && !keyframe)
+					continue;
+				sparse_values[c] = val;
+				sparse_valid[c] = valid;
+				sparse_known[c] = 1;
+			} else if (!keyframe || !sparse_known[c]) {
+				continue;
+			}
+
+			print_start(stream, time, &started);
+			fprintf(stream, " ");
+			print_column(stream, engine, i, j);
+			if (sparse_valid[c])
+				fprintf(stream, fmt, sparse_values[c]);
+			else
+				fprintf(stream, "=-");
+		}
+
+		if (!(commands[i].flags & COMMAND_ADAPTIVE))
+			continue;
+		if (engine->due[i] && sparse_periods[i] != engine->periods[i])
+			sparse_periods[i] = engine->periods[i];
+		else if (!keyframe || !sparse_periods[i])
+			continue;
+
+		print_start(stream, time, &started);
+		fprintf(stream, " period(0x%lx)=%u", commands[i].address,
+			sparse_periods[i]);
+	}
+
+	if (!started)
+		return;
+
+	fprintf(stream, "\n");
+	fflush(stream);
+}
+
+void sparse_close(void)
+{
+	free(sparse_values);
+	free(sparse_known);
+	free(sparse_valid);
+	free(sparse_periods);
+	sparse_values = NULL;
+	sparse_known = NULL;
+	sparse_valid = NULL;
+	sparse_periods = NULL;
+}
@@ -0,0 +1,109 @@
+/*
+ * Copyright 2015 Gauthier Voron
+ * This file is part of rwmsr.
+ *
+ * Rwmsr is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Rwmsr is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with rwmsr. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#  include <x86intrin.h>
+#  define HAVE_TSC
+#endif
+
+#include "stamp.h"
+
+
+#define CALIBRATION_NS   20000000ul
+
+
+static uint8_t  stamp_source = STAMP_NONE;
+
+static double   stamp_ratio  = 1.0;
+
+
+static uint64_t read_raw(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+	return ts.tv_sec * 1000000000ul + ts.tv_nsec;
+}
+
+#ifdef HAVE_TSC
+/*
+ * Measure the timestamp counter frequency against CLOCK_MONOTONIC_RAW.
+ * The measure is taken over a busy loop of CALIBRATION_NS nanoseconds, the
+ * counter reads being enclosed between two clock reads each time.
+ */
+static int8_t calibrate_tsc(void)
+{
+	uint64_t tsc0, tsc1, raw0, raw1;
+
+	raw0 = read_raw();
+	tsc0 = __rdtsc();
+
+	do {
+		tsc1 = __rdtsc();
+		raw1 = read_raw();
+	} while (raw1 - raw0 < CALIBRATION_NS);
+
+	if (tsc1 <= tsc0)
+		return -1;
+
+	stamp_ratio = (double) (raw1 - raw0) / (double) (tsc1 - tsc0);
+	return 0;
+}
+#endif
+
+int8_t stamp_setup(uint8_t source)
+{
+	switch (source) {
+	case STAMP_NONE:
+	case STAMP_RAW:
+		stamp_ratio = 1.0;
+		break;
+	case STAMP_TSC:
+#ifdef HAVE_TSC
+		if (calibrate_tsc())
+			return -1;
+		break;
+#else
+		return -1;
+#endif
+	default:
+		return -1;
+	}
+
+	stamp_source = source;
+	return 0;
+}
+
+uint64_t stamp_read(void)
+{
+#ifdef HAVE_TSC
+	if (stamp_source == STAMP_TSC)
+		return __rdtsc();
+#endif
+	return read_raw();
+}
+
+uint64_t stamp_to_ns(uint64_t delta)
+{
+	if (stamp_source == STAMP_TSC)
+		return (uint64_t) (delta * stamp_ratio);
+	return delta;
+}
@@ -0,0 +1,382 @@
+/*
+ * Copyright 2015 Gauthier Voron
+ * This file is part of rwmsr.
+ *
+ * Rwmsr is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Rwmsr is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with rwmsr. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "engine.h"
+#include "output.h"
+#include "reduce.h"
+#include "summary.h"
+
+
+/*
+ * The quantiles are estimated with a logarithmic sketch: a value v > 0 is
+ * counted in the bucket ceil(log(v) / log(gamma)), so any value of a bucket
+ * is within SKETCH_ACCURACY of the bucket estimate. Only SKETCH_BUCKETS
+ * contiguous buckets are kept, the lowest ones being collapsed together when
+ * the range of values exceeds them, which keeps the high quantiles accurate.
+ * Two sketches can be merged by adding their buckets.
+ */
+#define SKETCH_ACCURACY   0.02
+#define SKETCH_BUCKETS    256
+
+
+struct sketch
+{
+	uint64_t  zeros;
+	int32_t   offset;
+	uint8_t   empty;
+	uint32_t  counts[SKETCH_BUCKETS];
+};
+
+struct stats
+{
+	uint64_t       count;
+	double         mean;
+	double         m2;
+	uint64_t       min;
+	uint64_t       max;
+	uint64_t       prev;
+	uint8_t        primed;
+	struct sketch  sketch;
+};
+
+
+static uint8_t        summary_mode;
+
+static struct stats  *summary_stats = NULL;
+
+static size_t        *summary_offsets;
+
+static double         sketch_gamma_log;
+
+
+static int32_t sketch_index(uint64_t val)
+{
+	return (int32_t) ceil(log((double) val) / sketch_gamma_log);
+}
+
+static double sketch_value(int32_t index)
+{
+	double gamma = exp(sketch_gamma_log);
+
+	return 2.0 * exp(index * sketch_gamma_log) / (gamma + 1.0);
+}
+
+/*
+ * Move the window of buckets so that it starts at the given offset, folding
+ * the buckets falling below the window in its lowest bucket.
+ */
+static void sketch_shift(struct sketch *sketch, int32_t offset)
+{
+	uint32_t counts[SKETCH_BUCKETS];
+	int32_t i, index;
+
+	memset(counts, 0, sizeof (counts));
+	for (i=0; i<SKETCH_BUCKETS; i++) {
+		if (sketch->counts[i] == 0)
+			continue;
+		index = sketch->offset + i - offset;
+		if (index < 0)
+			index = 0;
+		counts[index] += sketch->counts[i];
+	}
+
+	memcpy(sketch->counts, counts, sizeof (counts));
+	sketch->offset = offset;
+}
+
+static void sketch_add(struct sketch *sketch, int32_t index, uint32_t count)
+{
+	int32_t high;
+
+	if (sketch->empty) {
+		sketch->offset = index - SKETCH_BUCKETS / 2;
+		sketch->empty = 0;
+	} else if (index >= sketch->offset + SKETCH_BUCKETS) {
+		sketch_shift(sketch, index - SKETCH_BUCKETS + 1);
+	} else if (index < sketch->offset) {
+		for (high=SKETCH_BUCKETS-1; high>0; high--)
+			if (sketch->counts[high])
+				break;
+		high += sketch->offset;
+
+		if (high - index < SKETCH_BUCKETS)
+			sketch_shift(sketch, index);
+		else
+			sketch_shift(sketch, high - SKETCH_BUCKETS + 1);
+	}
+
+	if (index < sketch->offset)
+		index = sketch->offset;
+	sketch->counts[index - sketch->offset] += count;
+}
+
+static void sketch_insert(struct sketch *sketch, uint64_t val)
+{
+	if (val == 0)
+		sketch->zeros++;
+	else
+		sketch_add(sketch, sketch_index(val), 1);
+}
+
+static void sketch_merge(struct sketch *dest, const struct sketch *src)
+{
+	int32_t i;
+
+	dest->zeros += src->zeros;
+	if (src->empty)
+		return;
+
+	for (i=SKETCH_BUCKETS-1; i>=0; i--)
+		if (src->counts[i])
+			sketch_add(dest, src->offset + i, src->counts[i]);
+}
+
+/*
+ * Return an estimate of the value of the given quantile for a sketch
+ * containing count values.
+ */
+static double sketch_quantile(const struct sketch *sketch, uint64_t count,
+			      double quantile)
+{
+	uint64_t rank = (uint64_t) (quantile * (count - 1)), seen;
+	int32_t i;
+
+	if (count == 0)
+		return 0;
+	if (rank < sketch->zeros)
+		return 0;
+
+	seen = sketch->zeros;
+	for (i=0; i<SKETCH_BUCKETS; i++) {
+		seen += sketch->counts[i];
+		if (seen > rank)
+			return sketch_value(sketch->offset + i);
+	}
+
+	return sketch_value(sketch->offset + SKETCH_BUCKETS - 1);
+}
+
+
+static void stats_init(struct stats *stats)
+{
+	memset(stats, 0, sizeof (*stats));
+	stats->min = ~(0ul);
+	stats->sketch.empty = 1;
+}
+
+static void stats_insert(struct stats *stats, uint64_t val)
+{
+	double delta;
+
+	stats->count++;
+	delta = val - stats->mean;
+	stats->mean += delta / stats->count;
+	stats->m2 += delta * (val - stats->mean);
+
+	if (val < stats->min)
+		stats->min = val;
+	if (val > stats->max)
+		stats->max = val;
+
+	sketch_insert(&stats->sketch, val);
+}
+
+/*
+ * Merge the statistics of src into dest, with the parallel variant of the
+ * Welford algorithm.
+ */
+static void stats_merge(struct stats *dest, const struct stats *src)
+{
+	uint64_t count = dest->count + src->count;
+	double delta = src->mean - dest->mean;
+
+	if (src->count == 0)
+		return;
+
+	dest->m2 += src->m2 + delta * delta * dest->count * src->count / count;
+	dest->mean += delta * src->count / count;
+	dest->count = count;
+
+	if (src->min < dest->min)
+		dest->min = src->min;
+	if (src->max > dest->max)
+		dest->max = src->max;
+
+	sketch_merge(&dest->sketch, &src->sketch);
+}
+
+
+int8_t summary_open(const struct engine *engine, uint8_t mode)
+{
+	size_t i, cells = 0;
+
+	summary_offsets = malloc(engine->mlen * sizeof (size_t));
+	if (!summary_offsets)
+		return -1;
+
+	for (i=0; i<engine->mlen; i++) {
+		summary_offsets[i] = cells;
+		if (engine->commands[i].flags & COMMAND_PRINT)
+			cells += engine->columns[i];
+	}
+
+	summary_stats = malloc(cells * sizeof (struct stats));
+	if (!summary_stats && cells) {
+		free(summary_offsets);
+		return -1;
+	}
+
+	for (i=0; i<cells; i++)
+		stats_init(&summary_stats[i]);
+
+	summary_mode = mode;
+	sketch_gamma_log = log((1.0 + SKETCH_ACCURACY)
+			       / (1.0 - SKETCH_ACCURACY));
+	return 0;
+}
+
+void summary_update(const struct engine *engine)
+{
+	size_t i, j, k;
+	const msrval_t *values;
+	const uint8_t *valid;
+	struct stats *stats;
+
+	for (k=0; k<engine->ndue; k++) {
+		i = engine->due_list[k];
+		if (!(engine->commands[i].flags & COMMAND_PRINT))
+			continue;
+
+		values = engine->values + engine->offsets[i];
+		valid = engine->valid + engine->offsets[i];
+		stats = summary_stats + summary_offsets[i];
+
+		for (j=0; j<engine->columns[i]; j++) {
+			if (!valid[j])
+				continue;
+
+			if (summary_mode == SUMMARY_VALUE) {
+				stats_insert(&stats[j], values[j]);
+				continue;
+			}
+
+			if (stats[j].primed)
+				stats_insert(&stats[j],
+					     values[j] - stats[j].prev);
+			stats[j].prev = values[j];
+			stats[j].primed = 1;
+		}
+	}
+}
+
+/*
+ * Return the estimate of a quantile from the sketch, bounded by the exact
+ * min and max values.
+ */
+static double stats_quantile(const struct stats *stats, double quantile)
+{
+	double val = sketch_quantile(&stats->sketch, stats->count, quantile);
+
+	if (val < stats->min)
+		return stats->min;
+	if (val > stats->max)
+		return stats->max;
+	return val;
+}
+
+static void print_stats(FILE *stream, const struct stats *stats)
+{
+	double stddev = 0;
+
+	if (stats->count == 0) {
+		fprintf(stream, " 0 - - - - - - -\n");
+		return;
+	}
+
+	if (stats->count > 1)
+		stddev = sqrt(stats->m2 / (stats->count - 1));
+
+	fprintf(stream, " %lu %.3f %.3f %lu %lu %.0f %.0f %.0f\n",
+		stats->count, stats->mean, stddev, stats->min, stats->max,
+		stats_quantile(stats, 0.50), stats_quantile(stats, 0.90),
+		stats_quantile(stats, 0.99));
+}
+
+void summary_print(FILE *stream, const struct engine *engine)
+{
+	const struct command *commands = engine->commands;
+	struct stats *stats, total;
+	const char *ptype;
+	char name[64];
+	size_t i, j;
+
+	fprintf(stream, "command column count mean stddev min max p50 p90 "
+		"p99\n");
+
+	for (i=0; i<engine->mlen; i++) {
+		if (!(commands[i].flags & COMMAND_PRINT))
+			continue;
+
+		ptype = (commands[i].flags & COMMAND_HEXA) ? "::" : ":";
+		if (commands[i].reduce == REDUCE_NONE)
+			snprintf(name, sizeof (name), "%s0x%lx", ptype,
+				 commands[i].address);
+		else
+			snprintf(name, sizeof (name), "%s0x%lx/%s", ptype,
+				 commands[i].address,
+				 reduce_name(commands[i].reduce));
+
+		stats = summary_stats + summary_offsets[i];
+		stats_init(&total);
+
+		for (j=0; j<engine->columns[i]; j++) {
+			if (commands[i].reduce == REDUCE_NONE)
+				fprintf(stream, "%s %u", name,
+					column_core(engine, i, j));
+			else if (commands[i].flags & COMMAND_SOCKET)
+				fprintf(stream, "%s s%u", name,
+					column_socket(engine, i, j));
+			else
+				fprintf(stream, "%s all", name);
+
+			print_stats(stream, &stats[j]);
+			stats_merge(&total, &stats[j]);
+		}
+
+		if (engine->columns[i] > 1) {
+			fprintf(stream, "%s *", name);
+			print_stats(stream, &total);
+		}
+	}
+
+	fflush(stream);
+}
+
+void summary_close(void)
+{
+	free(summary_stats);
+	free(summary_offsets);
+	summary_stats = NULL;
+	summary_offsets = NULL;
+}
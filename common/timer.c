@@ -0,0 +1,337 @@
+/*
+ * Copyright 2015 Gauthier Voron
+ * This file is part of rwmsr.
+ *
+ * Rwmsr is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Rwmsr is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with rwmsr. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "engine.h"
+#include "timer.h"
+
+
+static const struct command *sort_commands;
+
+static const uint64_t       *sort_nexts;
+
+
+static uint64_t command_delay(const struct command *command)
+{
+	if (command->flags & COMMAND_DELAY)
+		return command->delay;
+	return 0;
+}
+
+static uint32_t command_repeat(const struct command *command)
+{
+	if (!(command->flags & COMMAND_REPEAT))
+		return 0;
+	if (command->repeat == 0)
+		return 1;
+	return command->repeat;
+}
+
+static int compare_commands(const void *a, const void *b)
+{
+	size_t ia = *(const size_t *) a, ib = *(const size_t *) b;
+	const struct command *ca = &sort_commands[ia];
+	const struct command *cb = &sort_commands[ib];
+	uint64_t da = sort_nexts[ia], db = sort_nexts[ib];
+	uint32_t ra = command_repeat(ca), rb = command_repeat(cb);
+
+	if (da != db)
+		return da < db ? -1 : 1;
+	if (ra != rb)
+		return ra < rb ? -1 : 1;
+	if (ia != ib)
+		return ia < ib ? -1 : 1;
+	return 0;
+}
+
+
+static int compare_indexes(const void *a, const void *b)
+{
+	size_t ia = *(const size_t *) a, ib = *(const size_t *) b;
+
+	return (ia > ib) - (ia < ib);
+}
+
+
+static uint8_t heap_less(const struct timer *timer, size_t a, size_t b)
+{
+	return timer->groups[timer->heap[a]].next
+		< timer->groups[timer->heap[b]].next;
+}
+
+static void heap_swap(struct timer *timer, size_t a, size_t b)
+{
+	size_t tmp = timer->heap[a];
+
+	timer->heap[a] = timer->heap[b];
+	timer->heap[b] = tmp;
+	timer->positions[timer->heap[a]] = a;
+	timer->positions[timer->heap[b]] = b;
+}
+
+static void heap_up(struct timer *timer, size_t pos)
+{
+	size_t parent;
+
+	while (pos > 0) {
+		parent = (pos - 1) / 2;
+		if (!heap_less(timer, pos, parent))
+			break;
+		heap_swap(timer, pos, parent);
+		pos = parent;
+	}
+}
+
+static void heap_down(struct timer *timer, size_t pos)
+{
+	size_t child;
+
+	while ((child = 2 * pos + 1) < timer->hlen) {
+		if (child + 1 < timer->hlen && heap_less(timer, child + 1, child))
+			child++;
+		if (!heap_less(timer, child, pos))
+			break;
+		heap_swap(timer, child, pos);
+		pos = child;
+	}
+}
+
+/*
+ * Take a free group, set it to the given next time and repeat period, and
+ * insert it in the heap.
+ * Return the index of the group.
+ */
+static size_t add_group(struct timer *timer, uint64_t next, uint32_t repeat)
+{
+	size_t g = timer->free_groups[--timer->nfree];
+	struct timer_group *group = &timer->groups[g];
+
+	group->next = next;
+	group->repeat = repeat;
+	group->periodic = (repeat != 0);
+	group->head = TIMER_NONE;
+	group->count = 0;
+
+	timer->heap[timer->hlen] = g;
+	timer->positions[g] = timer->hlen;
+	heap_up(timer, timer->hlen++);
+	return g;
+}
+
+/*
+ * Remove the group at the top of the heap, unschedule its commands and free
+ * the group.
+ */
+static void pop_group(struct timer *timer)
+{
+	size_t i, g = timer->heap[0];
+
+	for (i=timer->groups[g].head; i!=TIMER_NONE; i=timer->member_next[i])
+		timer->command_groups[i] = TIMER_NONE;
+
+	timer->positions[g] = TIMER_NONE;
+	timer->free_groups[timer->nfree++] = g;
+	timer->heap[0] = timer->heap[--timer->hlen];
+	if (timer->hlen > 0)
+		timer->positions[timer->heap[0]] = 0;
+	heap_down(timer, 0);
+}
+
+/*
+ * Append the command i at the end of the members of the group g, whose
+ * members all have a lower index.
+ */
+static void append_member(struct timer *timer, size_t g, size_t i,
+			  size_t *tail)
+{
+	struct timer_group *group = &timer->groups[g];
+
+	timer->member_next[i] = TIMER_NONE;
+	timer->member_prev[i] = *tail;
+	if (*tail == TIMER_NONE)
+		group->head = i;
+	else
+		timer->member_next[*tail] = i;
+	*tail = i;
+	group->count++;
+	timer->command_groups[i] = g;
+}
+
+static void remove_member(struct timer *timer, size_t g, size_t i)
+{
+	struct timer_group *group = &timer->groups[g];
+	size_t prev = timer->member_prev[i], next = timer->member_next[i];
+
+	if (prev == TIMER_NONE)
+		group->head = next;
+	else
+		timer->member_next[prev] = next;
+	if (next != TIMER_NONE)
+		timer->member_prev[next] = prev;
+	group->count--;
+	timer->command_groups[i] = TIMER_NONE;
+}
+
+
+uint64_t timer_first(const struct command *command, uint64_t origin)
+{
+	return origin + command_delay(command);
+}
+
+int8_t timer_setup(struct timer *timer, const struct command *commands,
+		   const uint64_t *nexts, size_t mlen)
+{
+	size_t i, k, g = TIMER_NONE, tail = TIMER_NONE, n = 0;
+	size_t *order;
+
+	memset(timer, 0, sizeof (*timer));
+
+	order = malloc((mlen + 1) * sizeof (size_t));
+	timer->member_next = malloc((mlen + 1) * sizeof (size_t));
+	timer->member_prev = malloc((mlen + 1) * sizeof (size_t));
+	timer->groups = malloc((mlen + 1) * sizeof (struct timer_group));
+	timer->heap = malloc((mlen + 1) * sizeof (size_t));
+	timer->positions = malloc((mlen + 1) * sizeof (size_t));
+	timer->free_groups = malloc((mlen + 1) * sizeof (size_t));
+	timer->command_groups = malloc((mlen + 1) * sizeof (size_t));
+	if (!order || !timer->member_next || !timer->member_prev
+	    || !timer->groups || !timer->heap || !timer->positions
+	    || !timer->free_groups || !timer->command_groups) {
+		free(order);
+		timer_release(timer);
+		return -1;
+	}
+
+	for (i=0; i<mlen; i++) {
+		timer->command_groups[i] = TIMER_NONE;
+		if (nexts[i] != ~(0ul))
+			order[n++] = i;
+	}
+
+	for (k=0; k<=mlen; k++) {
+		timer->free_groups[k] = mlen - k;
+		timer->positions[k] = TIMER_NONE;
+	}
+	timer->nfree = mlen + 1;
+
+	sort_commands = commands;
+	sort_nexts = nexts;
+	qsort(order, n, sizeof (size_t), compare_commands);
+
+	/*
+	 * Groups are created by increasing next time, so appending them to
+	 * the heap never moves them.
+	 */
+	for (k=0; k<n; k++) {
+		i = order[k];
+		if (k == 0 || nexts[i] != nexts[order[k - 1]]
+		    || command_repeat(&commands[i])
+		    != command_repeat(&commands[order[k - 1]])) {
+			g = add_group(timer, nexts[i],
+				      command_repeat(&commands[i]));
+			tail = TIMER_NONE;
+		}
+		append_member(timer, g, i, &tail);
+	}
+
+	free(order);
+	return 0;
+}
+
+void timer_release(struct timer *timer)
+{
+	free(timer->member_next);
+	free(timer->member_prev);
+	free(timer->groups);
+	free(timer->heap);
+	free(timer->positions);
+	free(timer->free_groups);
+	free(timer->command_groups);
+	memset(timer, 0, sizeof (*timer));
+}
+
+uint64_t timer_command_next(const struct timer *timer, size_t i)
+{
+	size_t g = timer->command_groups[i];
+
+	if (g == TIMER_NONE)
+		return ~(0ul);
+	return timer->groups[g].next;
+}
+
+void timer_update(struct timer *timer, size_t i, uint64_t next,
+		  uint32_t repeat)
+{
+	size_t g = timer->command_groups[i], tail = TIMER_NONE;
+	struct timer_group *group;
+
+	if (g != TIMER_NONE && timer->groups[g].count == 1) {
+		group = &timer->groups[g];
+		group->next = next;
+		group->repeat = repeat;
+		group->periodic = (repeat != 0);
+		heap_up(timer, timer->positions[g]);
+		heap_down(timer, timer->positions[g]);
+		return;
+	}
+
+	if (g != TIMER_NONE)
+		remove_member(timer, g, i);
+
+	g = add_group(timer, next, repeat);
+	append_member(timer, g, i, &tail);
+}
+
+uint64_t timer_next(const struct timer *timer)
+{
+	if (timer->hlen == 0)
+		return ~(0ul);
+	return timer->groups[timer->heap[0]].next;
+}
+
+size_t timer_expire(struct timer *timer, uint64_t now, size_t *due)
+{
+	struct timer_group *group;
+	size_t i, count = 0, popped = 0;
+
+	while (timer->hlen > 0) {
+		group = &timer->groups[timer->heap[0]];
+		if (group->next > now)
+			break;
+
+		for (i=group->head; i!=TIMER_NONE; i=timer->member_next[i])
+			due[count++] = i;
+		popped++;
+
+		if (group->periodic) {
+			group->next += ((now - group->next) / group->repeat
+					+ 1) * group->repeat;
+			heap_down(timer, 0);
+		} else {
+			pop_group(timer);
+		}
+	}
+
+	if (popped > 1)
+		qsort(due, count, sizeof (size_t), compare_indexes);
+
+	return count;
+}
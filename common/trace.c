@@ -0,0 +1,251 @@
+/*
+ * Copyright 2015 Gauthier Voron
+ * This file is part of rwmsr.
+ *
+ * Rwmsr is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Rwmsr is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with rwmsr. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "engine.h"
+#include "trace.h"
+
+
+#define TRACE_BUFFER_SIZE   (1 << 20)
+
+
+static FILE      *trace = NULL;
+
+static uint32_t   trace_keyframe;
+
+static uint64_t   trace_ticks;
+
+static uint64_t   trace_time;
+
+static uint8_t   *trace_frame;
+
+static uint8_t   *trace_due;
+
+static uint64_t  *trace_stamps;
+
+static msrval_t  *trace_values;
+
+static size_t    *trace_missing;
+
+
+size_t put_varint(uint8_t *buf, uint64_t val)
+{
+	size_t len = 0;
+
+	while (val >= 0x80) {
+		buf[len++] = (uint8_t) (val | 0x80);
+		val >>= 7;
+	}
+	buf[len++] = (uint8_t) val;
+
+	return len;
+}
+
+const uint8_t *get_varint(const uint8_t *buf, const uint8_t *end,
+			  uint64_t *val)
+{
+	uint64_t res = 0;
+	unsigned int shift = 0;
+
+	while (buf < end && shift < 64) {
+		res |= ((uint64_t) (*buf & 0x7f)) << shift;
+		if (!(*buf++ & 0x80)) {
+			*val = res;
+			return buf;
+		}
+		shift += 7;
+	}
+
+	return NULL;
+}
+
+uint64_t zigzag_encode(int64_t val)
+{
+	return (((uint64_t) val) << 1) ^ (uint64_t) (val >> 63);
+}
+
+int64_t zigzag_decode(uint64_t val)
+{
+	return (int64_t) (val >> 1) ^ -((int64_t) (val & 1));
+}
+
+
+int8_t trace_open(const struct engine *engine, const char *path,
+		  uint32_t keyframe)
+{
+	struct trace_header header;
+	size_t dlen, cells = engine->offsets[engine->mlen];
+	void *desc;
+
+	trace = fopen(path, "w");
+	if (!trace)
+		return -1;
+	setvbuf(trace, NULL, _IOFBF, TRACE_BUFFER_SIZE);
+
+	memset(&header, 0, sizeof (header));
+	memcpy(header.magic, TRACE_MAGIC, sizeof (header.magic));
+	header.start = engine->start;
+	header.mlen = engine->mlen;
+	header.rlen = engine->rlen;
+	header.flags = engine->stamps ? TRACE_STAMPS : 0;
+	header.keyframe = keyframe;
+	fwrite(&header, sizeof (header), 1, trace);
+
+	dlen = describe_engine(engine, NULL);
+	desc = malloc(dlen);
+	if (desc) {
+		describe_engine(engine, desc);
+		fwrite(desc, dlen, 1, trace);
+		free(desc);
+	}
+
+	trace_keyframe = keyframe ? keyframe : 1;
+	trace_ticks = 0;
+	trace_time = 0;
+	trace_frame = malloc(1 + TRACE_VARINT_MAXLEN + (engine->mlen + 7) / 8
+			     + (engine->rlen + 2 * cells + engine->mlen + 1)
+			     * TRACE_VARINT_MAXLEN);
+	trace_due = calloc(engine->mlen, sizeof (uint8_t));
+	trace_stamps = calloc(engine->rlen, sizeof (uint64_t));
+	trace_values = calloc(cells, sizeof (msrval_t));
+	trace_missing = malloc((cells + 1) * sizeof (size_t));
+
+	if (!desc || !trace_frame || !trace_due || !trace_stamps
+	    || !trace_values || !trace_missing || ferror(trace)) {
+		trace_close();
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Encode the due commands bitmap in buf.
+ * Return the number of bytes written.
+ */
+static size_t put_due(uint8_t *buf, const uint8_t *due, size_t mlen)
+{
+	size_t i;
+
+	memset(buf, 0, (mlen + 7) / 8);
+	for (i=0; i<mlen; i++)
+		if (due[i])
+			buf[i / 8] |= 1 << (i % 8);
+
+	return (mlen + 7) / 8;
+}
+
+void trace_write(const struct engine *engine, uint64_t time)
+{
+	size_t i, j, k, n = 0, len = 0, rlen = engine->rlen, column = 0;
+	size_t cells = engine->offsets[engine->mlen];
+	uint8_t key = (trace_ticks++ % trace_keyframe) == 0;
+	uint8_t *buf = trace_frame;
+	const msrval_t *values;
+	const uint8_t *valid;
+	msrval_t *prev;
+
+	if (key) {
+		fflush(trace);
+		fwrite(TRACE_KEYFRAME_MARK, sizeof (TRACE_KEYFRAME_MARK), 1,
+		       trace);
+		buf[len++] = TRACE_KEYFRAME;
+		len += put_varint(buf + len, time);
+		len += put_due(buf + len, engine->due, engine->mlen);
+	} else if (memcmp(trace_due, engine->due, engine->mlen)) {
+		buf[len++] = TRACE_DELTA_DUE;
+		len += put_varint(buf + len, time - trace_time);
+		len += put_due(buf + len, engine->due, engine->mlen);
+	} else {
+		buf[len++] = TRACE_DELTA;
+		len += put_varint(buf + len, time - trace_time);
+	}
+
+	memcpy(trace_due, engine->due, engine->mlen);
+	trace_time = time;
+
+	if (key)
+		memset(trace_values, 0, cells * sizeof (msrval_t));
+
+	if (engine->stamps) {
+		for (j=0; j<rlen; j++) {
+			if (key)
+				len += put_varint(buf + len,
+						  engine->stamps[j]);
+			else
+				len += put_varint(buf + len, zigzag_encode(
+					engine->stamps[j] - trace_stamps[j]));
+			trace_stamps[j] = engine->stamps[j];
+		}
+	}
+
+	for (i=0; i<engine->mlen; i++) {
+		if (!engine->due[i])
+			continue;
+
+		values = engine->values + engine->offsets[i];
+		valid = engine->valid + engine->offsets[i];
+		prev = trace_values + engine->offsets[i];
+
+		for (j=0; j<engine->columns[i]; j++, column++) {
+			if (!valid[j]) {
+				trace_missing[n++] = column;
+				buf[len++] = 0;
+				continue;
+			}
+
+			if (key)
+				len += put_varint(buf + len, values[j]);
+			else
+				len += put_varint(buf + len, zigzag_encode(
+					values[j] - prev[j]));
+			prev[j] = values[j];
+		}
+	}
+
+	len += put_varint(buf + len, n);
+	for (k=0; k<n; k++)
+		len += put_varint(buf + len, trace_missing[k]
+				  - (k ? trace_missing[k - 1] : 0));
+
+	for (i=0; i<engine->mlen; i++)
+		if (engine->due[i]
+		    && (engine->commands[i].flags & COMMAND_ADAPTIVE))
+			len += put_varint(buf + len, engine->periods[i]);
+
+	fwrite(buf, len, 1, trace);
+}
+
+void trace_close(void)
+{
+	if (trace == NULL)
+		return;
+
+	fclose(trace);
+	trace = NULL;
+
+	free(trace_frame);
+	free(trace_due);
+	free(trace_stamps);
+	free(trace_values);
+	free(trace_missing);
+}
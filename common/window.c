@@ -0,0 +1,156 @@
+/*
+ * Copyright 2015 Gauthier Voron
+ * This file is part of rwmsr.
+ *
+ * Rwmsr is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Rwmsr is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with rwmsr. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "engine.h"
+#include "window.h"
+
+
+struct window_stats
+{
+	uint64_t  count;
+	double    mean;
+	msrval_t  min;
+	msrval_t  max;
+	msrval_t  last;
+};
+
+
+static struct window_stats  *window_stats = NULL;
+
+static uint32_t              window_length;
+
+static uint64_t              window_start;
+
+static uint8_t               window_filled;
+
+
+static void reset_stats(size_t cells)
+{
+	size_t c;
+
+	for (c=0; c<cells; c++) {
+		memset(&window_stats[c], 0, sizeof (window_stats[c]));
+		window_stats[c].min = ~(0ul);
+	}
+	window_filled = 0;
+}
+
+int8_t window_open(const struct engine *engine, uint32_t length)
+{
+	size_t cells = engine->offsets[engine->mlen];
+
+	window_stats = malloc((cells + 1) * sizeof (struct window_stats));
+	if (!window_stats)
+		return -1;
+
+	window_length = length;
+	window_start = 0;
+	reset_stats(cells);
+	return 0;
+}
+
+void window_flush(FILE *stream, const struct engine *engine)
+{
+	size_t i, j;
+	const char *fmt;
+	const char *dfmt = " %lu/%lu/%lu/%lu";
+	const char *hfmt = " %lx/%lx/%lx/%lx";
+	const struct command *commands = engine->commands;
+	const struct window_stats *stats;
+
+	if (!window_filled)
+		return;
+
+	fprintf(stream, "%lu.%03lu", window_start / 1000, window_start % 1000);
+
+	for (i=0; i<engine->mlen; i++) {
+		if (!(commands[i].flags & COMMAND_PRINT))
+			continue;
+
+		if (commands[i].flags & COMMAND_HEXA)
+			fmt = hfmt;
+		else
+			fmt = dfmt;
+
+		for (j=0; j<engine->columns[i]; j++) {
+			stats = &window_stats[engine->offsets[i] + j];
+			if (stats->count == 0) {
+				fprintf(stream, " -");
+				continue;
+			}
+			fprintf(stream, fmt, stats->min, stats->max,
+				(msrval_t) (stats->mean + 0.5), stats->last);
+		}
+
+		if (commands[i].flags & COMMAND_ADAPTIVE)
+			fprintf(stream, " %u", engine->periods[i]);
+	}
+
+	fprintf(stream, "\n");
+	fflush(stream);
+
+	reset_stats(engine->offsets[engine->mlen]);
+}
+
+void window_update(FILE *stream, const struct engine *engine, uint64_t time)
+{
+	size_t i, j, k, c;
+	msrval_t val;
+	struct window_stats *stats;
+
+	if (time >= window_start + window_length) {
+		window_flush(stream, engine);
+		window_start = time - time % window_length;
+	}
+
+	for (k=0; k<engine->ndue; k++) {
+		i = engine->due_list[k];
+		if (!(engine->commands[i].flags & COMMAND_PRINT))
+			continue;
+
+		for (j=0; j<engine->columns[i]; j++) {
+			c = engine->offsets[i] + j;
+			if (!engine->valid[c])
+				continue;
+
+			val = engine->values[c];
+			stats = &window_stats[c];
+
+			stats->count++;
+			stats->mean += ((double) val - stats->mean)
+				/ stats->count;
+			if (val < stats->min)
+				stats->min = val;
+			if (val > stats->max)
+				stats->max = val;
+			stats->last = val;
+			window_filled = 1;
+		}
+	}
+}
+
+void window_close(void)
+{
+	free(window_stats);
+	window_stats = NULL;
+}
@@ -0,0 +1,116 @@
+/*
+ * Copyright 2015 Gauthier Voron
+ * This file is part of rwmsr.
+ *
+ * Rwmsr is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Rwmsr is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with rwmsr. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "rwmsr.h"
+
+
+/*
+ * The capture file records every access made through the module interface,
+ * so it can be served back later by the replay module. It starts with a
+ * header, followed by the socket of each core id up to maxid, followed by one
+ * record per access.
+ * Fixed size integers are in the host byte order.
+ *
+ *   header   struct capture_header
+ *   sockets  (maxid + 1) * uint32_t
+ *   records  struct capture_record ...
+ *
+ * The time of a record is in nanoseconds since the start of the capture, all
+ * the accesses of a same module call having the same time. The value field
+ * is the value read (the previous value for a read-write) and the written
+ * field the value written, if any.
+ */
+
+#define CAPTURE_MAGIC      "RWMSRCP1"
+#define CAPTURE_SOCKETS    (1 << 0)
+
+#define CAPTURE_READ       1
+#define CAPTURE_WRITE      2
+#define CAPTURE_READWRITE  3
+
+
+struct capture_header
+{
+	char      magic[8];
+	uint64_t  numcore;
+	uint64_t  maxid;
+	uint32_t  flags;
+	uint32_t  reserved;
+};
+
+struct capture_record
+{
+	uint64_t  time;
+	msradr_t  address;
+	msrval_t  value;
+	msrval_t  written;
+	uint8_t   core;
+	uint8_t   type;
+	uint8_t   success;
+	uint8_t   reserved[5];
+};
+
+
+/*
+ * Create the capture file at the given path and write its header, from the
+ * informations of the loaded module.
+ * Return 0 in case of success, -1 otherwise.
+ */
+int8_t capture_open(const char *path);
+
+/*
+ * Indicate if a capture is in progress.
+ */
+uint8_t capture_enabled(void);
+
+/*
+ * Keep a copy of the len values to write, so they can be recorded once the
+ * read-write call overwrote them.
+ * Return the copy, valid until the next call, or NULL in case of error.
+ */
+const msrval_t *capture_stash(const msrval_t *vals, size_t len);
+
+/*
+ * Merge the len previous values returned by a read-modify-write call with
+ * the stashed values, so the stash holds the values actually written.
+ * Return the stash.
+ */
+const msrval_t *capture_merge(const msrval_t *olds, const msrval_t *masks,
+			      size_t len);
+
+/*
+ * Record the len accesses of a module call of the given type, with the vals
+ * read and the values written, any of them being NULL if the call does not
+ * read or write. The success bitmap indicates which accesses succeeded, or
+ * is NULL if the call only returned the number done of successes.
+ */
+void capture_write(uint8_t type, const msradr_t *addrs, const msrval_t *vals,
+		   const msrval_t *written, const uint8_t *cores, size_t len,
+		   const uint64_t *success, size_t done);
+
+void capture_close(void);
+
+
+#endif
@@ -0,0 +1,84 @@
+/*
+ * Copyright 2015 Gauthier Voron
+ * This file is part of rwmsr.
+ *
+ * Rwmsr is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Rwmsr is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with rwmsr. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef CONTROL_H
+#define CONTROL_H
+
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "engine.h"
+#include "event.h"
+
+
+#define CONTROL_ADD      1
+#define CONTROL_REMOVE   2
+#define CONTROL_PERIOD   3
+#define CONTROL_LIST     4
+
+
+/*
+ * An operation requested on the control socket, one per line:
+ *
+ *   add <command>               add a command, in the command line grammar
+ *   remove <index>              remove the command at the given index
+ *   period <index> <repeat>     change the repeat period of a command
+ *   list                        list the commands with their index
+ *
+ * The client field identifies the connection to reply to, or is -1 if the
+ * connection has been closed since.
+ */
+struct control_op
+{
+	uint8_t         type;
+	int             client;
+	size_t          index;
+	uint32_t        repeat;
+	struct command  command;
+};
+
+
+/*
+ * Create a Unix domain stream socket at the given path and watch it with the
+ * event loop. The operations received are queued until control_pending().
+ * Return 0 in case of success, -1 otherwise.
+ */
+int8_t control_open(struct events *events, const char *path);
+
+/*
+ * Return the number of queued operations and set ops to their array if it is
+ * not NULL. The operations stay queued until control_done() is called.
+ */
+size_t control_pending(struct control_op **ops);
+
+/*
+ * Send a formatted reply line to the client of the given operation.
+ */
+void control_reply(const struct control_op *op, const char *format, ...);
+
+/*
+ * Drop the queued operations.
+ */
+void control_done(void);
+
+void control_close(struct events *events);
+
+
+#endif
@@ -27,25 +27,316 @@
 #include "rwmsr.h"
 
 
-#define COMMAND_PRINT   (1 << 0)
-#define COMMAND_HEXA    (1 << 1)
-#define COMMAND_WRITE   (1 << 2)
-#define COMMAND_DELAY   (1 << 3)
-#define COMMAND_REPEAT  (1 << 4)
+#define COMMAND_PRINT    (1 << 0)
+#define COMMAND_HEXA     (1 << 1)
+#define COMMAND_WRITE    (1 << 2)
+#define COMMAND_DELAY    (1 << 3)
+#define COMMAND_REPEAT   (1 << 4)
+#define COMMAND_SOCKET   (1 << 5)
+#define COMMAND_CORES    (1 << 6)
+#define COMMAND_CONSTANT (1 << 7)
+#define COMMAND_ADAPTIVE (1 << 8)
+#define COMMAND_MASKED   (1 << 9)
+#define COMMAND_STEP     (1 << 10)
+#define COMMAND_DECREASE (1 << 11)
 
+#define REDUCE_NONE     0
+#define REDUCE_SUM      1
+#define REDUCE_MIN      2
+#define REDUCE_MAX      3
+#define REDUCE_MEAN     4
 
+#define CORES_MAX       256
+
+#define CONDITION_NONE  0
+#define CONDITION_LT    1
+#define CONDITION_LE    2
+#define CONDITION_EQ    3
+#define CONDITION_NE    4
+#define CONDITION_GE    5
+#define CONDITION_GT    6
+
+#define CONDITION_VALUE 0
+#define CONDITION_DELTA 1
+#define CONDITION_RATE  2
+
+#define COMMAND_HAS_CORE(cmd, id) \
+	(((cmd)->cores[(id) / 64] >> ((id) % 64)) & 1)
+#define COMMAND_SET_CORE(cmd, id) \
+	((cmd)->cores[(id) / 64] |= 1ul << ((id) % 64))
+
+
+/*
+ * A command to execute on each selected core.
+ * If reduce is not REDUCE_NONE, the values read on the selected cores are
+ * reduced into a single column, or into one column per socket if the
+ * COMMAND_SOCKET flag is set.
+ * The cores bitmap indicates the cores on which the command is executed. It
+ * is set from the command itself if the COMMAND_CORES flag is set, and from
+ * the global core set otherwise.
+ * A command with the COMMAND_CONSTANT flag reads a register which never
+ * changes, so it is read only once and then output from memory.
+ * A command with the COMMAND_ADAPTIVE flag repeats with a period between
+ * repeat and repeat_max milliseconds, halved when the values change by more
+ * than threshold between two executions and doubled otherwise.
+ * A write command with the COMMAND_MASKED flag only writes the bits set in
+ * mask, as a read-modify-write keeping the other bits of the register. The
+ * value is then already shifted to the position of these bits.
+ * A masked write command with the COMMAND_STEP flag adds its value to the
+ * field of the bits set in mask, or subtracts it with the COMMAND_DECREASE
+ * flag, the field saturating at 0 and at its largest value. Only the
+ * commands of the rules can step.
+ * A command with a non zero stride stands for a range of commands, one for
+ * each address from address to last included, every stride addresses. It
+ * must be expanded with expand_command() before being executed.
+ */
 struct command
 {
-	uint8_t   flags;
+	uint16_t  flags;
+	uint8_t   reduce;
 	msradr_t  address;
+	msradr_t  last;
+	msradr_t  stride;
 	msrval_t  value;
+	msrval_t  mask;
 	uint32_t  delay;
 	uint32_t  repeat;
+	uint32_t  repeat_max;
+	msrval_t  threshold;
+	uint64_t  cores[CORES_MAX / 64];
+};
+
+
+/*
+ * A condition on the values read at an address.
+ * The condition holds if (value & mask) <op> threshold for any column of a
+ * command reading the address, op being one of the CONDITION_* constants, or
+ * CONDITION_NONE if there is no condition.
+ * With the CONDITION_DELTA mode, the threshold is compared to the increase
+ * of the field selected by mask since the previous execution of the command,
+ * modulo the width of the field so a wrapping counter is handled. With the
+ * CONDITION_RATE mode, it is compared to this increase per second.
+ */
+struct condition
+{
+	uint8_t   op;
+	uint8_t   mode;
+	msradr_t  address;
+	msrval_t  mask;
+	msrval_t  threshold;
+};
+
+/*
+ * A condition which switches the periodic commands to a burst period for a
+ * duration, both in milliseconds.
+ * If ticks is not 0, the line output only prints the bursts, and keeps the
+ * last ticks ticks before a burst in memory to print them once it starts.
+ */
+struct trigger
+{
+	struct condition  condition;
+	uint32_t          period;
+	uint32_t          duration;
+	uint32_t          ticks;
+};
+
+/*
+ * A closed-loop control rule. The on command is written once the condition
+ * holds, then the off command, if its flags are not 0, once the condition no
+ * longer holds with the release threshold in place of the threshold, so the
+ * rule does not flap around a single threshold.
+ */
+struct rule
+{
+	struct condition  condition;
+	msrval_t          release;
+	struct command    on;
+	struct command    off;
+};
+
+
+/*
+ * Configuration of the engine, set from the command line options.
+ * The timestamps field indicates the clock used to timestamp the accesses of
+ * each core (one of the STAMP_* constants), or STAMP_NONE to disable per-core
+ * timestamps.
+ * If realtime is set, the engine runs with the SCHED_FIFO policy at the
+ * realtime_priority, pinned on the realtime_cpu.
+ * If control_path is set, the engine accepts commands changes on a control
+ * socket at this path. The commands added without cores use the cores bitmap,
+ * and the cores they specify must be lower than cores_size.
+ * If elide_writes is set, the writes of a value the register is known to
+ * already contain are skipped.
+ * If window is not 0, the text output prints the statistics of each window
+ * of this many milliseconds instead of the values of each tick.
+ * If sparse is not 0, the text output only prints the columns which changed,
+ * with all the columns every sparse printed ticks.
+ * The trigger switches the engine to burst sampling when its condition holds.
+ * The nrules rules write registers in reaction to the values of each tick.
+ */
+struct engine_config
+{
+	uint8_t       timestamps;
+	const char   *recorder_path;
+	uint32_t      recorder_seconds;
+	const char   *trace_path;
+	uint32_t      trace_keyframe;
+	uint8_t       summary;
+	const char   *metrics_address;
+	uint8_t       realtime;
+	uint32_t      realtime_cpu;
+	uint8_t       realtime_priority;
+	const char   *control_path;
+	uint64_t      cores[CORES_MAX / 64];
+	size_t        cores_size;
+	uint8_t       elide_writes;
+	uint32_t      window;
+	uint32_t      sparse;
+	struct trigger trigger;
+	const struct rule *rules;
+	size_t        nrules;
+};
+
+
+/*
+ * Running state of the engine.
+ * The cores array lists the rlen cores used by at least one command. The
+ * values and addresses arrays contain one cell for each core of each of the
+ * mlen commands, the cells of the command i starting at offsets[i] and ending
+ * at offsets[i + 1], and the members array indicates the index in the cores
+ * array of each cell. The due array indicates which commands are executed
+ * during the current tick, and the due_list array lists the ndue indexes of
+ * these commands in increasing order. The valid array indicates for each
+ * cell of the due commands whether its value has been accessed successfully
+ * during the current tick, failed cells having a value of 0.
+ * When per-core timestamps are enabled, the stamps array contains the time
+ * of the last access batch of each core, in nanoseconds since the origin.
+ * Otherwise it is NULL.
+ * During a burst started by the trigger, burst_end is the time the burst
+ * ends, in milliseconds since the epoch. Otherwise it is 0.
+ * The batch arrays gather the accesses of the due commands of a tick, so they
+ * are sent to the backend with one read-write call and one read call. The
+ * batch_writes and batch_reads arrays give the end of the read-writes and of
+ * the reads of each core in the batch.
+ * The batch_cells array gives the cell of each access of the batch, the
+ * batch_masks array the bits written by each read-write, and the
+ * batch_success bitmap which of these accesses succeeded.
+ * The register_slots array gives for each cell the cell holding the entries
+ * of its register, accessed by the same address on the same core. The
+ * fault_counts array counts the consecutive failures of each register and
+ * the fault_skips array how many of its next ticks skip it. The fault_ticks
+ * array gives the last tick which skipped each register or counted its
+ * failure, ticks counting the access batches set up so far.
+ * When the write-elision cache is enabled, the cache arrays give the last
+ * value read or written in each register. Otherwise they are NULL. The
+ * total_writes and elided_writes fields count the due writes and the
+ * skipped ones.
+ * The registers array lists the first cell of each of the nregisters
+ * registers, sorted by address then core, to find the cells of a register
+ * written by a rule.
+ * The engaged array indicates for each rule whether its on command has been
+ * written last, and the rule arrays gather the writes of the rules firing
+ * during a tick, so they are sent to the backend with one call. The
+ * rule_steps array gives the step flags of each write, whose register is
+ * first read in the rule_reads array to compute the value to write.
+ * The periods array gives the current repeat period of each adaptive
+ * command and the sampled array whether it has been executed already. The
+ * previous array gives the last valid value of each column, and the
+ * previous_times array the time it was read at, in milliseconds since the
+ * epoch, or 0 if it has never been.
+ * The constants array indicates for each command whether it reads a constant
+ * register and whether it has been read already, in which case its cells are
+ * copied from the constant_values array instead of being accessed.
+ * The sockets array contains the socket of each core, the groups array maps
+ * each core to the index of its socket in the ngroups sockets listed in the
+ * group_sockets array, which contain group_counts cores. The columns array
+ * indicates how many columns each command outputs, which are stored at the
+ * beginning of its cells once reduced.
+ * For a command reduced by socket, the column_groups array gives the group
+ * of each column and the column_counts array its number of cells, both at
+ * the offset of the command, and the cell_groups array gives the column of
+ * each cell.
+ */
+struct engine
+{
+	const struct engine_config  *config;
+	const struct command        *commands;
+	size_t                       mlen;
+	const uint8_t               *cores;
+	const uint32_t              *sockets;
+	size_t                       rlen;
+
+	size_t                      *groups;
+	size_t                      *group_counts;
+	uint32_t                    *group_sockets;
+	size_t                       ngroups;
+	size_t                      *columns;
+	size_t                      *offsets;
+	size_t                      *members;
+	size_t                      *cell_groups;
+	size_t                      *column_groups;
+	size_t                      *column_counts;
+
+	uint64_t                     start;
+	uint8_t                     *due;
+	size_t                      *due_list;
+	size_t                       ndue;
+	msrval_t                    *values;
+	uint8_t                     *valid;
+	msradr_t                    *addresses;
+	msrval_t                    *scratch;
+
+	uint64_t                    *stamps;
+	uint64_t                     origin;
+
+	uint64_t                     burst_end;
+
+	msradr_t                    *batch_addresses;
+	msrval_t                    *batch_values;
+	msrval_t                    *batch_masks;
+	uint8_t                     *batch_cores;
+	size_t                      *batch_slots;
+	size_t                      *batch_aliases;
+	size_t                      *batch_writes;
+	size_t                      *batch_reads;
+	size_t                      *batch_cells;
+	uint64_t                    *batch_success;
+
+	uint8_t                     *constants;
+	msrval_t                    *constant_values;
+
+	size_t                      *register_slots;
+	size_t                      *registers;
+	size_t                       nregisters;
+	uint32_t                    *fault_counts;
+	uint32_t                    *fault_skips;
+	uint64_t                    *fault_ticks;
+	uint64_t                     ticks;
+
+	uint8_t                     *engaged;
+	msradr_t                    *rule_addresses;
+	msrval_t                    *rule_values;
+	msrval_t                    *rule_masks;
+	uint8_t                     *rule_cores;
+	uint16_t                    *rule_steps;
+	msrval_t                    *rule_reads;
+	uint64_t                    *rule_success;
+
+	uint32_t                    *periods;
+	msrval_t                    *previous;
+	uint64_t                    *previous_times;
+	uint8_t                     *sampled;
+
+	uint8_t                     *cache_valid;
+	msrval_t                    *cache_values;
+	uint64_t                     total_writes;
+	uint64_t                     elided_writes;
 };
 
 
 void execute(const struct command *commands, size_t mlen, const uint8_t *cores,
-	     size_t rlen);
+	     const uint32_t *sockets, size_t rlen,
+	     const struct engine_config *config);
 
 
 #endif
@@ -0,0 +1,99 @@
+/*
+ * Copyright 2015 Gauthier Voron
+ * This file is part of rwmsr.
+ *
+ * Rwmsr is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Rwmsr is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with rwmsr. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef EVENT_H
+#define EVENT_H
+
+
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+
+#define EVENT_WATCH_MAX   8
+
+
+/*
+ * Handler called when an auxiliary descriptor is ready.
+ */
+typedef void (*event_handler_t)(int fd, void *data);
+
+/*
+ * Event loop of the engine, waiting on a timerfd for the next deadline, on a
+ * signalfd for the signals of the mask, and on up to EVENT_WATCH_MAX
+ * auxiliary descriptors.
+ */
+struct events
+{
+	int               epfd;
+	int               tfd;
+	int               sfd;
+	sigset_t          mask;
+	size_t            nwatch;
+	int               fds[EVENT_WATCH_MAX];
+	event_handler_t   handlers[EVENT_WATCH_MAX];
+	void             *data[EVENT_WATCH_MAX];
+};
+
+
+/*
+ * Block the signals of the given mask and create the descriptors of the
+ * event loop. The blocked signals are only received through event_wait().
+ * Return 0 in case of success, -1 otherwise.
+ */
+int8_t event_open(struct events *events, const sigset_t *mask);
+
+/*
+ * Watch the given descriptor for input, the handler being called with the
+ * given data from event_wait() each time it is readable.
+ * Return 0 in case of success, -1 otherwise.
+ */
+int8_t event_watch(struct events *events, int fd, event_handler_t handler,
+		   void *data);
+
+/*
+ * Stop watching the given descriptor.
+ */
+void event_unwatch(struct events *events, int fd);
+
+/*
+ * Arm the timer to expire at the given CLOCK_REALTIME time in milliseconds.
+ * A time in the past makes the timer expire immediately.
+ * Return 0 in case of success, -1 otherwise.
+ */
+int8_t event_arm(struct events *events, uint64_t until);
+
+/*
+ * Wait until the timer expires, a signal of the mask is received or an
+ * auxiliary descriptor is ready, calling the handlers of the ready auxiliary
+ * descriptors. The caller loops until the event it waits for happened.
+ * Each received signal sets the bit (1 << signum) in the signals field.
+ * Return 1 if the timer expired or if waiting failed, 0 otherwise.
+ */
+uint8_t event_wait(struct events *events, uint32_t *signals);
+
+/*
+ * Close the descriptors of the event loop.
+ * The signals stay blocked, so a late signal cannot interrupt the end of the
+ * program.
+ */
+void event_close(struct events *events);
+
+
+#endif
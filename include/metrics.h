@@ -0,0 +1,50 @@
+/*
+ * Copyright 2015 Gauthier Voron
+ * This file is part of rwmsr.
+ *
+ * Rwmsr is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Rwmsr is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with rwmsr. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef METRICS_H
+#define METRICS_H
+
+
+#include <stdint.h>
+
+#include "engine.h"
+
+
+/*
+ * Start serving the last values of the printed commands in the OpenMetrics
+ * text format, over HTTP. The address is either the path of a Unix domain
+ * socket to create, or a TCP port to listen on the localhost interface.
+ * Requests are served from a separate thread which never blocks the engine,
+ * and which polls the connections so that a slow client never delays the
+ * others.
+ * Return 0 in case of success, -1 otherwise.
+ */
+int8_t metrics_open(const struct engine *engine, const char *address);
+
+/*
+ * Publish the values of the commands due during the current tick of the
+ * engine, happening at the given time in milliseconds since the start. The
+ * invalid columns are left out of the responses until they are valid again.
+ */
+void metrics_update(const struct engine *engine, uint64_t time);
+
+void metrics_close(void);
+
+
+#endif
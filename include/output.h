@@ -0,0 +1,81 @@
+/*
+ * Copyright 2015 Gauthier Voron
+ * This file is part of rwmsr.
+ *
+ * Rwmsr is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Rwmsr is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with rwmsr. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "engine.h"
+#include "rwmsr.h"
+
+
+/*
+ * Compute the cells of each command from its cores, the socket groups of the
+ * engine cores and the number of columns output by each command.
+ * Return 0 in case of success, -1 otherwise.
+ */
+int8_t setup_columns(struct engine *engine);
+
+void release_columns(struct engine *engine);
+
+/*
+ * Return the core of the given column of the command i, which must not be
+ * reduced.
+ */
+uint8_t column_core(const struct engine *engine, size_t i, size_t column);
+
+/*
+ * Return the socket of the given column of the command i, which must be
+ * reduced by socket.
+ */
+uint32_t column_socket(const struct engine *engine, size_t i, size_t column);
+
+/*
+ * Print the name of the given column of the command i on the given stream,
+ * without the leading ':' characters.
+ */
+void print_column(FILE *stream, const struct engine *engine, size_t i,
+		  size_t column);
+
+/*
+ * Print the name of the columns printed by print_line() on the given stream.
+ */
+void print_header(FILE *stream, const struct engine *engine);
+
+/*
+ * Print a line of values on the given stream for a tick happening at the
+ * specified time, in milliseconds since the engine start.
+ * The due array indicates for each command if it has been executed during
+ * the tick. The stamps array may be NULL if timestamps are disabled.
+ * The valid array indicates for each column whether its value is valid, '-'
+ * being printed in place of the invalid ones, or may be NULL if they all
+ * are. The periods array gives the period of the adaptive commands during
+ * the tick, or may be NULL if unknown.
+ * Nothing is printed if no printed command is due.
+ */
+void print_line(FILE *stream, const struct engine *engine, uint64_t time,
+		const uint8_t *due, const uint64_t *stamps,
+		const msrval_t *values, const uint8_t *valid,
+		const uint32_t *periods);
+
+
+#endif
@@ -40,20 +40,103 @@ const char *parse_cores(uint8_t *dest, size_t len, const char *str);
 
 /*
  * Parse a string indicating a rwmsr command and fill the dest structure with.
- * The string is in the form: "[:]<address>[=<value>][@<delay>[-<repeat>]].
+ * The string is in the form:
+ * "[:]<address>[-<last>[+<stride>]][.const][/<reduce>[.socket]][%<cores>]
+ *  [<write>][@<delay>[-<repeat>[-<max>[~<threshold>]]]]".
+ * where <write> is one of "=<value>", "|=<value>", "&=~<value>" or
+ * "[<hi>:<lo>]=<value>".
  * The leading ":" character indicate to print the value of the register,
  * before the write if any.
+ * The ".const" suffix indicates the register never changes, so it is read
+ * only once. It cannot be used with a write.
+ * The <reduce> operation is one of "sum", "min", "max" or "mean" and
+ * indicates to reduce the values of all the cores, or of each socket with the
+ * ".socket" suffix.
+ * The <cores> set, in the same form than for parse_cores(), indicates the
+ * cores on which to execute the command instead of the global core set.
  * The <address> is the msr hardware address, the <value> is the number to
- * write in the register. Any of those can be in the decimal form, or in the
- * hexadecimal form (when starting with 'x' or '0x').
+ * write in the register. With a <last> address, the command stands for the
+ * range of addresses from <address> to <last> included, every <stride>
+ * addresses (1 by default), and must be expanded with expand_command().
+ * The "|=" and "&=~" writes set and clear the bits of <value>, and the
+ * "[<hi>:<lo>]=" write sets the bits <hi> to <lo> included to <value>, the
+ * other bits of the register being kept.
+ * Any of those can be in the decimal form, or in the hexadecimal form (when
+ * starting with 'x' or '0x').
  * The <delay> is the amount of millisecond to wait before to execute the
  * command and the <repeat> is the amount of millisecond to wait before to
  * repeat the command (until the program is killed).
+ * With a <max> period, the command is adaptive: its period starts at
+ * <repeat> and is doubled up to <max> while its values change by at most
+ * <threshold> between two executions, or halved down to <repeat> otherwise.
+ * The <threshold> defaults to 0.
  * In case of success, return NULL, otherwise, return the address of the first
  * wrong character.
  */
 const char *parse_command(struct command *dest, const char *str);
 
+/*
+ * Write in dest one command for each address of the range of the src command,
+ * or a copy of src if it is not a range.
+ * The commands of a range are adjacent, so their accesses are adjacent in the
+ * batch of each core, but the backends still get one access per address:
+ * there is no range access in the module interface.
+ * If dest is NULL, nothing is written.
+ * Return the number of commands of the range.
+ */
+size_t expand_command(struct command *dest, const struct command *src);
+
+
+/*
+ * Parse a string indicating a trigger and fill the dest structure with.
+ * The string is in the form:
+ * "<address>[&<mask>][.delta|.rate]<op><threshold>,<period>,<duration>"
+ * "[,<ticks>]"
+ * where <op> is one of "<", "<=", "==", "!=", ">=" or ">", and the numbers
+ * are in the same form than in parse_command(). The ".delta" and ".rate"
+ * suffixes select the CONDITION_DELTA and CONDITION_RATE modes. The <ticks>
+ * kept before a burst default to 16.
+ * In case of success, return NULL, otherwise, return the address of the first
+ * wrong character.
+ */
+const char *parse_trigger(struct trigger *dest, const char *str);
+
+/*
+ * Parse a string indicating a control rule and fill the dest structure with.
+ * The string is in the form:
+ * "<address>[&<mask>][.delta|.rate]<op><threshold>[~<release>]"
+ * "?<command>[?<command>]"
+ * where the condition is in the same form than for parse_trigger(), the
+ * <release> threshold defaults to <threshold>, and each <command> is a write
+ * command as accepted by parse_command(), without printing nor delay. The
+ * write of a command can also be "+=<step>" or "-=<step>", alone or after
+ * "[<hi>:<lo>]", to set the COMMAND_STEP and COMMAND_DECREASE flags.
+ * In case of success, return NULL, otherwise, return the address of the first
+ * wrong character.
+ */
+const char *parse_rule(struct rule *dest, const char *str);
+
+
+/*
+ * Write in dest the string form of the given command, as accepted by
+ * parse_command(), truncated to len characters including the terminating
+ * null byte.
+ * Return the length of the whole string form.
+ */
+size_t format_command(char *dest, size_t len, const struct command *command);
+
+
+/*
+ * Parse a file containing one command per line and append the commands to
+ * the dest array of len elements, reallocating it when its size is reached.
+ * Blank lines and anything following a '#' character are ignored. A command
+ * strictly identical to one already in the array is dropped.
+ * In case of success, return NULL. If the file cannot be read, return the
+ * path and set line to 0. Otherwise, set line to the number of the faulty
+ * line and return the address of the first wrong character in a copy of it.
+ */
+const char *parse_commands_file(struct command **dest, size_t *len,
+				size_t *size, const char *path, size_t *line);
 
 
 #endif
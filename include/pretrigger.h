@@ -0,0 +1,53 @@
+/*
+ * Copyright 2015 Gauthier Voron
+ * This file is part of rwmsr.
+ *
+ * Rwmsr is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Rwmsr is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with rwmsr. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PRETRIGGER_H
+#define PRETRIGGER_H
+
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "engine.h"
+
+
+/*
+ * Allocate an in-memory ring keeping the last given number of ticks which
+ * print a command, so the ticks preceding a burst can be printed once the
+ * burst starts.
+ * Return 0 in case of success, -1 otherwise.
+ */
+int8_t pretrigger_open(const struct engine *engine, uint32_t ticks);
+
+/*
+ * Keep the current tick of the engine in the ring, happening at the given
+ * time in milliseconds since the engine start, in place of the oldest one
+ * if the ring is full.
+ */
+void pretrigger_write(const struct engine *engine, uint64_t time);
+
+/*
+ * Print the ticks of the ring on the given stream, from the oldest to the
+ * newest, in the same format than print_line(), then empty the ring.
+ */
+void pretrigger_flush(FILE *stream, const struct engine *engine);
+
+void pretrigger_close(void);
+
+
+#endif
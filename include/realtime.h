@@ -0,0 +1,58 @@
+/*
+ * Copyright 2015 Gauthier Voron
+ * This file is part of rwmsr.
+ *
+ * Rwmsr is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Rwmsr is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with rwmsr. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef REALTIME_H
+#define REALTIME_H
+
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+
+#define REALTIME_DEFAULT_PRIORITY  80
+
+
+/*
+ * Switch the calling thread to the SCHED_FIFO policy with the given priority
+ * and pin it on the given cpu, then lock the process memory and prefault the
+ * stack the engine may use.
+ * Return 0 in case of success, -1 otherwise.
+ */
+int8_t realtime_setup(uint32_t cpu, uint8_t priority);
+
+/*
+ * Touch each page of the given buffer so that it is mapped and locked before
+ * the engine starts.
+ */
+void realtime_prefault(void *buffer, size_t size);
+
+/*
+ * Record the wakeup latency of a wakeup expected at the given CLOCK_REALTIME
+ * time in milliseconds, that is how late the thread is at this time.
+ */
+void realtime_record(uint64_t until);
+
+/*
+ * Print the recorded wakeup latency percentiles on the given stream.
+ */
+void realtime_report(FILE *stream);
+
+
+#endif
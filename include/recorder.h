@@ -0,0 +1,126 @@
+/*
+ * Copyright 2015 Gauthier Voron
+ * This file is part of rwmsr.
+ *
+ * Rwmsr is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Rwmsr is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with rwmsr. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef RECORDER_H
+#define RECORDER_H
+
+
+#include <stdint.h>
+
+#include "engine.h"
+
+
+/*
+ * The flight recorder file starts with a header, followed by a description
+ * of the commands and cores, followed by a ring of fixed size records.
+ * All integers are in the host byte order.
+ *
+ *   header    struct recorder_header
+ *   commands  mlen * struct recorder_command
+ *   cores     rlen * struct recorder_core
+ *   records   capacity * record_size bytes, starting at data_offset
+ *
+ * Each record is laid out as follows:
+ *
+ *   seq       uint64_t, number of the record since the recorder start
+ *   time      uint64_t, milliseconds since the start time
+ *   due       mlen * uint8_t, padded to a multiple of 8 bytes
+ *   stamps    rlen * uint64_t, only if RECORDER_STAMPS is set
+ *   values    one uint64_t per cell, the cells of each command being the
+ *             cores of its bitmap found in the cores array, and the
+ *             columns of reduced commands being stored at the beginning
+ *             of their cells
+ *   valid     one uint8_t per cell, indicating if its value is valid,
+ *             padded to a multiple of 8 bytes
+ *   periods   mlen * uint32_t, the current repeat period of each command,
+ *             padded to a multiple of 8 bytes
+ *
+ * The record number N is stored in the slot N % capacity. The cursor is the
+ * number of records written so far. A record is updated by first setting
+ * its seq field to RECORDER_INVALID, then writing its content, then setting
+ * its seq field and finally incrementing the cursor, so a reader can detect
+ * a record being written when the process crashed.
+ */
+
+#define RECORDER_MAGIC    "RWMSRFR4"
+#define RECORDER_INVALID  (~(0ul))
+#define RECORDER_STAMPS   (1 << 0)
+
+
+struct recorder_header
+{
+	char      magic[8];
+	uint64_t  start;
+	uint64_t  cursor;
+	uint32_t  capacity;
+	uint32_t  record_size;
+	uint32_t  mlen;
+	uint32_t  rlen;
+	uint32_t  flags;
+	uint32_t  data_offset;
+};
+
+struct recorder_command
+{
+	uint64_t  address;
+	uint32_t  flags;
+	uint32_t  reduce;
+	uint64_t  cores[CORES_MAX / 64];
+};
+
+struct recorder_core
+{
+	uint32_t  id;
+	uint32_t  socket;
+};
+
+
+/*
+ * Write the description of the engine commands and cores at the given
+ * address, if not NULL, as found in the flight recorder and trace files.
+ * Return the size of the description in bytes.
+ */
+size_t describe_engine(const struct engine *engine, void *dest);
+
+
+/*
+ * Create the flight recorder file at the given path with enough records to
+ * keep the last given amount of seconds of ticks, considering the repeat
+ * periods of the engine commands.
+ * Return 0 in case of success, -1 otherwise.
+ */
+int8_t recorder_open(const struct engine *engine, const char *path,
+		     uint32_t seconds);
+
+/*
+ * Record the current tick of the engine, happening at the given time in
+ * milliseconds since the engine start.
+ */
+void recorder_write(const struct engine *engine, uint64_t time);
+
+/*
+ * Print on the standard output the ticks recorded during the last seconds
+ * of the window, in the same format than the regular output.
+ */
+void recorder_dump(const struct engine *engine);
+
+void recorder_close(void);
+
+
+#endif
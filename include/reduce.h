@@ -0,0 +1,59 @@
+/*
+ * Copyright 2015 Gauthier Voron
+ * This file is part of rwmsr.
+ *
+ * Rwmsr is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Rwmsr is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with rwmsr. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef REDUCE_H
+#define REDUCE_H
+
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "rwmsr.h"
+
+
+/*
+ * Return the name of the given REDUCE_* operation, as written in commands,
+ * or NULL if there is no such operation.
+ */
+const char *reduce_name(uint8_t op);
+
+/*
+ * Reduce the len values of row with the given REDUCE_* operation and return
+ * the result. The mean is rounded down, and does not overflow even if the
+ * sum of the values does.
+ */
+msrval_t reduce_row(const msrval_t *row, size_t len, uint8_t op);
+
+/*
+ * Reduce the len values of row into ngroups results stored in dest, the
+ * value at index i being reduced in the group groups[i]. The counts array
+ * contains the number of values of each group, and there are at most
+ * CORES_MAX groups.
+ * If valid is not NULL, only the values whose valid entry is set are
+ * reduced and counts is ignored. If present is not NULL, it indicates for
+ * each group whether it contains any reduced value, the result of an empty
+ * group being 0. The present array may be the same than valid.
+ * The dest array must not overlap with row.
+ */
+void reduce_groups(msrval_t *dest, uint8_t *present, const msrval_t *row,
+		   const uint8_t *valid, const size_t *groups,
+		   const size_t *counts, size_t len, size_t ngroups,
+		   uint8_t op);
+
+#endif
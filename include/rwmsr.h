@@ -36,6 +36,12 @@ int8_t destroy(void);
 
 int8_t coreinfo(size_t *numcore, size_t *maxid);
 
+/*
+ * Store in sockets[i] the socket of the core cores[i]. Modules may omit this
+ * function, in which case all the cores are on the socket 0.
+ */
+int8_t socketinfo(uint32_t *sockets, const uint8_t *cores, size_t len);
+
 
 size_t rdmsr_arr(msrval_t *vals, const msradr_t *addrs, const uint8_t *cores,
 		 size_t len);
@@ -47,4 +53,27 @@ size_t rwmsr_arr(const msradr_t *addrs, msrval_t *vals, const uint8_t *cores,
 		 size_t len);
 
 
+/*
+ * Same as rdmsr_arr() and rwmsr_arr() but also set the bit i of the success
+ * bitmap (bit i % 64 of success[i / 64]) if and only if the access i
+ * succeeded. Modules may omit these functions, in which case the failures
+ * are found from rdmsr_arr() and rwmsr_arr().
+ */
+size_t rdmsr_map(msrval_t *vals, const msradr_t *addrs, const uint8_t *cores,
+		 size_t len, uint64_t *success);
+
+size_t rwmsr_map(const msradr_t *addrs, msrval_t *vals, const uint8_t *cores,
+		 size_t len, uint64_t *success);
+
+/*
+ * Same as rwmsr_map() but only replace the bits of each register set in
+ * masks[i] by the same bits of vals[i], the other bits keeping the value
+ * read, as a single read-modify-write access per register. The previous
+ * values are stored in vals. Modules may omit this function, in which case
+ * the registers are read first, then read-written with the merged values.
+ */
+size_t rmwmsr_map(const msradr_t *addrs, msrval_t *vals, const msrval_t *masks,
+		  const uint8_t *cores, size_t len, uint64_t *success);
+
+
 #endif
@@ -0,0 +1,51 @@
+/*
+ * Copyright 2015 Gauthier Voron
+ * This file is part of rwmsr.
+ *
+ * Rwmsr is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Rwmsr is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with rwmsr. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SPARSE_H
+#define SPARSE_H
+
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "engine.h"
+
+
+/*
+ * Allocate the last printed value of each column for a sparse output with a
+ * keyframe every given number of printed ticks.
+ * Return 0 in case of success, -1 otherwise.
+ */
+int8_t sparse_open(const struct engine *engine, uint32_t keyframe);
+
+/*
+ * Print a line for a tick happening at the given time, in milliseconds since
+ * the engine start, with only the columns of the due commands whose value
+ * changed since it was last printed, in the form "<column>=<value>" where
+ * <column> is named as in print_header(), or "<column>=-" when it becomes
+ * invalid. The period of an adaptive command is printed as
+ * "period(<address>)=<period>" when it changes.
+ * A keyframe prints all the columns already known instead. Nothing is
+ * printed if no column changed.
+ */
+void sparse_update(FILE *stream, const struct engine *engine, uint64_t time);
+
+void sparse_close(void);
+
+
+#endif
@@ -0,0 +1,54 @@
+/*
+ * Copyright 2015 Gauthier Voron
+ * This file is part of rwmsr.
+ *
+ * Rwmsr is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Rwmsr is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with rwmsr. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef STAMP_H
+#define STAMP_H
+
+
+#include <stdint.h>
+
+
+#define STAMP_NONE   0
+#define STAMP_TSC    1
+#define STAMP_RAW    2
+
+
+/*
+ * Select the clock used to take sample timestamps and calibrate it.
+ * The STAMP_TSC clock reads the processor timestamp counter which is
+ * calibrated once against CLOCK_MONOTONIC_RAW, the STAMP_RAW clock directly
+ * reads CLOCK_MONOTONIC_RAW.
+ * Return 0 in case of success, -1 if the clock is not available.
+ */
+int8_t stamp_setup(uint8_t source);
+
+/*
+ * Take a timestamp with the selected clock.
+ * The returned value is in clock units and must be converted with
+ * stamp_to_ns() to be meaningful.
+ */
+uint64_t stamp_read(void);
+
+/*
+ * Convert a difference of timestamps into nanoseconds.
+ */
+uint64_t stamp_to_ns(uint64_t delta);
+
+
+#endif
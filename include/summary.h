@@ -0,0 +1,59 @@
+/*
+ * Copyright 2015 Gauthier Voron
+ * This file is part of rwmsr.
+ *
+ * Rwmsr is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Rwmsr is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with rwmsr. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef SUMMARY_H
+#define SUMMARY_H
+
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "engine.h"
+
+
+#define SUMMARY_NONE    0
+#define SUMMARY_VALUE   1
+#define SUMMARY_DELTA   2
+
+
+/*
+ * Allocate the running statistics of each column of the printed commands.
+ * With SUMMARY_DELTA, the statistics are computed on the differences between
+ * two successive values of a column instead of the values themselves.
+ * Return 0 in case of success, -1 otherwise.
+ */
+int8_t summary_open(const struct engine *engine, uint8_t mode);
+
+/*
+ * Update the statistics with the valid values of the commands due during
+ * the current tick of the engine. The differences of SUMMARY_DELTA are taken
+ * from the last valid value of each column.
+ */
+void summary_update(const struct engine *engine);
+
+/*
+ * Print the statistics of each column on the given stream, followed by the
+ * statistics of all the columns of each command merged together.
+ */
+void summary_print(FILE *stream, const struct engine *engine);
+
+void summary_close(void);
+
+
+#endif
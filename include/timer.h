@@ -0,0 +1,115 @@
+/*
+ * Copyright 2015 Gauthier Voron
+ * This file is part of rwmsr.
+ *
+ * Rwmsr is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Rwmsr is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with rwmsr. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef TIMER_H
+#define TIMER_H
+
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "engine.h"
+
+
+/*
+ * A group of commands sharing the same next execution time and repeat period,
+ * hence always due at the same time. The count commands of a group are
+ * linked in increasing order from the head index through the member_next
+ * and member_prev arrays of the timer.
+ */
+struct timer_group
+{
+	uint64_t  next;
+	uint32_t  repeat;
+	uint8_t   periodic;
+	size_t    head;
+	size_t    count;
+};
+
+/*
+ * Schedule of the engine commands.
+ * The heap array is a binary min-heap of the hlen groups still to execute,
+ * ordered by their next execution time. The positions array gives the index
+ * in the heap of each group, or TIMER_NONE if the group is not used, and the
+ * command_groups array the group of each command, or TIMER_NONE if the
+ * command is not scheduled. The free_groups array lists the nfree groups not
+ * used.
+ */
+struct timer
+{
+	struct timer_group  *groups;
+	size_t              *member_next;
+	size_t              *member_prev;
+	size_t              *heap;
+	size_t               hlen;
+	size_t              *positions;
+	size_t              *free_groups;
+	size_t               nfree;
+	size_t              *command_groups;
+};
+
+#define TIMER_NONE  ((size_t) -1)
+
+
+/*
+ * Return the time of the first execution of the given command when its
+ * schedule starts at the given origin time.
+ */
+uint64_t timer_first(const struct command *command, uint64_t origin);
+
+/*
+ * Group the given commands by next execution time and repeat period, the
+ * nexts array giving the next execution time of each command, or ~0 if the
+ * command must not be executed anymore.
+ * Return 0 in case of success, -1 otherwise.
+ */
+int8_t timer_setup(struct timer *timer, const struct command *commands,
+		   const uint64_t *nexts, size_t mlen);
+
+void timer_release(struct timer *timer);
+
+/*
+ * Return the next execution time of the command i, or ~0 if it will not be
+ * executed anymore, in constant time.
+ */
+uint64_t timer_command_next(const struct timer *timer, size_t i);
+
+/*
+ * Schedule the scheduled or not command i alone at the given next time, then
+ * every repeat milliseconds if repeat is not 0, in logarithmic time.
+ */
+void timer_update(struct timer *timer, size_t i, uint64_t next,
+		  uint32_t repeat);
+
+/*
+ * Return the next time a group of commands is due, or ~0 if there is no
+ * command left to execute.
+ */
+uint64_t timer_next(const struct timer *timer);
+
+/*
+ * Store in due the indexes of the commands due at the given time, in
+ * increasing order, and schedule their next execution, if any.
+ * The due array must have room for all the commands.
+ * Return the number of due commands.
+ */
+size_t timer_expire(struct timer *timer, uint64_t now, size_t *due);
+
+
+#endif
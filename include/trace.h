@@ -0,0 +1,130 @@
+/*
+ * Copyright 2015 Gauthier Voron
+ * This file is part of rwmsr.
+ *
+ * Rwmsr is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Rwmsr is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with rwmsr. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef TRACE_H
+#define TRACE_H
+
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "engine.h"
+#include "recorder.h"
+
+
+/*
+ * The trace file starts with a header, followed by a description of the
+ * commands and cores in the same form than the flight recorder, followed by
+ * a sequence of frames, one per tick.
+ * Fixed size integers are in the host byte order.
+ *
+ *   header    struct trace_header
+ *   commands  mlen * struct recorder_command
+ *   cores     rlen * struct recorder_core
+ *   frames    ...
+ *
+ * Each frame starts with a tag byte. A keyframe is preceded by the 8 bytes
+ * of TRACE_KEYFRAME_MARK and the tag TRACE_KEYFRAME, and encodes the values
+ * as they are. A delta frame has the tag TRACE_DELTA or TRACE_DELTA_DUE and
+ * encodes each value as its difference with the previous value of the same
+ * cell. The content of a frame is a sequence of varints (7 bits per byte,
+ * least significant group first, high bit set on all bytes but the last),
+ * differences being zigzag encoded first:
+ *
+ *   time      milliseconds since the start for a keyframe, since the
+ *             previous frame for a delta frame
+ *   due       mlen bits bitmap in (mlen + 7) / 8 raw bytes, only present in
+ *             keyframes and TRACE_DELTA_DUE frames, otherwise the due
+ *             commands are the same than the previous frame
+ *   stamps    rlen varints, only if TRACE_STAMPS is set
+ *   values    one varint per column of each due command
+ *   missing   number of invalid columns as a varint, followed by the index
+ *             of each of them among the columns of the frame, as its
+ *             difference with the previous index (or with 0 for the first)
+ *   periods   one varint per due command with the COMMAND_ADAPTIVE flag,
+ *             its current repeat period
+ *
+ * An invalid column is encoded as a value of 0 in a keyframe and as a
+ * difference of 0 in a delta frame, so it does not change the previous value
+ * of its cell.
+ * A keyframe is emitted every keyframe ticks, and resets the previous value
+ * of the cells of the commands it does not contain to 0, so a reader can
+ * start decoding from any keyframe.
+ */
+
+#define TRACE_MAGIC          "RWMSRTR4"
+#define TRACE_KEYFRAME_MARK  "RWMSRKF"
+#define TRACE_STAMPS         (1 << 0)
+
+#define TRACE_KEYFRAME       'K'
+#define TRACE_DELTA          'D'
+#define TRACE_DELTA_DUE      'd'
+
+#define TRACE_VARINT_MAXLEN  10
+
+
+struct trace_header
+{
+	char      magic[8];
+	uint64_t  start;
+	uint32_t  mlen;
+	uint32_t  rlen;
+	uint32_t  flags;
+	uint32_t  keyframe;
+};
+
+
+/*
+ * Create the trace file at the given path and write its header.
+ * A keyframe is written every keyframe ticks.
+ * Return 0 in case of success, -1 otherwise.
+ */
+int8_t trace_open(const struct engine *engine, const char *path,
+		  uint32_t keyframe);
+
+/*
+ * Write a frame for the current tick of the engine, happening at the given
+ * time in milliseconds since the engine start.
+ */
+void trace_write(const struct engine *engine, uint64_t time);
+
+void trace_close(void);
+
+
+/*
+ * Encode the given value as a varint in buf, which must have room for at
+ * least TRACE_VARINT_MAXLEN bytes.
+ * Return the number of bytes written.
+ */
+size_t put_varint(uint8_t *buf, uint64_t val);
+
+/*
+ * Decode a varint from buf, reading no further than end.
+ * Return the address of the first byte following the varint, or NULL if the
+ * varint is truncated.
+ */
+const uint8_t *get_varint(const uint8_t *buf, const uint8_t *end,
+			  uint64_t *val);
+
+uint64_t zigzag_encode(int64_t val);
+
+int64_t zigzag_decode(uint64_t val);
+
+
+#endif
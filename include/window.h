@@ -0,0 +1,56 @@
+/*
+ * Copyright 2015 Gauthier Voron
+ * This file is part of rwmsr.
+ *
+ * Rwmsr is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Rwmsr is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with rwmsr. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef WINDOW_H
+#define WINDOW_H
+
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "engine.h"
+
+
+/*
+ * Allocate the statistics of each column over an output window of the
+ * given length, in milliseconds. The windows are aligned on the engine
+ * start.
+ * Return 0 in case of success, -1 otherwise.
+ */
+int8_t window_open(const struct engine *engine, uint32_t length);
+
+/*
+ * Print the windows ended before the given time, in milliseconds since the
+ * engine start, then add the values of the commands due during the current
+ * tick to the statistics of the current window.
+ * Each window is printed as a line in the same form than print_line(), each
+ * column being the minimum, maximum, mean and last values of the window
+ * separated by '/', or '-' if the column has no valid value during the
+ * window.
+ */
+void window_update(FILE *stream, const struct engine *engine, uint64_t time);
+
+/*
+ * Print the current window if it contains any value.
+ */
+void window_flush(FILE *stream, const struct engine *engine);
+
+void window_close(void);
+
+
+#endif
@@ -40,6 +40,10 @@
 
 #define TOTAL_MAXLEN    (BASE_LENGTH + CORE_MAXLEN + END_LENGTH)
 
+#define SOCKET_PATH      "/sys/devices/system/cpu/cpu%u/topology/" \
+	                 "physical_package_id"
+#define SOCKET_MAXLEN    96
+
 
 int8_t init(const char *sysname)
 {
@@ -102,6 +106,32 @@ int8_t coreinfo(size_t *numcore, size_t *maxid)
 }
 
 
+int8_t socketinfo(uint32_t *sockets, const uint8_t *cores, size_t len)
+{
+	char path[SOCKET_MAXLEN];
+	unsigned int val;
+	size_t i;
+	FILE *fh;
+
+	for (i=0; i<len; i++) {
+		sprintf(path, SOCKET_PATH, cores[i]);
+
+		fh = fopen(path, "r");
+		if (!fh)
+			return -1;
+		if (fscanf(fh, "%u", &val) != 1) {
+			fclose(fh);
+			return -1;
+		}
+		fclose(fh);
+
+		sockets[i] = val;
+	}
+
+	return 0;
+}
+
+
 static int open_msrfd(msradr_t addr, uint8_t core, int flags)
 {
 	int fd, ret = -1;
@@ -121,28 +151,81 @@ static int open_msrfd(msradr_t addr, uint8_t core, int flags)
 	return ret;
 }
 
+static int8_t read_msr(msrval_t *val, msradr_t addr, uint8_t core)
+{
+	int fd;
+	uint64_t tmp;
+	ssize_t ret;
+
+	fd = open_msrfd(addr, core, O_RDONLY);
+	if (fd < 0)
+		return -1;
+
+	ret = read(fd, &tmp, sizeof (uint64_t));
+	close(fd);
+
+	if (ret != sizeof (uint64_t))
+		return -1;
+	*val = (msrval_t) tmp;
+	return 0;
+}
+
+static int8_t rmw_msr(msrval_t *val, msrval_t mask, msradr_t addr,
+		      uint8_t core)
+{
+	int fd;
+	uint64_t tmp, new;
+	int8_t err = -1;
+
+	fd = open_msrfd(addr, core, O_RDWR);
+	if (fd < 0)
+		return -1;
+
+	if (read(fd, &tmp, sizeof (uint64_t)) != sizeof (uint64_t))
+		goto end;
+	new = (tmp & ~mask) | (*val & mask);
+	if (write(fd, &new, sizeof (uint64_t)) != sizeof (uint64_t))
+		goto end;
+
+	*val = (msrval_t) tmp;
+	err = 0;
+
+ end:
+	close(fd);
+	return err;
+}
+
+static int8_t rw_msr(msrval_t *val, msradr_t addr, uint8_t core)
+{
+	return rmw_msr(val, ~(0ul), addr, core);
+}
+
 size_t rdmsr_arr(msrval_t *vals, const msradr_t *addrs, const uint8_t *cores,
 		 size_t len)
 {
-	int fd;
-	uint64_t val;
 	size_t i, done = 0;
-	ssize_t ret;
+
+	for (i=0; i<len; i++)
+		if (!read_msr(&vals[i], addrs[i], cores[i]))
+			done++;
+
+	return done;
+}
+
+size_t rdmsr_map(msrval_t *vals, const msradr_t *addrs, const uint8_t *cores,
+		 size_t len, uint64_t *success)
+{
+	size_t i, done = 0;
+
+	memset(success, 0, (len + 63) / 64 * sizeof (uint64_t));
 
 	for (i=0; i<len; i++) {
-		fd = open_msrfd(addrs[i], cores[i], O_RDONLY);
-		if (fd < 0)
+		if (read_msr(&vals[i], addrs[i], cores[i]))
 			continue;
-
-		ret = read(fd, &val, sizeof (uint64_t));
-		if (ret == sizeof (uint64_t)) {
-			vals[i] = (msrval_t) val;
-			done++;
-		}
-		
-		close(fd);
+		success[i / 64] |= 1ul << (i % 64);
+		done++;
 	}
-	
+
 	return done;
 }
 	
@@ -171,30 +254,45 @@ size_t wrmsr_arr(const msradr_t *addrs, const msrval_t *vals,
 size_t rwmsr_arr(const msradr_t *addrs, msrval_t *vals, const uint8_t *cores,
 		 size_t len)
 {
-	int fd;
-	uint64_t val;
 	size_t i, done = 0;
-	ssize_t ret;
+
+	for (i=0; i<len; i++)
+		if (!rw_msr(&vals[i], addrs[i], cores[i]))
+			done++;
+
+	return done;
+}
+
+size_t rwmsr_map(const msradr_t *addrs, msrval_t *vals, const uint8_t *cores,
+		 size_t len, uint64_t *success)
+{
+	size_t i, done = 0;
+
+	memset(success, 0, (len + 63) / 64 * sizeof (uint64_t));
 
 	for (i=0; i<len; i++) {
-		fd = open_msrfd(addrs[i], cores[i], O_RDWR);
-		if (fd < 0)
+		if (rw_msr(&vals[i], addrs[i], cores[i]))
 			continue;
-
-		ret = read(fd, &val, sizeof (uint64_t));
-		if (ret != sizeof (uint64_t))
-			goto end;
-		
-		ret = write(fd, (uint64_t *) &vals[i], sizeof (uint64_t));
-		if (ret != sizeof (uint64_t))
-			goto end;
-		
-		vals[i] = (msrval_t) val;
+		success[i / 64] |= 1ul << (i % 64);
 		done++;
+	}
 
-	end:
-		close(fd);
+	return done;
+}
+
+size_t rmwmsr_map(const msradr_t *addrs, msrval_t *vals, const msrval_t *masks,
+		  const uint8_t *cores, size_t len, uint64_t *success)
+{
+	size_t i, done = 0;
+
+	memset(success, 0, (len + 63) / 64 * sizeof (uint64_t));
+
+	for (i=0; i<len; i++) {
+		if (rmw_msr(&vals[i], masks[i], addrs[i], cores[i]))
+			continue;
+		success[i / 64] |= 1ul << (i % 64);
+		done++;
 	}
-	
+
 	return done;
 }
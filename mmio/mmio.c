@@ -0,0 +1,316 @@
+/*
+ * Copyright 2015 Gauthier Voron
+ * This file is part of rwmsr.
+ *
+ * Rwmsr is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Rwmsr is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with rwmsr. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Backend accessing memory-mapped registers instead of MSRs, such as the
+ * uncore counters exposed in a PCI BAR. The system type is in the form
+ * "mmio:<path>[,<offset>[,<size>[,<width>]]]" where <path> is the file to
+ * map (like /dev/mem or a sysfs resourceN file), <offset> the offset of the
+ * register window in the file, <size> the size of the window (the rest of
+ * the file by default) and <width> the size of the registers, either 4 or 8
+ * bytes (8 by default).
+ * The register addresses are byte offsets in the window and the registers
+ * are not per-core, so the module exposes a single core.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "main.h"
+#include "rwmsr.h"
+
+
+#define SYSTEM_PREFIX    "mmio:"
+#define SYSTEM_LENGTH    5
+
+#define DEFAULT_WIDTH    8
+
+
+static void            *map_base = MAP_FAILED;
+static size_t           map_length;
+static volatile uint8_t *window;
+static size_t           window_size;
+static size_t           register_width;
+static uint8_t          writable;
+
+
+/*
+ * Parse the configuration following the "mmio:" prefix of the system type.
+ * Return 0 in case of success, -1 otherwise.
+ */
+static int8_t parse_system(char *path, size_t len, uint64_t *offset,
+			   uint64_t *size, uint64_t *width, const char *str)
+{
+	const char *comma = strchr(str, ',');
+	char *end;
+	size_t plen = comma ? (size_t) (comma - str) : strlen(str);
+
+	if (plen == 0 || plen >= len)
+		return -1;
+	memcpy(path, str, plen);
+	path[plen] = '\0';
+
+	*offset = 0;
+	*size = 0;
+	*width = DEFAULT_WIDTH;
+
+	if (!comma)
+		return 0;
+	*offset = strtoull(comma + 1, &end, 0);
+	if (*end == '\0')
+		return 0;
+	if (*end != ',')
+		return -1;
+
+	*size = strtoull(end + 1, &end, 0);
+	if (*end == '\0')
+		return 0;
+	if (*end != ',')
+		return -1;
+
+	*width = strtoull(end + 1, &end, 0);
+	if (*end != '\0' || (*width != 4 && *width != 8))
+		return -1;
+	return 0;
+}
+
+int8_t init(const char *sysname)
+{
+	char path[4096];
+	uint64_t offset, size, width, delta;
+	long page = sysconf(_SC_PAGESIZE);
+	struct stat st;
+	int fd, prot = PROT_READ | PROT_WRITE;
+
+	if (strncmp(sysname, SYSTEM_PREFIX, SYSTEM_LENGTH))
+		return -1;
+
+	if (parse_system(path, sizeof (path), &offset, &size, &width,
+			 sysname + SYSTEM_LENGTH)) {
+		if (verbose)
+			vlog("invalid mmio system: '%s'", sysname);
+		return -1;
+	}
+
+	fd = open(path, O_RDWR | O_SYNC);
+	if (fd < 0 && errno == EACCES) {
+		prot = PROT_READ;
+		fd = open(path, O_RDONLY | O_SYNC);
+	}
+	if (fd < 0) {
+		if (verbose)
+			vlog("cannot open '%s'", path);
+		return -1;
+	}
+
+	if (size == 0 && !fstat(fd, &st) && (uint64_t) st.st_size > offset)
+		size = st.st_size - offset;
+	if (size == 0) {
+		if (verbose)
+			vlog("unknown register window size for '%s'", path);
+		close(fd);
+		return -1;
+	}
+
+	delta = offset % page;
+	map_length = size + delta;
+	map_base = mmap(NULL, map_length, prot, MAP_SHARED, fd,
+			offset - delta);
+	close(fd);
+
+	if (map_base == MAP_FAILED) {
+		if (verbose)
+			vlog("cannot map '%s'", path);
+		return -1;
+	}
+
+	window = (volatile uint8_t *) map_base + delta;
+	window_size = size;
+	register_width = width;
+	writable = (prot & PROT_WRITE) != 0;
+	return 0;
+}
+
+int8_t destroy(void)
+{
+	if (map_base != MAP_FAILED)
+		munmap(map_base, map_length);
+	map_base = MAP_FAILED;
+	return 0;
+}
+
+
+int8_t coreinfo(size_t *numcore, size_t *maxid)
+{
+	if (numcore)
+		*numcore = 1;
+	if (maxid)
+		*maxid = 0;
+	return 0;
+}
+
+int8_t socketinfo(uint32_t *sockets, const uint8_t *cores
+		  __attribute__((unused)), size_t len)
+{
+	memset(sockets, 0, len * sizeof (uint32_t));
+	return 0;
+}
+
+
+/*
+ * Indicate if a register can be accessed at the given address on the given
+ * core.
+ */
+static uint8_t check_register(msradr_t addr, uint8_t core)
+{
+	return core == 0 && addr % register_width == 0
+		&& window_size >= register_width
+		&& addr <= window_size - register_width;
+}
+
+static msrval_t load_register(msradr_t addr)
+{
+	if (register_width == 4)
+		return *(volatile uint32_t *) (window + addr);
+	return *(volatile uint64_t *) (window + addr);
+}
+
+static void store_register(msradr_t addr, msrval_t val)
+{
+	if (register_width == 4)
+		*(volatile uint32_t *) (window + addr) = (uint32_t) val;
+	else
+		*(volatile uint64_t *) (window + addr) = val;
+}
+
+size_t rdmsr_map(msrval_t *vals, const msradr_t *addrs, const uint8_t *cores,
+		 size_t len, uint64_t *success)
+{
+	size_t i, done = 0;
+
+	memset(success, 0, (len + 63) / 64 * sizeof (uint64_t));
+
+	for (i=0; i<len; i++) {
+		if (!check_register(addrs[i], cores[i]))
+			continue;
+		vals[i] = load_register(addrs[i]);
+		success[i / 64] |= 1ul << (i % 64);
+		done++;
+	}
+
+	return done;
+}
+
+size_t rwmsr_map(const msradr_t *addrs, msrval_t *vals, const uint8_t *cores,
+		 size_t len, uint64_t *success)
+{
+	size_t i, done = 0;
+	msrval_t old;
+
+	memset(success, 0, (len + 63) / 64 * sizeof (uint64_t));
+
+	for (i=0; i<len; i++) {
+		if (!writable || !check_register(addrs[i], cores[i]))
+			continue;
+		old = load_register(addrs[i]);
+		store_register(addrs[i], vals[i]);
+		vals[i] = old;
+		success[i / 64] |= 1ul << (i % 64);
+		done++;
+	}
+
+	return done;
+}
+
+size_t rmwmsr_map(const msradr_t *addrs, msrval_t *vals, const msrval_t *masks,
+		  const uint8_t *cores, size_t len, uint64_t *success)
+{
+	size_t i, done = 0;
+	msrval_t old;
+
+	memset(success, 0, (len + 63) / 64 * sizeof (uint64_t));
+
+	for (i=0; i<len; i++) {
+		if (!writable || !check_register(addrs[i], cores[i]))
+			continue;
+		old = load_register(addrs[i]);
+		store_register(addrs[i], (old & ~masks[i])
+			       | (vals[i] & masks[i]));
+		vals[i] = old;
+		success[i / 64] |= 1ul << (i % 64);
+		done++;
+	}
+
+	return done;
+}
+
+size_t rdmsr_arr(msrval_t *vals, const msradr_t *addrs, const uint8_t *cores,
+		 size_t len)
+{
+	size_t i, done = 0;
+
+	for (i=0; i<len; i++) {
+		if (!check_register(addrs[i], cores[i]))
+			continue;
+		vals[i] = load_register(addrs[i]);
+		done++;
+	}
+
+	return done;
+}
+
+size_t wrmsr_arr(const msradr_t *addrs, const msrval_t *vals,
+		 const uint8_t *cores, size_t len)
+{
+	size_t i, done = 0;
+
+	for (i=0; i<len; i++) {
+		if (!writable || !check_register(addrs[i], cores[i]))
+			continue;
+		store_register(addrs[i], vals[i]);
+		done++;
+	}
+
+	return done;
+}
+
+size_t rwmsr_arr(const msradr_t *addrs, msrval_t *vals, const uint8_t *cores,
+		 size_t len)
+{
+	size_t i, done = 0;
+	msrval_t old;
+
+	for (i=0; i<len; i++) {
+		if (!writable || !check_register(addrs[i], cores[i]))
+			continue;
+		old = load_register(addrs[i]);
+		store_register(addrs[i], vals[i]);
+		vals[i] = old;
+		done++;
+	}
+
+	return done;
+}
@@ -0,0 +1,353 @@
+/*
+ * Copyright 2015 Gauthier Voron
+ * This file is part of rwmsr.
+ *
+ * Rwmsr is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Rwmsr is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with rwmsr. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Backend serving back the accesses recorded in a capture file, so the
+ * engine can run on real data without the original host. The system type is
+ * in the form "replay:<path>[,fast]" where <path> is the capture file.
+ * The values read on each register of each core are served in the order they
+ * were recorded, the accesses failing once the recorded ones are exhausted.
+ * By default, each value is served no sooner than at the time it was
+ * recorded, relative to the first access. With ",fast", the values are served
+ * as fast as possible. The writes always succeed and are ignored.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "capture.h"
+#include "main.h"
+#include "rwmsr.h"
+
+
+#define SYSTEM_PREFIX    "replay:"
+#define SYSTEM_LENGTH    7
+
+
+/*
+ * The recorded reads of a register of a core, in the order they were
+ * recorded, the next one to serve being at cursor.
+ */
+struct replay_register
+{
+	msradr_t  address;
+	uint8_t   core;
+	size_t    first;
+	size_t    count;
+	size_t    cursor;
+};
+
+
+static struct capture_header    header;
+static uint32_t                *sockets = NULL;
+static struct capture_record   *records = NULL;
+static size_t                   nrecords;
+static size_t                  *order = NULL;
+static struct replay_register  *registers = NULL;
+static size_t                   nregisters;
+static uint8_t                  fast;
+static uint64_t                 start;
+static uint8_t                  started;
+
+
+static int compare_records(const void *a, const void *b)
+{
+	const struct capture_record *ra = &records[*(const size_t *) a];
+	const struct capture_record *rb = &records[*(const size_t *) b];
+
+	if (ra->address != rb->address)
+		return ra->address < rb->address ? -1 : 1;
+	if (ra->core != rb->core)
+		return ra->core < rb->core ? -1 : 1;
+	if (*(const size_t *) a != *(const size_t *) b)
+		return *(const size_t *) a < *(const size_t *) b ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Load the capture file and index its reads by register.
+ * Return 0 in case of success, -1 otherwise.
+ */
+static int8_t load_capture(const char *path)
+{
+	struct capture_record *tmp;
+	size_t i, size = 0, n = 0;
+	FILE *fh;
+
+	fh = fopen(path, "r");
+	if (!fh)
+		return -1;
+
+	if (fread(&header, sizeof (header), 1, fh) != 1
+	    || memcmp(header.magic, CAPTURE_MAGIC, sizeof (header.magic))
+	    || header.maxid >= 256)
+		goto err;
+
+	sockets = malloc((header.maxid + 1) * sizeof (uint32_t));
+	if (!sockets || fread(sockets, sizeof (uint32_t), header.maxid + 1, fh)
+	    != header.maxid + 1)
+		goto err;
+
+	nrecords = 0;
+	while (1) {
+		if (nrecords == size) {
+			size = size ? size * 2 : 4096;
+			tmp = realloc(records, size * sizeof (*records));
+			if (!tmp)
+				goto err;
+			records = tmp;
+		}
+		if (fread(&records[nrecords], sizeof (*records), 1, fh) != 1)
+			break;
+		if (records[nrecords].type != CAPTURE_WRITE)
+			nrecords++;
+	}
+	fclose(fh);
+
+	order = malloc((nrecords + 1) * sizeof (size_t));
+	registers = malloc((nrecords + 1) * sizeof (*registers));
+	if (!order || !registers)
+		return -1;
+
+	for (i=0; i<nrecords; i++)
+		order[i] = i;
+	qsort(order, nrecords, sizeof (size_t), compare_records);
+
+	for (i=0; i<nrecords; i++) {
+		tmp = &records[order[i]];
+		if (n > 0 && registers[n - 1].address == tmp->address
+		    && registers[n - 1].core == tmp->core) {
+			registers[n - 1].count++;
+			continue;
+		}
+		registers[n].address = tmp->address;
+		registers[n].core = tmp->core;
+		registers[n].first = i;
+		registers[n].count = 1;
+		registers[n].cursor = 0;
+		n++;
+	}
+	nregisters = n;
+
+	return 0;
+ err:
+	fclose(fh);
+	return -1;
+}
+
+int8_t init(const char *sysname)
+{
+	char path[4096];
+	const char *comma;
+	size_t plen;
+
+	if (strncmp(sysname, SYSTEM_PREFIX, SYSTEM_LENGTH))
+		return -1;
+	sysname += SYSTEM_LENGTH;
+
+	comma = strchr(sysname, ',');
+	plen = comma ? (size_t) (comma - sysname) : strlen(sysname);
+	fast = 0;
+	if (comma && !strcmp(comma, ",fast"))
+		fast = 1;
+	else if (comma)
+		plen = 0;
+
+	if (plen == 0 || plen >= sizeof (path)) {
+		if (verbose)
+			vlog("invalid replay system: '%s'", sysname);
+		return -1;
+	}
+	memcpy(path, sysname, plen);
+	path[plen] = '\0';
+
+	if (load_capture(path)) {
+		if (verbose)
+			vlog("cannot load capture: '%s'", path);
+		destroy();
+		return -1;
+	}
+
+	started = 0;
+	return 0;
+}
+
+int8_t destroy(void)
+{
+	free(sockets);
+	free(records);
+	free(order);
+	free(registers);
+	sockets = NULL;
+	records = NULL;
+	order = NULL;
+	registers = NULL;
+	return 0;
+}
+
+
+int8_t coreinfo(size_t *numcore, size_t *maxid)
+{
+	if (numcore)
+		*numcore = header.numcore;
+	if (maxid)
+		*maxid = header.maxid;
+	return 0;
+}
+
+int8_t socketinfo(uint32_t *dest, const uint8_t *cores, size_t len)
+{
+	size_t i;
+
+	if (!(header.flags & CAPTURE_SOCKETS))
+		return -1;
+
+	for (i=0; i<len; i++) {
+		if (cores[i] > header.maxid)
+			return -1;
+		dest[i] = sockets[cores[i]];
+	}
+
+	return 0;
+}
+
+
+static uint64_t now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ul + ts.tv_nsec;
+}
+
+/*
+ * Wait until the time the given record was captured, relative to the first
+ * access served.
+ */
+static void wait_record(const struct capture_record *record)
+{
+	struct timespec ts;
+	uint64_t until;
+
+	if (fast)
+		return;
+
+	if (!started) {
+		start = now() - record->time;
+		started = 1;
+	}
+
+	until = start + record->time;
+	ts.tv_sec = until / 1000000000ul;
+	ts.tv_nsec = until % 1000000000ul;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL))
+		;
+}
+
+/*
+ * Serve the next recorded read of the given register.
+ * Return 0 in case of success, -1 if the read fails.
+ */
+static int8_t serve_read(msrval_t *val, msradr_t addr, uint8_t core)
+{
+	size_t lo = 0, hi = nregisters, mid;
+	struct replay_register *reg;
+	const struct capture_record *record;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		reg = &registers[mid];
+		if (reg->address < addr
+		    || (reg->address == addr && reg->core < core))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (lo == nregisters)
+		return -1;
+	reg = &registers[lo];
+	if (reg->address != addr || reg->core != core
+	    || reg->cursor == reg->count)
+		return -1;
+
+	record = &records[order[reg->first + reg->cursor++]];
+	wait_record(record);
+	if (!record->success)
+		return -1;
+
+	*val = record->value;
+	return 0;
+}
+
+size_t rdmsr_map(msrval_t *vals, const msradr_t *addrs, const uint8_t *cores,
+		 size_t len, uint64_t *success)
+{
+	size_t i, done = 0;
+
+	memset(success, 0, (len + 63) / 64 * sizeof (uint64_t));
+
+	for (i=0; i<len; i++) {
+		if (serve_read(&vals[i], addrs[i], cores[i]))
+			continue;
+		success[i / 64] |= 1ul << (i % 64);
+		done++;
+	}
+
+	return done;
+}
+
+size_t rwmsr_map(const msradr_t *addrs, msrval_t *vals, const uint8_t *cores,
+		 size_t len, uint64_t *success)
+{
+	return rdmsr_map(vals, addrs, cores, len, success);
+}
+
+size_t rmwmsr_map(const msradr_t *addrs, msrval_t *vals,
+		  const msrval_t *masks __attribute__((unused)),
+		  const uint8_t *cores, size_t len, uint64_t *success)
+{
+	return rdmsr_map(vals, addrs, cores, len, success);
+}
+
+size_t rdmsr_arr(msrval_t *vals, const msradr_t *addrs, const uint8_t *cores,
+		 size_t len)
+{
+	size_t i, done = 0;
+
+	for (i=0; i<len; i++)
+		if (!serve_read(&vals[i], addrs[i], cores[i]))
+			done++;
+
+	return done;
+}
+
+size_t wrmsr_arr(const msradr_t *addrs __attribute__((unused)),
+		 const msrval_t *vals __attribute__((unused)),
+		 const uint8_t *cores __attribute__((unused)), size_t len)
+{
+	return len;
+}
+
+size_t rwmsr_arr(const msradr_t *addrs, msrval_t *vals, const uint8_t *cores,
+		 size_t len)
+{
+	return rdmsr_arr(vals, addrs, cores, len);
+}
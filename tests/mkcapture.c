@@ -0,0 +1,128 @@
+/*
+ * Copyright 2015 Gauthier Voron
+ * This file is part of rwmsr.
+ *
+ * Rwmsr is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Rwmsr is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with rwmsr. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Write the synthetic capture file served by the replay module to the
+ * regression checks. It holds TICKS reads of each register below on each of
+ * the CORES cores, the cores 0 and 1 being on the socket 0 and the cores 2
+ * and 3 on the socket 1:
+ *
+ *   0x10         1000 * tick + core, a counter
+ *   0x20         tick + 10 * core, always failing on the core 3
+ *   0x30         0x1234 + core, a constant
+ *   0x40         0xff
+ *   0xc1-0xc4    (address << 8) + tick
+ *   0x611        a counter increasing by 100 per tick, except by 5000 from
+ *                the tick 21 to the tick 40
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "capture.h"
+
+
+#define CORES  4
+#define TICKS  64
+
+
+static FILE *fh;
+
+
+static void record(uint64_t tick, msradr_t address, uint8_t core,
+		   msrval_t value, uint8_t success)
+{
+	struct capture_record rec;
+
+	memset(&rec, 0, sizeof (rec));
+	rec.time = tick * 10000000ul;
+	rec.address = address;
+	rec.value = value;
+	rec.core = core;
+	rec.type = CAPTURE_READ;
+	rec.success = success;
+
+	if (fwrite(&rec, sizeof (rec), 1, fh) != 1) {
+		perror("mkcapture");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static msrval_t energy(uint64_t tick)
+{
+	if (tick <= 20)
+		return tick * 100;
+	if (tick <= 40)
+		return 2000 + (tick - 20) * 5000;
+	return 102000 + (tick - 40) * 100;
+}
+
+int main(int argc, char *const *argv)
+{
+	struct capture_header header;
+	uint32_t sockets[CORES];
+	msradr_t address;
+	uint64_t tick;
+	uint8_t core;
+
+	if (argc != 2) {
+		fprintf(stderr, "usage: mkcapture <file>\n");
+		return EXIT_FAILURE;
+	}
+
+	fh = fopen(argv[1], "w");
+	if (!fh) {
+		perror(argv[1]);
+		return EXIT_FAILURE;
+	}
+
+	memset(&header, 0, sizeof (header));
+	memcpy(header.magic, CAPTURE_MAGIC, sizeof (header.magic));
+	header.numcore = CORES;
+	header.maxid = CORES - 1;
+	header.flags = CAPTURE_SOCKETS;
+	for (core=0; core<CORES; core++)
+		sockets[core] = core / 2;
+
+	if (fwrite(&header, sizeof (header), 1, fh) != 1
+	    || fwrite(sockets, sizeof (sockets), 1, fh) != 1) {
+		perror(argv[1]);
+		return EXIT_FAILURE;
+	}
+
+	for (tick=0; tick<TICKS; tick++) {
+		for (core=0; core<CORES; core++) {
+			record(tick, 0x10, core, 1000 * tick + core, 1);
+			record(tick, 0x20, core, tick + 10 * core, core != 3);
+			record(tick, 0x30, core, 0x1234 + core, 1);
+			record(tick, 0x40, core, 0xff, 1);
+			for (address=0xc1; address<=0xc4; address++)
+				record(tick, address, core,
+				       (address << 8) + tick, 1);
+			record(tick, 0x611, core, energy(tick), 1);
+		}
+	}
+
+	if (fclose(fh)) {
+		perror(argv[1]);
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
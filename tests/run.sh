@@ -0,0 +1,115 @@
+#!/bin/sh
+#
+# Regression checks of the parser and of the outputs, running rwmsr on the
+# replay module over the synthetic capture written by mkcapture, and
+# comparing what it prints, without the times, with the files in expected/.
+# Run from the top directory with "make check", or with "-u" to rewrite the
+# expected files from the current output.
+
+BIN=${BIN:-bin/}
+LIB=${LIB:-lib/}
+OBJ=${OBJ:-obj/}
+TESTS=${0%/*}
+
+update=0
+[ "x$1" = "x-u" ] && update=1
+
+tmp=`mktemp -d` || exit 1
+trap 'rm -rf "$tmp"' EXIT
+
+"${OBJ}mkcapture" "$tmp/capture" || exit 1
+replay="replay:$tmp/capture,fast"
+
+failed=0
+count=0
+
+# Strip the time of the tick lines, which depends on the scheduling.
+strip_times() {
+    sed 's/^[0-9][0-9]*\.[0-9][0-9]* //'
+}
+
+# Compare the file $2 with the expected output of the check $1.
+compare() {
+    count=$((count + 1))
+    if [ $update -eq 1 ] ; then
+	cp "$2" "$TESTS/expected/$1.out"
+	return
+    fi
+
+    if ! diff -u "$TESTS/expected/$1.out" "$2" > "$tmp/diff" ; then
+	echo "FAIL: $1"
+	cat "$tmp/diff"
+	failed=$((failed + 1))
+    fi
+}
+
+# Run rwmsr on the capture during $2 seconds with the remaining arguments,
+# and store the first $3 lines of its output, along with its errors, in the
+# file $1.
+run() {
+    file=$1
+    seconds=$2
+    lines=$3
+    shift 3
+    timeout -s INT "$seconds" "${BIN}rwmsr" -s "$replay" -p "$LIB" "$@" \
+	2>&1 | head -n "$lines" | strip_times > "$file"
+}
+
+# Same as run() for the check $1, then compare its output.
+check() {
+    name=$1
+    shift
+    run "$tmp/$name.out" "$@"
+    compare "$name" "$tmp/$name.out"
+}
+
+
+check plain 3 8 -c 0-3 ':0x10@0-10' '::0x30.const@0-10'
+
+check range 3 6 -c 0,2 '::0xc1-0xc4+2@0-10' ':0xc3%1'
+
+check reduce 3 6 -c 0-3 ':0x10/sum@0-10' ':0x10/max.socket@0-10' \
+    ':0x10/mean.socket@0-10'
+
+check invalid 3 6 -c 0-3 ':0x20@0-10' ':0x20/sum@0-10' \
+    ':0x20/min.socket@0-10'
+
+check masked 3 4 -c 0 '::0x40[7:4]=3' '::0x40|=0x8000000000000000' \
+    '::0x40&=~0xf'
+
+check sparse 3 30 -c 0-3 -d 4 ':0x10@0-10' ':0x30@0-10' ':0x20@0-10'
+
+check rule 3 70 -c 0 -L '0x611.delta>1000~500?0x620[3:0]-=1?0x620[3:0]+=1' \
+    ':0x611@0-10'
+
+# Only the burst markers, the number of ticks of a burst depending on the
+# scheduling.
+run "$tmp/burst" 2 200 -c 0 -T '0x611.delta>1000,5,20,0' ':0x611@0-10'
+grep '^#' "$tmp/burst" > "$tmp/trigger.out"
+compare trigger "$tmp/trigger.out"
+
+check summary 2 40 -c 0-3 -S ':0x10@0-10' ':0x20@0-10' ':0x611@0-10'
+
+check trace-run 2 10 -c 0-3 -o "$tmp/trace,4" ':0x10@0-10' \
+    ':0x20/sum.socket@0-10'
+"${BIN}rwmsr-decode" "$tmp/trace" 2>&1 | head -n 21 | strip_times \
+    > "$tmp/trace.out"
+compare trace "$tmp/trace.out"
+
+for command in ':0x10=-1' ':0x10=0x10000000000000000' ':0x10[64:0]=1' \
+	       ':0x10[3:0]=16' ':0x10-=1' ':0x20-0x10' ':0x10-0x2000' \
+	       ':0x10.const=1' ':0x10/avg' ':0x10@0-10-5' ; do
+    "${BIN}rwmsr" -s "$replay" -p "$LIB" -c 0 "$command" 2>&1 \
+	| sed 's/^[^:]*: //' | head -n 1
+done > "$tmp/errors.out"
+compare errors "$tmp/errors.out"
+
+
+if [ $update -eq 1 ] ; then
+    echo "updated $count expected outputs"
+elif [ $failed -ne 0 ] ; then
+    echo "$failed of $count checks failed"
+    exit 1
+else
+    echo "all $count checks passed"
+fi
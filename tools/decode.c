@@ -0,0 +1,473 @@
+/*
+ * Copyright 2015 Gauthier Voron
+ * This file is part of rwmsr.
+ *
+ * Rwmsr is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Rwmsr is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with rwmsr. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "engine.h"
+#include "output.h"
+#include "recorder.h"
+#include "trace.h"
+
+
+static const char     *options_string = "hVf:";
+static struct option   options[] = {
+	{"help",    no_argument,       0, 'h'},
+	{"version", no_argument,       0, 'V'},
+	{"from",    required_argument, 0, 'f'},
+	{ NULL,     0,                 0,  0 }
+};
+
+static const char     *program;
+
+static uint64_t        from = 0;
+
+
+static void usage(void)
+{
+	printf("Usage: rwmsr-decode [-h | --help] [-V | --version]\n"
+	       "       rwmsr-decode [-f <time>] <file>\n"
+	       "Decode a rwmsr binary trace or flight recorder file.\n"
+	       "The content of the file is printed on the standard output in "
+	       "the same format\n"
+	       "than the regular rwmsr output.\n"
+	       "\n"
+	       "The '-f' (or '--from') option indicates a time in "
+	       "milliseconds since the start\n"
+	       "of the recording. The ticks before this time are not printed "
+	       "and the decoding\n"
+	       "of a trace file starts from the last keyframe before this "
+	       "time.\n");
+}
+
+static void version(void)
+{
+	printf("rwmsr-decode 1.0.0\nGauthier Voron\n"
+	       "gauthier.voron@lip6.fr\n");
+}
+
+static void error(const char *format, ...)
+{
+	va_list ap;
+
+	fprintf(stderr, "%s: ", program);
+	va_start(ap, format);
+	vfprintf(stderr, format, ap);
+	va_end(ap);
+	fprintf(stderr, "\n");
+	exit(EXIT_FAILURE);
+}
+
+
+/*
+ * Fill the engine structure with the description of the commands and cores
+ * found at the given address of the file.
+ * Return the address of the first byte following the description.
+ */
+static const uint8_t *load_description(struct engine *engine,
+				       const uint8_t *ptr, const uint8_t *end,
+				       size_t mlen, size_t rlen)
+{
+	const struct recorder_command *rcommands;
+	const struct recorder_core *rcores;
+	struct command *commands;
+	uint32_t *sockets;
+	uint8_t *cores;
+	size_t i;
+
+	if ((size_t) (end - ptr) < mlen * sizeof (*rcommands)
+	    + rlen * sizeof (*rcores))
+		error("truncated file description");
+
+	rcommands = (const struct recorder_command *) ptr;
+	rcores = (const struct recorder_core *) (rcommands + mlen);
+
+	commands = calloc(mlen, sizeof (*commands));
+	cores = calloc(rlen, sizeof (*cores));
+	sockets = calloc(rlen, sizeof (*sockets));
+	if (!commands || !cores || !sockets)
+		error("cannot allocate file description");
+
+	for (i=0; i<mlen; i++) {
+		commands[i].address = rcommands[i].address;
+		commands[i].flags = rcommands[i].flags;
+		commands[i].reduce = rcommands[i].reduce;
+		memcpy(commands[i].cores, rcommands[i].cores,
+		       sizeof (commands[i].cores));
+	}
+	for (i=0; i<rlen; i++) {
+		cores[i] = rcores[i].id;
+		sockets[i] = rcores[i].socket;
+	}
+
+	memset(engine, 0, sizeof (*engine));
+	engine->commands = commands;
+	engine->mlen = mlen;
+	engine->cores = cores;
+	engine->sockets = sockets;
+	engine->rlen = rlen;
+
+	if (setup_columns(engine))
+		error("cannot allocate file description");
+
+	return (const uint8_t *) (rcores + rlen);
+}
+
+
+static void decode_recorder(const uint8_t *data, size_t size)
+{
+	const struct recorder_header *header =
+		(const struct recorder_header *) data;
+	const uint8_t *slot, *due, *valid;
+	const uint64_t *stamps, *record;
+	const uint32_t *periods;
+	uint64_t seq, first;
+	struct engine engine;
+
+	if (size < sizeof (*header))
+		error("truncated flight recorder header");
+
+	load_description(&engine, (const uint8_t *) (header + 1), data + size,
+			 header->mlen, header->rlen);
+	if (header->flags & RECORDER_STAMPS)
+		engine.stamps = calloc(engine.rlen, sizeof (uint64_t));
+
+	if (header->data_offset + (uint64_t) header->capacity
+	    * header->record_size > size)
+		error("truncated flight recorder ring");
+
+	first = 0;
+	if (header->cursor > header->capacity)
+		first = header->cursor - header->capacity;
+
+	print_header(stdout, &engine);
+
+	for (seq=first; seq<header->cursor; seq++) {
+		slot = data + header->data_offset
+			+ (seq % header->capacity) * header->record_size;
+		record = (const uint64_t *) slot;
+		if (record[0] != seq || record[1] < from)
+			continue;
+
+		due = slot + 2 * sizeof (uint64_t);
+		slot = due + ((engine.mlen + 7) & ~7ul);
+		stamps = NULL;
+		if (engine.stamps) {
+			stamps = (const uint64_t *) slot;
+			slot += engine.rlen * sizeof (uint64_t);
+		}
+
+		valid = slot + engine.offsets[engine.mlen] * sizeof (msrval_t);
+		periods = (const uint32_t *)
+			(valid + ((engine.offsets[engine.mlen] + 7) & ~7ul));
+
+		print_line(stdout, &engine, record[1], due, stamps,
+			   (const msrval_t *) slot, valid, periods);
+	}
+
+	free(engine.stamps);
+}
+
+
+/*
+ * Decode the body of a frame with the given tag, from the byte following the
+ * tag, and update the time, the due bitmap, the stamps, the values, their
+ * validity and the periods of the adaptive commands with.
+ * Return the address of the first byte following the frame, or NULL if the
+ * frame is truncated or invalid.
+ */
+static const uint8_t *decode_frame(const struct engine *engine,
+				   const uint8_t *ptr, const uint8_t *end,
+				   uint8_t tag, uint64_t *time, uint8_t *due,
+				   uint64_t *stamps, msrval_t *values,
+				   uint8_t *valid, uint32_t *periods)
+{
+	size_t i, j, k, mlen = engine->mlen, dlen = (mlen + 7) / 8;
+	uint64_t val, count, column, index = 0;
+
+	if (!(ptr = get_varint(ptr, end, &val)))
+		return NULL;
+	*time = (tag == TRACE_KEYFRAME) ? val : *time + val;
+
+	if (tag != TRACE_DELTA) {
+		if ((size_t) (end - ptr) < dlen)
+			return NULL;
+		for (i=0; i<mlen; i++)
+			due[i] = (ptr[i / 8] >> (i % 8)) & 1;
+		ptr += dlen;
+	}
+
+	if (tag == TRACE_KEYFRAME)
+		memset(values, 0, engine->offsets[mlen] * sizeof (msrval_t));
+
+	for (j=0; stamps && j<engine->rlen; j++) {
+		if (!(ptr = get_varint(ptr, end, &val)))
+			return NULL;
+		if (tag == TRACE_KEYFRAME)
+			stamps[j] = val;
+		else
+			stamps[j] += zigzag_decode(val);
+	}
+
+	for (i=0; i<mlen; i++) {
+		if (!due[i])
+			continue;
+		for (j=0; j<engine->columns[i]; j++) {
+			if (!(ptr = get_varint(ptr, end, &val)))
+				return NULL;
+			if (tag == TRACE_KEYFRAME)
+				values[engine->offsets[i] + j] = val;
+			else
+				values[engine->offsets[i] + j] +=
+					zigzag_decode(val);
+			valid[engine->offsets[i] + j] = 1;
+		}
+	}
+
+	if (!(ptr = get_varint(ptr, end, &count)))
+		return NULL;
+
+	for (i=0, k=0, column=0; k<count; k++) {
+		if (!(ptr = get_varint(ptr, end, &val)))
+			return NULL;
+		index += val;
+
+		while (i < mlen && (!due[i]
+				    || column + engine->columns[i] <= index)) {
+			if (due[i])
+				column += engine->columns[i];
+			i++;
+		}
+		if (i == mlen)
+			return NULL;
+
+		valid[engine->offsets[i] + index - column] = 0;
+	}
+
+	for (i=0; i<mlen; i++) {
+		if (!due[i] || !(engine->commands[i].flags & COMMAND_ADAPTIVE))
+			continue;
+		if (!(ptr = get_varint(ptr, end, &val)))
+			return NULL;
+		periods[i] = val;
+	}
+
+	return ptr;
+}
+
+/*
+ * Indicate if the frame ending at ptr is followed by a frame boundary: the
+ * end of the trace, a keyframe mark or a delta frame tag.
+ */
+static uint8_t frame_boundary(const uint8_t *ptr, const uint8_t *end)
+{
+	size_t mlen = sizeof (TRACE_KEYFRAME_MARK);
+
+	if (ptr == end)
+		return 1;
+	if (*ptr == TRACE_DELTA || *ptr == TRACE_DELTA_DUE)
+		return 1;
+	return (size_t) (end - ptr) >= mlen
+		&& !memcmp(ptr, TRACE_KEYFRAME_MARK, mlen);
+}
+
+/*
+ * Find the last keyframe whose time is lower or equal to the from time.
+ * Since the keyframe mark can also appear inside the varints of a frame, a
+ * mark is only accepted if it is followed by a keyframe which decodes up to
+ * a frame boundary, with padding bits of its due bitmap cleared and a time
+ * not lower than the previous keyframe.
+ * Return its address, or the address of the first frame if there is none.
+ */
+static const uint8_t *seek_keyframe(const struct engine *engine,
+				    const uint8_t *ptr, const uint8_t *end,
+				    uint8_t *due, uint64_t *stamps,
+				    msrval_t *values, uint8_t *valid,
+				    uint32_t *periods)
+{
+	const uint8_t *found = ptr, *cur = ptr, *next;
+	size_t mlen = sizeof (TRACE_KEYFRAME_MARK);
+	size_t dbits = engine->mlen % 8, dlen = (engine->mlen + 7) / 8;
+	uint64_t time, last = 0;
+
+	while ((cur = memmem(cur, end - cur, TRACE_KEYFRAME_MARK, mlen))) {
+		next = cur + mlen;
+		if (next >= end || *next != TRACE_KEYFRAME) {
+			cur++;
+			continue;
+		}
+
+		next = get_varint(next + 1, end, &time);
+		if (next && dbits && (size_t) (end - next) >= dlen
+		    && (next[dlen - 1] >> dbits))
+			next = NULL;
+		if (next)
+			next = decode_frame(engine, cur + mlen + 1, end,
+					    TRACE_KEYFRAME, &time, due,
+					    stamps, values, valid, periods);
+		if (!next || !frame_boundary(next, end) || time < last) {
+			cur++;
+			continue;
+		}
+
+		if (time > from)
+			break;
+		found = cur;
+		last = time;
+		cur = next;
+	}
+
+	return found;
+}
+
+static void decode_trace(const uint8_t *data, size_t size)
+{
+	const struct trace_header *header = (const struct trace_header *) data;
+	const uint8_t *ptr, *end = data + size;
+	size_t mlen, rlen, cells;
+	uint64_t time = 0, *stamps = NULL;
+	uint32_t *periods;
+	msrval_t *values;
+	uint8_t *due, *valid, tag, started = 0;
+	struct engine engine;
+
+	if (size < sizeof (*header))
+		error("truncated trace header");
+
+	mlen = header->mlen;
+	rlen = header->rlen;
+
+	ptr = load_description(&engine, (const uint8_t *) (header + 1), end,
+			       mlen, rlen);
+	if (header->flags & TRACE_STAMPS)
+		stamps = calloc(rlen, sizeof (uint64_t));
+	engine.stamps = stamps;
+
+	cells = engine.offsets[mlen];
+	due = calloc(mlen, sizeof (uint8_t));
+	values = calloc(cells, sizeof (msrval_t));
+	valid = calloc(cells, sizeof (uint8_t));
+	periods = calloc(mlen, sizeof (uint32_t));
+	if (!due || !values || !valid || !periods)
+		error("cannot allocate trace buffers");
+
+	if (from)
+		ptr = seek_keyframe(&engine, ptr, end, due, stamps, values,
+				    valid, periods);
+
+	print_header(stdout, &engine);
+
+	while (ptr < end) {
+		if ((size_t) (end - ptr) >= sizeof (TRACE_KEYFRAME_MARK)
+		    && !memcmp(ptr, TRACE_KEYFRAME_MARK,
+			       sizeof (TRACE_KEYFRAME_MARK)))
+			ptr += sizeof (TRACE_KEYFRAME_MARK);
+		if (ptr >= end)
+			break;
+
+		tag = *ptr++;
+		if (tag != TRACE_KEYFRAME && !started)
+			error("trace does not start with a keyframe");
+		if (tag != TRACE_KEYFRAME && tag != TRACE_DELTA
+		    && tag != TRACE_DELTA_DUE)
+			error("invalid frame tag: 0x%x", tag);
+		started = 1;
+
+		ptr = decode_frame(&engine, ptr, end, tag, &time, due, stamps,
+				   values, valid, periods);
+		if (!ptr)
+			break;
+
+		if (time >= from)
+			print_line(stdout, &engine, time, due, stamps,
+				   values, valid, periods);
+	}
+
+	free(due);
+	free(values);
+	free(valid);
+	free(periods);
+	free(stamps);
+}
+
+
+int main(int argc, char *const *argv)
+{
+	const uint8_t *data;
+	struct stat st;
+	char *err;
+	int c, fd;
+
+	program = argv[0];
+
+	while ((c = getopt_long(argc, argv, options_string, options, NULL))
+	       != -1) {
+		switch (c) {
+		case 'h':
+			usage();
+			return EXIT_SUCCESS;
+		case 'V':
+			version();
+			return EXIT_SUCCESS;
+		case 'f':
+			from = strtol(optarg, &err, 10);
+			if (*err)
+				error("invalid time: '%s'", optarg);
+			break;
+		default:
+			fprintf(stderr, "please type '%s --help' for more "
+				"informations\n", program);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (optind != argc - 1)
+		error("expected one file to decode");
+
+	fd = open(argv[optind], O_RDONLY);
+	if (fd < 0 || fstat(fd, &st))
+		error("cannot open file: '%s'", argv[optind]);
+	if (st.st_size < 8)
+		error("invalid file: '%s'", argv[optind]);
+
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED)
+		error("cannot map file: '%s'", argv[optind]);
+
+	if (!memcmp(data, TRACE_MAGIC, 8))
+		decode_trace(data, st.st_size);
+	else if (!memcmp(data, RECORDER_MAGIC, 8))
+		decode_recorder(data, st.st_size);
+	else
+		error("unknown file format: '%s'", argv[optind]);
+
+	munmap((void *) data, st.st_size);
+	return EXIT_SUCCESS;
+}
@@ -35,6 +35,50 @@
 #define HYPERCALL_BIGOS_RDMSR    -2
 #define HYPERCALL_BIGOS_WRMSR    -3
 
+#define DEFAULT_GROUP_SIZE    256
+
+
+/*
+ * Scratch arrays used to group the accesses of a batch by address, with room
+ * for group_size accesses.
+ */
+static size_t    *group_idx = NULL;
+
+static uint64_t  *group_buf = NULL;
+
+static size_t     group_size = 0;
+
+
+static const msradr_t  *sort_addrs;
+
+static const msrval_t  *sort_vals;
+
+
+/*
+ * Make room in the scratch arrays for len accesses.
+ * Return 0 in case of success, -1 otherwise.
+ */
+static int8_t grow_groups(size_t len)
+{
+	size_t *idx;
+	uint64_t *buf;
+
+	if (len <= group_size)
+		return 0;
+
+	idx = realloc(group_idx, len * sizeof (size_t));
+	if (!idx)
+		return -1;
+	group_idx = idx;
+
+	buf = realloc(group_buf, len * sizeof (uint64_t));
+	if (!buf)
+		return -1;
+	group_buf = buf;
+
+	group_size = len;
+	return 0;
+}
 
 int8_t init(const char *sysname)
 {
@@ -46,11 +90,16 @@ int8_t init(const char *sysname)
 		return -1;
 	}
 	
-	return 0;
+	return grow_groups(DEFAULT_GROUP_SIZE);
 }
 
 int8_t destroy(void)
 {
+	free(group_idx);
+	free(group_buf);
+	group_idx = NULL;
+	group_buf = NULL;
+	group_size = 0;
 	return 0;
 }
 
@@ -212,36 +261,83 @@ static void hypercall_rdmsr(uint64_t addr, uint64_t *cores, size_t len)
 }
 
 
-size_t rdmsr_arr(msrval_t *vals, const msradr_t *addrs, const uint8_t *cores,
-		 size_t len)
+static int compare_accesses(const void *a, const void *b)
 {
-	size_t i, j, done = 0;
-	size_t start, num = 0;
+	size_t ia = *(const size_t *) a, ib = *(const size_t *) b;
 
-	for (i=0; i<len; i++) {
-		if (num == 0) {
-			num = 1;
-			start = i;
-		} else if (addrs[i] == addrs[start]) {
-			num++;
-		} else {
-			for (j=start; j<i; j++)
-				vals[j] = (uint64_t) cores[j];
-			hypercall_rdmsr(addrs[start], vals + start, num);
-			done += num;
-			
-			num = 1;
-			start = i;
-		}
+	if (sort_addrs[ia] != sort_addrs[ib])
+		return sort_addrs[ia] < sort_addrs[ib] ? -1 : 1;
+	if (sort_vals && sort_vals[ia] != sort_vals[ib])
+		return sort_vals[ia] < sort_vals[ib] ? -1 : 1;
+	return (ia > ib) - (ia < ib);
+}
+
+/*
+ * Store in group_idx the indexes of the len accesses sorted by address, then
+ * by value if vals is not NULL, so that the accesses a hypercall can perform
+ * together are contiguous and keep the order of the batch.
+ * The engine sends its batches ordered core after core, so equal addresses
+ * are rarely consecutive while a hypercall accesses one address on many
+ * cores.
+ * Return 0 in case of success, -1 otherwise.
+ */
+static int8_t sort_groups(const msradr_t *addrs, const msrval_t *vals,
+			  size_t len)
+{
+	size_t i;
+
+	if (grow_groups(len))
+		return -1;
+
+	for (i=0; i<len; i++)
+		group_idx[i] = i;
+
+	sort_addrs = addrs;
+	sort_vals = vals;
+	qsort(group_idx, len, sizeof (size_t), compare_accesses);
+	return 0;
+}
+
+/*
+ * Return the number of accesses of the group starting at the position first
+ * of group_idx, with the same address, and the same value if vals is not
+ * NULL.
+ */
+static size_t group_length(const msradr_t *addrs, const msrval_t *vals,
+			   size_t first, size_t len)
+{
+	size_t i, f = group_idx[first];
+
+	for (i=first + 1; i<len; i++) {
+		if (addrs[group_idx[i]] != addrs[f])
+			break;
+		if (vals && vals[group_idx[i]] != vals[f])
+			break;
 	}
 
-	if (num) {
-		for (j=start; j<i; j++)
-			vals[j] = (uint64_t) cores[j];
-		hypercall_rdmsr(addrs[start], vals + start, num);
+	return i - first;
+}
+
+size_t rdmsr_arr(msrval_t *vals, const msradr_t *addrs, const uint8_t *cores,
+		 size_t len)
+{
+	size_t i, k, num, done = 0;
+	const size_t *idx;
+
+	if (sort_groups(addrs, NULL, len))
+		return 0;
+
+	for (i=0; i<len; i+=num) {
+		idx = group_idx + i;
+		num = group_length(addrs, NULL, i, len);
+		for (k=0; k<num; k++)
+			group_buf[k] = (uint64_t) cores[idx[k]];
+		hypercall_rdmsr(addrs[idx[0]], group_buf, num);
+		for (k=0; k<num; k++)
+			vals[idx[k]] = group_buf[k];
 		done += num;
 	}
-	
+
 	return done;
 }
 	
@@ -261,35 +357,24 @@ size_t wrmsr_arr(const msradr_t *addrs, const msrval_t *vals,
 size_t rwmsr_arr(const msradr_t *addrs, msrval_t *vals, const uint8_t *cores,
 		 size_t len)
 {
-	size_t i, j, done = 0;
-	size_t start, num = 0;
-	uint64_t val;
-
-	for (i=0; i<len; i++) {
-		if (num == 0) {
-			num = 1;
-			start = i;
-		} else if (addrs[i] == addrs[start]) {
-			num++;
-		} else {
-			val = vals[start];
-			for (j=start; j<i; j++)
-				vals[j] = (uint64_t) cores[j];
-			hypercall_wrmsr(addrs[start], val, vals + start, num);
-			done += num;
-			
-			num = 1;
-			start = i;
-		}
-	}
-
-	if (num) {
-		val = vals[start];
-		for (j=start; j<i; j++)
-			vals[j] = (uint64_t) cores[j];
-		hypercall_wrmsr(addrs[start], val, vals + start, num);
+	size_t i, k, num, done = 0;
+	const size_t *idx;
+	msrval_t val;
+
+	if (sort_groups(addrs, vals, len))
+		return 0;
+
+	for (i=0; i<len; i+=num) {
+		idx = group_idx + i;
+		num = group_length(addrs, vals, i, len);
+		val = vals[idx[0]];
+		for (k=0; k<num; k++)
+			group_buf[k] = (uint64_t) cores[idx[k]];
+		hypercall_wrmsr(addrs[idx[0]], val, group_buf, num);
+		for (k=0; k<num; k++)
+			vals[idx[k]] = group_buf[k];
 		done += num;
 	}
-	
+
 	return done;
 }